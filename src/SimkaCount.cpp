@@ -20,6 +20,9 @@
 
 #include "SimkaPotara.hpp"
 #include "minikc/MiniKC.hpp"
+#include "SimkaPartitionPack.hpp"
+#include "SimkaReadCache.hpp"
+#include "SimkaInputReader.hpp"
 //#include <gatb/gatb_core.hpp>
 
 // We use the required packages
@@ -87,9 +90,15 @@ public:
         getParser()->push_back (new OptionOneParam ("-bank-index",   "bank name", true));
         getParser()->push_back (new OptionOneParam (STR_SIMKA_MIN_READ_SIZE,   "bank name", true));
         getParser()->push_back (new OptionOneParam (STR_SIMKA_MIN_READ_SHANNON_INDEX,   "bank name", true));
+        getParser()->push_back (new OptionOneParam (STR_SIMKA_MIN_KMER_SHANNON_INDEX,   "bank name", false, "0"));
+        getParser()->push_back (new OptionNoParam (STR_SIMKA_SINGLETON_FILTER,   "filter out kmers seen one time", false));
+        getParser()->push_back (new OptionOneParam (STR_SIMKA_SCALED,   "kmer subsampling factor", false, "1"));
         getParser()->push_back (new OptionOneParam (STR_SIMKA_MAX_READS,   "bank name", true));
         getParser()->push_back (new OptionOneParam ("-nb-datasets",   "bank name", true));
         getParser()->push_back (new OptionOneParam ("-nb-partitions",   "bank name", true));
+        getParser()->push_back (new OptionOneParam (STR_SIMKA_COUNT_CACHE,   "count cache dir", false, ""));
+        getParser()->push_back (new OptionOneParam ("-count-cache-key",   "file containing the key of the dataset in the count cache", false, ""));
+        getParser()->push_back (new OptionOneParam (STR_SIMKA_READ_CACHE,   "dir of the reads shared by the runs of several kmer sizes", false, ""));
         //getParser()->push_back (new OptionOneParam ("-nb-cores",   "bank name", true));
         //getParser()->push_back (new OptionOneParam ("-max-memory",   "bank name", true));
 
@@ -110,13 +119,20 @@ public:
     	size_t bankIndex =  getInput()->getInt("-bank-index");
     	size_t minReadSize =  getInput()->getInt(STR_SIMKA_MIN_READ_SIZE);
     	double minReadShannonIndex =  getInput()->getDouble(STR_SIMKA_MIN_READ_SHANNON_INDEX);
+    	double minKmerShannonIndex =  getInput()->getDouble(STR_SIMKA_MIN_KMER_SHANNON_INDEX);
+    	bool singletonFilter =  getInput()->get(STR_SIMKA_SINGLETON_FILTER) != 0;
+    	u_int64_t scaled =  getInput()->getInt(STR_SIMKA_SCALED);
     	u_int64_t maxReads =  getInput()->getInt(STR_SIMKA_MAX_READS);
     	size_t nbDatasets =   getInput()->getInt("-nb-datasets");
     	size_t nbPartitions =   getInput()->getInt("-nb-partitions");
     	CountNumber abundanceMin =   getInput()->getInt(STR_KMER_ABUNDANCE_MIN);
     	CountNumber abundanceMax =   getInput()->getInt(STR_KMER_ABUNDANCE_MAX);
+    	u_int64_t maxMemory =   getInput()->getInt(STR_MAX_MEMORY);
+    	string countCacheDir =   getInput()->getStr(STR_SIMKA_COUNT_CACHE);
+    	string countCacheKeyFilename =   getInput()->getStr("-count-cache-key");
+    	string readCacheDir =   getInput()->getStr(STR_SIMKA_READ_CACHE);
 
-    	Parameter params(*this, kmerSize, outputDir, bankName, minReadSize, minReadShannonIndex, maxReads, nbDatasets, nbPartitions, abundanceMin, abundanceMax, bankIndex);
+    	Parameter params(*this, kmerSize, outputDir, bankName, minReadSize, minReadShannonIndex, minKmerShannonIndex, scaled, singletonFilter, maxMemory, maxReads, nbDatasets, nbPartitions, abundanceMin, abundanceMax, bankIndex, countCacheDir, countCacheKeyFilename, readCacheDir);
 
         Integer::apply<Functor,Parameter> (kmerSize, params);
 
@@ -154,8 +170,8 @@ public:
 
     struct Parameter
     {
-        Parameter (SimkaCount& tool, size_t kmerSize, string outputDir, string bankName, size_t minReadSize, double minReadShannonIndex, u_int64_t maxReads, size_t nbDatasets, size_t nbPartitions, CountNumber abundanceMin, CountNumber abundanceMax, size_t bankIndex) :
-        	tool(tool), kmerSize(kmerSize), outputDir(outputDir), bankName(bankName), minReadSize(minReadSize), minReadShannonIndex(minReadShannonIndex), maxReads(maxReads), nbDatasets(nbDatasets), nbPartitions(nbPartitions), abundanceMin(abundanceMin), abundanceMax(abundanceMax), bankIndex(bankIndex)  {}
+        Parameter (SimkaCount& tool, size_t kmerSize, string outputDir, string bankName, size_t minReadSize, double minReadShannonIndex, double minKmerShannonIndex, u_int64_t scaled, bool singletonFilter, u_int64_t maxMemory, u_int64_t maxReads, size_t nbDatasets, size_t nbPartitions, CountNumber abundanceMin, CountNumber abundanceMax, size_t bankIndex, string countCacheDir, string countCacheKeyFilename, string readCacheDir) :
+        	tool(tool), kmerSize(kmerSize), outputDir(outputDir), bankName(bankName), minReadSize(minReadSize), minReadShannonIndex(minReadShannonIndex), minKmerShannonIndex(minKmerShannonIndex), scaled(scaled), singletonFilter(singletonFilter), maxMemory(maxMemory), maxReads(maxReads), nbDatasets(nbDatasets), nbPartitions(nbPartitions), abundanceMin(abundanceMin), abundanceMax(abundanceMax), bankIndex(bankIndex), countCacheDir(countCacheDir), countCacheKeyFilename(countCacheKeyFilename), readCacheDir(readCacheDir)  {}
         SimkaCount& tool;
         //size_t datasetId;
         size_t kmerSize;
@@ -163,12 +179,19 @@ public:
         string bankName;
         size_t minReadSize;
         double minReadShannonIndex;
+        double minKmerShannonIndex;
+        u_int64_t scaled;
+        bool singletonFilter;
+        u_int64_t maxMemory;
         u_int64_t maxReads;
         size_t nbDatasets;
         size_t nbPartitions;
         CountNumber abundanceMin;
         CountNumber abundanceMax;
         size_t bankIndex;
+        string countCacheDir;
+        string countCacheKeyFilename;
+        string readCacheDir;
     };
 
     template<size_t span> struct Functor  {
@@ -185,7 +208,9 @@ public:
 
 
 
-			IBank* bank = Bank::open(p.outputDir + "/input/" + p.bankName);
+			//Input files are decompressed by background threads (BGZF blocks in parallel), in parallel with the counting
+			size_t nbInputThreads = max(props->getInt(STR_NB_CORES)/2, (int64_t)1);
+			IBank* bank = new SimkaBankFastx(p.outputDir + "/input/" + p.bankName, nbInputThreads);
 			LOCAL(bank);
 
 			/*
@@ -245,15 +270,17 @@ public:
 
 				//string outputDir = p.outputDir + "/solid/" + p.bankName;
 				//System::file().mkdir(outputDir, -1);
-				vector<Bag<Kmer_BankId_Count>* > bags;
+
+				//All the partitions of the dataset go in a single packed file (see SimkaPartitionPack.hpp)
+				string packFilename = p.outputDir + "/solid/__p__" + Stringify::format("%i", p.bankIndex) + ".pack";
+				//The chunks are compressed by the writer threads
+				size_t nbWriterThreads = max((size_t)props->getInt(STR_NB_CORES)/2, (size_t)SIMKA_PACK_WRITER_THREADS);
+				SimkaPartitionPackWriter<Kmer_BankId_Count> packWriter(packFilename + ".temp", p.nbPartitions, nbWriterThreads);
+
 				vector<Bag<Kmer_BankId_Count>* > cachedBags;
 		    	for(size_t i=0; i<p.nbPartitions; i++){
-					string outputFilename = p.outputDir + "/solid/part_" + Stringify::format("%i", i) + "/__p__" + Stringify::format("%i", p.bankIndex) + ".gz";
-					Bag<Kmer_BankId_Count>* bag = new BagGzFile<Kmer_BankId_Count>(outputFilename);
-					Bag<Kmer_BankId_Count>* cachedBag = new BagCache<Kmer_BankId_Count>(bag, 10000);
+					Bag<Kmer_BankId_Count>* cachedBag = new BagPartitionPack<Kmer_BankId_Count>(packWriter, i, 10000);
 					cachedBags.push_back(cachedBag);
-					//BagCache bagCache(*bag, 10000);
-		        	bags.push_back(bag);
 		    	}
 
 
@@ -276,12 +303,37 @@ public:
 				//solidStorage = StorageFactory(STORAGE_HDF5).create (solidsName, true, autoDelete);
 				//LOCAL(solidStorage);
 
-				SimkaCompressedProcessor<span>* proc = new SimkaCompressedProcessor<span>(cachedBags, nbKmerPerParts, nbDistinctKmerPerParts, chordNiPerParts, p.abundanceMin, p.abundanceMax, p.bankIndex);
+				//The counting uses 2/3 of the job memory (see SimkaPotaraAlgorithm::createConfig), the Bloom filter of the singleton filter uses the remaining third
+				IBank* countedBank = filteredBank;
+
+				//Several passes: the passes after the first one read the filtered reads from a packed spill file
+				//Several kmer sizes: the spill file of the first kmer size is used by the other ones
+				SimkaReadCacheBank* readCacheBank = 0;
+				string readCacheFilename = p.readCacheDir + "/" + p.bankName + ".reads";
+				if(p.readCacheDir != "" && System::file().doesExist(readCacheFilename)){
+					readCacheBank = new SimkaReadCacheBank(filteredBank, readCacheFilename, true);
+					countedBank = readCacheBank;
+				}
+				else if(p.readCacheDir != "" || config._nb_passes > 1){
+					readCacheBank = new SimkaReadCacheBank(filteredBank, tempDir + "/reads.cache");
+					countedBank = readCacheBank;
+				}
+
+				SimkaSingletonFilterBank<span>* singletonFilterBank = 0;
+				if(p.singletonFilter){
+					u_int64_t bloomBits = max((p.maxMemory/3) * MBYTE * 8, (u_int64_t) 10000);
+					singletonFilterBank = new SimkaSingletonFilterBank<span>(countedBank, p.kmerSize, bloomBits);
+					countedBank = singletonFilterBank;
+				}
+				LOCAL(countedBank);
+
+				SimkaKmerFilter<span> kmerFilter(p.kmerSize, p.minKmerShannonIndex, p.scaled);
+				SimkaCompressedProcessor<span>* proc = new SimkaCompressedProcessor<span>(cachedBags, nbKmerPerParts, nbDistinctKmerPerParts, chordNiPerParts, p.abundanceMin, p.abundanceMax, p.bankIndex, kmerFilter, p.singletonFilter);
 
 				u_int64_t nbReads = 0;
 
 				if(p.kmerSize <= 15){
-					MiniKC<span> miniKc(p.tool.getInput(), p.kmerSize, filteredBank, *repartitor, proc);
+					MiniKC<span> miniKc(p.tool.getInput(), p.kmerSize, countedBank, *repartitor, proc);
 					miniKc.execute();
 
 					nbReads = miniKc._nbReads;
@@ -290,7 +342,7 @@ public:
 					//SimkaCompressedProcessor<span>* proc = new SimkaCompressedProcessor<span>(bags, caches, cacheIndexes, p.abundanceMin, p.abundanceMax);
 					std::vector<ICountProcessor<span>* > procs;
 					procs.push_back(proc);
-					SortingCountAlgorithm<span> algo (filteredBank, config, repartitor,
+					SortingCountAlgorithm<span> algo (countedBank, config, repartitor,
 							procs,
 							props);
 
@@ -299,6 +351,9 @@ public:
 					nbReads = algo.getInfo()->getInt("seq_number");
 				}
 
+				//The counters see the fragments of the reads, not the reads
+				if(singletonFilterBank) nbReads = singletonFilterBank->getNbReads();
+
 
 				u_int64_t nbDistinctKmers = 0;
 				u_int64_t nbKmers = 0;
@@ -323,6 +378,8 @@ public:
 				system(command.c_str());
 #endif
 
+				if(readCacheBank && p.readCacheDir != "") readCacheBank->save(readCacheFilename);
+				if(readCacheBank) readCacheBank->remove();
 				System::file().rmdir(tempDir);
 
 		    	for(size_t i=0; i<p.nbPartitions; i++){
@@ -332,6 +389,9 @@ public:
 		    		//delete bags[i];
 		    	}
 
+		    	packWriter.close();
+		    	System::file().rename(packFilename + ".temp", packFilename);
+
 		    	//delete proc;
 			}
 
@@ -339,10 +399,20 @@ public:
 			for(size_t i=0; i<nbDistinctKmerPerParts.size(); i++){
 				contents += Stringify::format("%llu", nbDistinctKmerPerParts[i]) + "\n";
 			}
-			IFile* nbKmerPerPartFile = System::file().newFile(p.outputDir + "/kmercount_per_partition/" + p.bankName + ".txt", "w");
+			//Renamed rather than rewritten, the previous file may be a hard link to an entry of the count cache
+			string kmerCountFilename = p.outputDir + "/kmercount_per_partition/" + p.bankName + ".txt";
+			IFile* nbKmerPerPartFile = System::file().newFile(kmerCountFilename + ".temp", "w");
 			nbKmerPerPartFile->fwrite(contents.c_str(), contents.size(), 1);
 			nbKmerPerPartFile->flush();
 			delete nbKmerPerPartFile;
+			System::file().rename(kmerCountFilename + ".temp", kmerCountFilename);
+
+			//Stored before the finish signal, simka evicts old entries of the cache once all the datasets are counted
+			if(p.countCacheDir != ""){
+				string key = SimkaCountCache::readKey(p.countCacheKeyFilename);
+				string packFilename = p.outputDir + "/solid/__p__" + Stringify::format("%i", p.bankIndex) + ".pack";
+				SimkaCountCache::store(p.countCacheDir, key, packFilename, kmerCountFilename, getFinishContents(outInfo));
+			}
 
 
 			//cout << "heo" << endl;
@@ -354,17 +424,24 @@ public:
 
 		void writeFinishSignal(Parameter& p, const vector<string>& outInfo){
 
+			//Same as the kmer counts, the previous finish file may be linked to the count cache
 			string finishFilename = p.outputDir + "/count_synchro/" +  p.bankName + ".ok";
-			IFile* file = System::file().newFile(finishFilename, "w");
-			string contents = "";
+			IFile* file = System::file().newFile(finishFilename + ".temp", "w");
+			string contents = getFinishContents(outInfo);
 
-			for(size_t i=0; i<outInfo.size(); i++){
-				contents += outInfo[i] + "\n";
-			}
 			file->fwrite(contents.c_str(), contents.size(), 1);
 			file->flush();
 
 			delete file;
+			System::file().rename(finishFilename + ".temp", finishFilename);
+		}
+
+		string getFinishContents(const vector<string>& outInfo){
+			string contents = "";
+			for(size_t i=0; i<outInfo.size(); i++){
+				contents += outInfo[i] + "\n";
+			}
+			return contents;
 		}
 
 
@@ -22,6 +22,12 @@
 #include <gatb/gatb_core.hpp>
 #include <SimkaAlgorithm.hpp>
 #include <SimkaDistance.hpp>
+#include <SimkaPartitionPack.hpp>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <condition_variable>
+#include <sys/resource.h>
 
 // We use the required packages
 using namespace std;
@@ -33,7 +39,12 @@ using namespace gatb::core::system::impl;
 
 
 #define MERGE_BUFFER_SIZE 1000
+#define SIMKA_MERGE_BATCHES_PER_THREAD 2
 #define SIMKA_MERGE_MAX_FILE_USED 200
+#define SIMKA_MERGE_RESERVED_FILES 64
+#define SIMKA_MERGE_CHUNK_NB_ITEMS 10000
+#define SIMKA_MERGE_MAX_PENDING_CHUNKS 4
+#define SIMKA_MERGE_PREFETCH_MEMORY (256*MBYTE)
 
 
 
@@ -84,8 +95,64 @@ u_int64_t getFileSize(const string& filename){
 
 
 
+
+
+
+
+
+
+
+
+
+
+
+
+
+struct Parameter
+{
+    Parameter (IProperties* props, string inputFilename, string outputDir, size_t partitionId, size_t kmerSize, double minShannonIndex, bool computeSimpleDistances, bool computeComplexDistances, size_t nbCores, size_t nbPreviousBanks, u_int64_t maxMemory, size_t maxFanIn) : props(props), inputFilename(inputFilename), outputDir(outputDir), partitionId(partitionId), kmerSize(kmerSize), minShannonIndex(minShannonIndex), computeSimpleDistances(computeSimpleDistances), computeComplexDistances(computeComplexDistances), nbCores(nbCores), nbPreviousBanks(nbPreviousBanks), maxMemory(maxMemory), maxFanIn(maxFanIn) {}
+    IProperties* props;
+    string inputFilename;
+    string outputDir;
+    size_t partitionId;
+    size_t kmerSize;
+    double minShannonIndex;
+    bool computeSimpleDistances;
+    bool computeComplexDistances;
+    size_t nbCores;
+    size_t nbPreviousBanks;
+    u_int64_t maxMemory;
+    size_t maxFanIn;
+};
+
+
+/*
+ * Kmers of a partition waiting for the distance computation, with their sparse counts. The count
+ * vectors keep their capacity, batches are recycled between the merge thread and the distance threads.
+ */
 template<size_t span>
-class DistanceCommand : public gatb::core::tools::dp::ICommand //, public gatb::core::system::SmartPointer
+struct DistanceBatch
+{
+	typedef typename Kmer<span>::Type           Type;
+
+	vector<Type> _kmers;
+	vector<SparseCountVector> _counts;
+	size_t _size;
+
+	DistanceBatch(size_t capacity) : _kmers(capacity), _counts(capacity), _size(0) {}
+
+	bool isFull(){
+		return _size >= _kmers.size();
+	}
+};
+
+
+/*
+ * Distance accumulation of a thread, in its own statistics. The counts of the datasets are copied from
+ * the statistics of the partition.
+ */
+template<size_t span>
+class DistanceCommand
 {
 public:
 
@@ -93,37 +160,26 @@ public:
     typedef typename Kmer<span>::Type           Type;
     typedef typename Kmer<span>::Count          Count;
 
-
-    size_t _bufferIndex;
 	size_t _partitionId;
 	SimkaStatistics* _stats;
 	SimkaCountProcessorSimple<span>* _processor;
 
-	vector<Type> _bufferKmers;
-	vector<CountVector> _bufferCounts;
-
     /** Constructor. */
     DistanceCommand (
-    		const string& tmpDir,
-			const vector<string>& datasetIds,
+    		const SimkaStatistics& partitionStats,
     		size_t partitionId,
-    		size_t nbBanks,
-			bool computeSimpleDistances,
-			bool computeComplexDistances,
 			size_t kmerSize,
 			pair<size_t, size_t>& abundanceThreshold,
-			float minShannonIndex
+			float minShannonIndex,
+			size_t firstNewBank
     )
 	{
     	_partitionId = partitionId;
-		_stats = new SimkaStatistics(nbBanks, computeSimpleDistances, computeComplexDistances, tmpDir, datasetIds);
-
-		_processor = new SimkaCountProcessorSimple<span> (_stats, nbBanks, kmerSize, abundanceThreshold, SUM, false, minShannonIndex);
+		_stats = new SimkaStatistics(partitionStats._nbBanks, partitionStats._computeSimpleDistances, partitionStats._computeComplexDistances);
+		_stats->copyDatasets(partitionStats);
 
-		_bufferKmers.resize(MERGE_BUFFER_SIZE);
-		_bufferCounts.resize(MERGE_BUFFER_SIZE);
-
-		_bufferIndex = 0;
+		_processor = new SimkaCountProcessorSimple<span> (_stats, partitionStats._nbBanks, kmerSize, abundanceThreshold, SUM, false, minShannonIndex);
+		_processor->setFirstNewBank(firstNewBank);
     }
 
 	~DistanceCommand(){
@@ -131,54 +187,144 @@ public:
 		delete _stats;
 	}
 
-    //void add(Type& kmer, CountVector& counts){
-    //	_bufferIndex +=
-    //}
-    void setup(size_t bufferIndex, vector<Type>& bufferKmers, vector<CountVector>& bufferCounts){
-
-    	//cout << "hey  " << bufferIndex << endl;
-    	_bufferIndex = bufferIndex;
-
-    	for(size_t i=0; i<_bufferIndex; i++){
-    		_bufferKmers[i] = bufferKmers[i];
-    		_bufferCounts[i] = bufferCounts[i];
+    void execute (DistanceBatch<span>& batch){
+    	for(size_t i=0; i<batch._size; i++){
+    		_processor->process(_partitionId, batch._kmers[i], batch._counts[i]);
     	}
     }
+};
 
-    void execute (){
-    	for(size_t i=0; i<_bufferIndex; i++){
-    		_processor->process(_partitionId, _bufferKmers[i], _bufferCounts[i]);
-    	}
-    }
 
-	void use () {}
-	void forget () {}
-};
+/*
+ * Distance accumulation of a partition merge on several threads. The merge thread fills batches of
+ * kmers and counts, the distance threads process them in their own statistics, which are summed in
+ * the statistics of the partition at the end. The number of batches is bounded, the merge thread waits
+ * for a processed batch when they are all in use. With one core, the kmers are processed by the merge
+ * thread.
+ */
+template<size_t span>
+class DistanceDispatcher
+{
+public:
+
+    typedef typename Kmer<span>::Type           Type;
+
+	DistanceDispatcher(Parameter& p, const SimkaStatistics& partitionStats, size_t nbThreads, pair<size_t, size_t>& abundanceThreshold) :
+		_nbThreads(max((size_t)1, nbThreads)), _currentBatch(0), _isDone(false)
+	{
+		size_t firstNewBank = p.nbPreviousBanks;
+
+		for(size_t i=0; i<_nbThreads; i++){
+			_cmds.push_back(new DistanceCommand<span>(partitionStats, p.partitionId, p.kmerSize, abundanceThreshold, p.minShannonIndex, firstNewBank));
+		}
+
+		size_t nbBatches = _nbThreads == 1 ? 1 : _nbThreads*SIMKA_MERGE_BATCHES_PER_THREAD;
+
+		for(size_t i=0; i<nbBatches; i++){
+			_batches.push_back(new DistanceBatch<span>(MERGE_BUFFER_SIZE));
+			_freeBatches.push_back(_batches[i]);
+		}
 
+		_currentBatch = _freeBatches.front();
+		_freeBatches.pop_front();
 
+		if(_nbThreads == 1) return;
+		for(size_t i=0; i<_nbThreads; i++){
+			_threads.push_back(std::thread(&DistanceDispatcher::run, this, _cmds[i]));
+		}
+	}
 
+	~DistanceDispatcher(){
+		stop();
+		for(size_t i=0; i<_cmds.size(); i++) delete _cmds[i];
+		for(size_t i=0; i<_batches.size(); i++) delete _batches[i];
+	}
 
+	void process(const Type& kmer, const SparseCountVector& counts){
 
+		_currentBatch->_kmers[_currentBatch->_size] = kmer;
+		_currentBatch->_counts[_currentBatch->_size].assign(counts.begin(), counts.end());
+		_currentBatch->_size += 1;
 
+		if(_currentBatch->isFull()) dispatch();
+	}
 
+	//Processes the remaining kmers and adds the statistics of the threads to stats
+	void end(SimkaStatistics& stats){
 
+		if(_currentBatch->_size > 0) dispatch();
+		stop();
 
+		for(size_t i=0; i<_cmds.size(); i++){
+			_cmds[i]->_processor->end();
+			stats += *_cmds[i]->_stats;
+		}
+	}
 
+private:
 
+	void dispatch(){
 
+		if(_nbThreads == 1){
+			_cmds[0]->execute(*_currentBatch);
+			_currentBatch->_size = 0;
+			return;
+		}
 
-struct Parameter
-{
-    Parameter (IProperties* props, string inputFilename, string outputDir, size_t partitionId, size_t kmerSize, double minShannonIndex, bool computeSimpleDistances, bool computeComplexDistances, size_t nbCores) : props(props), inputFilename(inputFilename), outputDir(outputDir), partitionId(partitionId), kmerSize(kmerSize), minShannonIndex(minShannonIndex), computeSimpleDistances(computeSimpleDistances), computeComplexDistances(computeComplexDistances), nbCores(nbCores) {}
-    IProperties* props;
-    string inputFilename;
-    string outputDir;
-    size_t partitionId;
-    size_t kmerSize;
-    double minShannonIndex;
-    bool computeSimpleDistances;
-    bool computeComplexDistances;
-    size_t nbCores;
+		std::unique_lock<std::mutex> lock(_mutex);
+		_fullBatches.push_back(_currentBatch);
+		_fullCondition.notify_one();
+
+		_freeCondition.wait(lock, [this]{ return !_freeBatches.empty(); });
+		_currentBatch = _freeBatches.front();
+		_freeBatches.pop_front();
+	}
+
+	void run(DistanceCommand<span>* cmd){
+
+		while(true){
+
+			DistanceBatch<span>* batch;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_fullCondition.wait(lock, [this]{ return _isDone || !_fullBatches.empty(); });
+				if(_fullBatches.empty()) return;
+				batch = _fullBatches.front();
+				_fullBatches.pop_front();
+			}
+
+			cmd->execute(*batch);
+			batch->_size = 0;
+
+			std::lock_guard<std::mutex> lock(_mutex);
+			_freeBatches.push_back(batch);
+			_freeCondition.notify_one();
+		}
+	}
+
+	//The threads process the remaining batches before exiting
+	void stop(){
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_isDone = true;
+			_fullCondition.notify_all();
+		}
+		for(size_t i=0; i<_threads.size(); i++) _threads[i].join();
+		_threads.clear();
+	}
+
+	size_t _nbThreads;
+	vector<DistanceCommand<span>*> _cmds;
+	vector<DistanceBatch<span>*> _batches;
+	DistanceBatch<span>* _currentBatch;
+
+	std::mutex _mutex;
+	std::condition_variable _fullCondition;
+	std::condition_variable _freeCondition;
+	deque<DistanceBatch<span>*> _fullBatches;
+	deque<DistanceBatch<span>*> _freeBatches;
+	vector<std::thread> _threads;
+	bool _isDone;
 };
 
 
@@ -212,11 +358,12 @@ public:
     //typedef typename Kmer<span>::ModelCanonical                             ModelCanonical;
     //typedef typename ModelCanonical::Kmer                                   KmerType;
 
-    StorageIt(Iterator<Kmer_BankId_Count>* it, size_t bankId, size_t partitionId){
+    StorageIt(Iterator<Kmer_BankId_Count>* it, size_t bankId, size_t partitionId, bool isSingleBank){
     	_it = it;
     	//cout << h5filename << endl;
     	_bankId = bankId;
     	_partitionId = partitionId;
+    	_isSingleBank = isSingleBank;
 
 
 
@@ -253,7 +400,9 @@ public:
 		return _it->item()._type;
 	}
 
+	//The bank id stored in a count file is the index of the dataset in the run which counted it (see SimkaCountCache)
 	u_int16_t getBankId(){
+		if(_isSingleBank) return _bankId;
 		return _it->item()._bankId;
 	}
 
@@ -269,370 +418,374 @@ public:
 
 	u_int16_t _bankId;
 	u_int16_t _partitionId;
+	bool _isSingleBank;
     Iterator<Kmer_BankId_Count>* _it;
     //u_int64_t _nbKmers;
 };
 
 
-class SimkaCounterBuilderMerge
+/*
+ * Range [start, end) of the kmers of a partition, a range without start or end is not bounded.
+ */
+template<size_t span>
+struct SimkaKmerRange
 {
-public:
-
-    /** Constructor.
-     * \param[in] nbBanks : number of banks parsed during kmer counting.
-     */
-	SimkaCounterBuilderMerge (CountVector& abundancePerBank)  :  _abundancePerBank(abundancePerBank)  {}
-
-    /** Get the number of banks.
-     * \return the number of banks. */
-    size_t size() const  { return _abundancePerBank.size(); }
-
-    /** Initialization of the counting for the current kmer. This method should be called
-     * when a kmer is seen for the first time.
-     * \param[in] idxBank : bank index where the new current kmer has been found. */
-    void init (size_t idxBank, CountNumber abundance)
-    {
-        for (size_t k=0; k<_abundancePerBank.size(); k++)  { _abundancePerBank[k]=0; }
-        _abundancePerBank [idxBank]= abundance;
-    }
-
-    /** Increase the abundance of the current kmer for the provided bank index.
-     * \param[in] idxBank : index of the bank */
-    void increase (size_t idxBank, CountNumber abundance)  {  _abundancePerBank [idxBank] += abundance;  }
-
-    /** Set the abundance of the current kmer for the provided bank index.
-     * \param[in] idxBank : index of the bank */
-    //void set (CountNumber val, size_t idxBank=0)  {  _abundancePerBank [idxBank] = val;  }
-
-    /** Get the abundance of the current kmer for the provided bank index.
-     * \param[in] idxBank : index of the bank
-     * \return the abundance of the current kmer for the given bank. */
-    //CountNumber operator[] (size_t idxBank) const  { return _abundancePerBank[idxBank]; }
+	typedef typename Kmer<span>::Type                                       Type;
 
-    /** */
-    //const CountVector& get () const { return _abundancePerBank; }
+	bool _hasStart;
+	Type _start;
+	bool _hasEnd;
+	Type _end;
 
-    void print(const string& kmer){
-		cout << kmer << ": ";
-    	for(size_t i=0; i<size(); i++){
-    		cout << _abundancePerBank[i] << " ";
-    	}
-    	cout << endl;
-    }
+	SimkaKmerRange() : _hasStart(false), _hasEnd(false) {}
 
-private:
-    CountVector& _abundancePerBank;
+	bool isBounded() const {
+		return _hasStart || _hasEnd;
+	}
 };
 
 
+/*
+ * Iterates the items of a sorted input which are in a range of kmers. The input is read from its
+ * first item, the items before the start of the range are skipped.
+ */
+template<size_t span>
+class IteratorKmerRange : public Iterator<typename StorageIt<span>::Kmer_BankId_Count>
+{
+public:
 
+	typedef typename StorageIt<span>::Kmer_BankId_Count Kmer_BankId_Count;
 
+	IteratorKmerRange(Iterator<Kmer_BankId_Count>* ref, const SimkaKmerRange<span>& range) : _ref(ref), _range(range)
+	{
+	}
 
+	~IteratorKmerRange(){
+		delete _ref;
+	}
 
+	void first(){
+		_ref->first();
+		while(!_ref->isDone() && _range._hasStart && _ref->item()._type < _range._start) _ref->next();
+	}
 
+	void next(){
+		_ref->next();
+	}
 
+	bool isDone(){
+		return _ref->isDone() || (_range._hasEnd && !(_ref->item()._type < _range._end));
+	}
 
+	Kmer_BankId_Count& item(){
+		return _ref->item();
+	}
 
+private:
 
+	Iterator<Kmer_BankId_Count>* _ref;
+	SimkaKmerRange<span> _range;
+};
 
 
 /*
+ * The inputs of a partition merge are the packed count files of the datasets (one per dataset,
+ * written by simkaCount), or the intermediate files written by DiskBasedMergeSort when there
+ * are too many datasets to be merged at once. An input is identified by the id of its dataset,
+ * an intermediate file takes the id of the first dataset it contains.
+ */
 template<size_t span>
-class MergeCommand : public gatb::core::tools::dp::ICommand //, public gatb::core::system::SmartPointer
+class SimkaMergeInput
 {
 public:
 
-        void use () {}
-        void forget () {}
-
-    typedef typename Kmer<span>::Type           Type;
-    typedef typename Kmer<span>::Count          Count;
-
+	typedef typename StorageIt<span>::Kmer_BankId_Count Kmer_BankId_Count;
+	typedef SimkaPackPrefetcher<Kmer_BankId_Count> Prefetcher;
 
-	typedef std::pair<u_int16_t, Type> kxp; //id pointer in vec_pointer , value
-	struct kxpcomp { bool operator() (kxp l,kxp r) { return ((r.second) < (l.second)); } } ;
+	static string getPackFilename(const string& outputDir, size_t datasetId){
+		return outputDir + "/solid/__p__" + Stringify::format("%i", datasetId) + ".pack";
+	}
 
-	size_t _currentBuffer;
-	u_int64_t _progressStep;
-	vector<vector<Type> > _bufferKmers;
-	vector<vector<CountVector> > _bufferCounts;
-	vector<size_t> _bufferIndex;
-	u_int64_t _nbDistinctKmers;
-	u_int64_t _nbSharedDistinctKmers;
+	static string getIntermediateFilename(const string& outputDir, size_t partitionId, size_t id){
+		return outputDir + "/solid/part_" + Stringify::format("%i", partitionId) + "/__p__" + Stringify::format("%i", id) + ".pack";
+	}
 
-	MergeCommand (
-    		size_t partitionId,
-    		size_t nbBanks,
-			IteratorListener* progress,
-			vector<StorageIt<span>*>& its,
-			u_int64_t progressStep,
-			size_t nbCores,
-			bool computeComplexDistances
-    ) :
-    	its(its)
-	{
-		_nbBanks = nbBanks;
-    	_partitionId = partitionId;
-    	_progress = progress;
-    	_progressStep = progressStep;
-    	_nbCores = nbCores;
-    	_computeComplexDistances = computeComplexDistances;
-    	_nbDistinctKmers = 0;
-    	_nbSharedDistinctKmers = 0;
-
-		init();
-    }
+	/*
+	 * Packed file of an input: the intermediate file, whose single partition holds several datasets,
+	 * or else the packed file of the dataset.
+	 */
+	static string getInputFilename(const string& outputDir, size_t partitionId, size_t id, size_t& packPartitionId, bool& isSingleBank){
+
+		string filename = getIntermediateFilename(outputDir, partitionId, id);
+		if(System::file().doesExist(filename)){
+			packPartitionId = 0;
+			isSingleBank = false;
+			return filename;
+		}
 
-	~MergeCommand(){
-		delete solidCounter;	
+		packPartitionId = partitionId;
+		isSingleBank = true;
+		return getPackFilename(outputDir, id);
 	}
 
-    //void add(Type& kmer, CountVector& counts){
-    //	_bufferIndex +=
-    //}
-    //void setup(vector<Type>& bufferKmers, vector<CountVector>& bufferCounts){
-    //	_bufferKmers = bufferKmers;
-    //	_bufferCounts = bufferCounts;
-    //}
+	static u_int64_t getSize(const string& outputDir, size_t partitionId, size_t id){
+		string filename = getIntermediateFilename(outputDir, partitionId, id);
+		if(System::file().doesExist(filename)) return getFileSize(filename);
 
-	size_t _nbCores;
-	size_t _partitionId;
-	size_t _nbBanks;
-	vector<StorageIt<span>*>& its;
-	std::priority_queue< kxp, vector<kxp>,kxpcomp > pq;
-	u_int64_t nbKmersProcessed;
-	IteratorListener* _progress;
-	bool _computeComplexDistances;
+		SimkaPartitionPackReader<Kmer_BankId_Count> pack(getPackFilename(outputDir, id));
+		return pack.getPartitionSize(partitionId);
+	}
 
-	u_int16_t best_p;
-	Type previous_kmer;
-    CountVector abundancePerBank;
-	size_t nbBankThatHaveKmer;
-	SimkaCounterBuilderMerge* solidCounter;
-	bool _isDone;
+	//Iterates the kmers of the range, from the last chunk whose first kmer is lower than the start of the range
+	static StorageIt<span>* create(const string& outputDir, size_t partitionId, size_t id, const SimkaKmerRange<span>& range=SimkaKmerRange<span>(), Prefetcher* prefetcher=0){
 
+		size_t packPartitionId;
+		bool isSingleBank;
+		SimkaPartitionPackReader<Kmer_BankId_Count> pack(getInputFilename(outputDir, partitionId, id, packPartitionId, isSingleBank));
 
-	void init(){
+		if(!range.isBounded()) return new StorageIt<span>(pack.iterator(packPartitionId, 0, prefetcher), id, partitionId, isSingleBank);
 
-		_isDone = false;
-		solidCounter = new SimkaCounterBuilderMerge(abundancePerBank);
-		for(size_t i=0; i<_nbCores; i++){
-			vector<Type> vec = vector<Type>(MERGE_BUFFER_SIZE);
-			_bufferKmers.push_back(vec);
-			vector<CountVector> vec2 = vector<CountVector>(MERGE_BUFFER_SIZE);
-			_bufferCounts.push_back(vec2);
-			_bufferIndex.push_back(0);
+		size_t firstChunk = 0;
+		if(range._hasStart && packPartitionId < pack.getNbPartitions()){
+			const vector<Kmer_BankId_Count>& firstItems = pack.getFirstItems(packPartitionId);
+			while(firstChunk+1 < firstItems.size() && firstItems[firstChunk+1]._type < range._start) firstChunk += 1;
 		}
 
+		return new StorageIt<span>(new IteratorKmerRange<span>(pack.iterator(packPartitionId, firstChunk, prefetcher), range), id, partitionId, isSingleBank);
+	}
 
-		nbBankThatHaveKmer = 0;
-		abundancePerBank.resize(_nbBanks, 0);
-		_currentBuffer = 0;
-		//_bufferIndex = 0;
-		//_bufferSize = 1000;
+	/*
+	 * Splits the kmers of a partition in at most nbRanges ranges of about as many items, from the first
+	 * kmers of the chunks of its inputs.
+	 */
+	static vector<SimkaKmerRange<span> > getRanges(const string& outputDir, size_t partitionId, const vector<size_t>& ids, size_t nbRanges){
 
-		nbKmersProcessed = 0;
-		//vector<Partition<Count>*> partitions;
-		//vector<Collection<Count>*> collections;
-		//vector<Iterator<Count>*> its;
-		//vector<Storage*> storages;
+		typedef typename Kmer<span>::Type Type;
 
-		//size_t nbPartitions;
+		vector<SimkaKmerRange<span> > ranges(1);
+		if(nbRanges <= 1) return ranges;
 
+		vector<pair<Type, u_int64_t> > firstKmers;
+		u_int64_t nbItems = 0;
 
+		for(size_t i=0; i<ids.size(); i++){
 
+			size_t packPartitionId;
+			bool isSingleBank;
+			SimkaPartitionPackReader<Kmer_BankId_Count> pack(getInputFilename(outputDir, partitionId, ids[i], packPartitionId, isSingleBank));
 
+			if(packPartitionId >= pack.getNbPartitions()) continue;
 
+			const vector<SimkaPackChunk>& chunks = pack.getChunks(packPartitionId);
+			const vector<Kmer_BankId_Count>& firstItems = pack.getFirstItems(packPartitionId);
+			for(size_t j=0; j<chunks.size(); j++){
+				firstKmers.push_back(pair<Type, u_int64_t>(firstItems[j]._type, chunks[j]._nbItems));
+				nbItems += chunks[j]._nbItems;
+			}
+		}
 
+		std::sort(firstKmers.begin(), firstKmers.end(), [](const pair<Type, u_int64_t>& l, const pair<Type, u_int64_t>& r){ return l.first < r.first; });
 
-		for(size_t i=0; i<_nbBanks; i++){
+		//A new range starts at the first kmer of the chunk which reaches its share of the items
+		u_int64_t nbRangeItems = 0;
+		for(size_t i=0; i<firstKmers.size() && ranges.size() < nbRanges; i++){
 
-			StorageIt<span>* it = its[i];
-			it->_it->first();
+			SimkaKmerRange<span>& range = ranges.back();
+			if(nbRangeItems > 0 && nbRangeItems >= nbItems / nbRanges && (!range._hasStart || range._start < firstKmers[i].first)){
+				range._hasEnd = true;
+				range._end = firstKmers[i].first;
 
-			//partitionIts[i]->first();
+				SimkaKmerRange<span> nextRange;
+				nextRange._hasStart = true;
+				nextRange._start = firstKmers[i].first;
+				ranges.push_back(nextRange);
+				nbRangeItems = 0;
+			}
 
-			//while(!it->_it->isDone()){
+			nbRangeItems += firstKmers[i].second;
+		}
 
-			//	it->_it->next();
-			//	cout << it->_it->item().value.toString(_kmerSize) << " " << it->_it->item().abundance << endl;
-			//}
+		return ranges;
+	}
 
+	//Packed files are shared by all the partitions, only intermediate files can be removed
+	static void remove(const string& outputDir, size_t partitionId, size_t id){
+		string filename = getIntermediateFilename(outputDir, partitionId, id);
+		if(System::file().doesExist(filename)) System::file().remove(filename);
+	}
+
+	//Intermediate files left by an interrupted merge would be counted twice
+	static void removeIntermediates(const string& outputDir, size_t partitionId){
+		string partDir = outputDir + "/solid/part_" + Stringify::format("%i", partitionId) + "/";
+		vector<string> filenames = System::file().listdir(partDir);
+		for(size_t i=0; i<filenames.size(); i++){
+			if(filenames[i].find("__p__") != std::string::npos){
+				System::file().remove(partDir + filenames[i]);
+			}
 		}
+	}
+};
 
 
+/*
+ * Counts of the merged kmer in the datasets which have it. The inputs having the kmer come in no
+ * particular order, the counts are inserted by increasing bank id.
+ */
+class SimkaCounterBuilderMerge
+{
+public:
 
-	    //fill the  priority queue with the first elems
-	    for (size_t ii=0; ii<_nbBanks; ii++)
-	    {
-	        //if(its[ii]->next())  {  pq.push(kxp(ii,its[ii]->value()));  }
-	    	pq.push(kxp(ii,its[ii]->value()));
-	    }
+    /** Constructor.
+     * \param[in] counts : sparse counts of the current kmer.
+     */
+	SimkaCounterBuilderMerge (SparseCountVector& counts)  :  _counts(counts)  {}
 
-	    if (pq.size() != 0) // everything empty, no kmer at all
-	    {
-	        //get first pointer
-	        best_p = pq.top().first ; pq.pop();
+    /** Get the number of banks which have the current kmer.
+     * \return the number of banks. */
+    size_t size() const  { return _counts.size(); }
 
-	        previous_kmer = its[best_p]->value();
+    /** Initialization of the counting for the current kmer. This method should be called
+     * when a kmer is seen for the first time.
+     * \param[in] idxBank : bank index where the new current kmer has been found. */
+    void init (size_t idxBank, CountNumber abundance)
+    {
+        _counts.clear();
+        _counts.push_back(SimkaSparseCount(idxBank, abundance));
+    }
 
-	        solidCounter->init (its[best_p]->getBankId(), its[best_p]->abundance());
-	        nbBankThatHaveKmer = 1;
-	    }
-	}
+    /** Increase the abundance of the current kmer for the provided bank index.
+     * \param[in] idxBank : index of the bank */
+    void increase (size_t idxBank, CountNumber abundance)
+    {
+        size_t i = _counts.size();
+        while(i > 0 && _counts[i-1]._bankId > idxBank) i -= 1;
 
+        if(i > 0 && _counts[i-1]._bankId == idxBank) _counts[i-1]._count += abundance;
+        else _counts.insert(_counts.begin() + i, SimkaSparseCount(idxBank, abundance));
+    }
 
-	void reset(){
-		for(size_t i=0; i<_bufferIndex.size(); i++){
-			_bufferIndex[i] = 0;
-		}
-	}
+    void print(const string& kmer){
+		cout << kmer << ": ";
+    	for(size_t i=0; i<size(); i++){
+    		cout << _counts[i]._bankId << ":" << _counts[i]._count << " ";
+    	}
+    	cout << endl;
+    }
 
+private:
+    SparseCountVector& _counts;
+};
 
-    void execute (){
-
-    	//cout << "lala " << pq.size() << endl;
-
-
-
-	        //merge-scan all 'virtual' arrays and output counts
-	        while (_currentBuffer < _nbCores)
-	        {
-
-	        	//cout << _currentBuffer << endl;
-	            //go forward in this array or in new array of reaches end of this one
-	            if (! its[best_p]->next())
-	            {
-	                //reaches end of one array
-	                if(pq.size() == 0){
-	                	_isDone = true;
-	                	break;
-	                }
-
-	                //otherwise get new best
-	                best_p = pq.top().first ; pq.pop();
-	            }
-
-	            if (its[best_p]->value() != previous_kmer )
-	            {
-	                //if diff, changes to new array, get new min pointer
-	                pq.push(kxp(best_p,its[best_p]->value())); //push new val of this pointer in pq, will be counted later
-
-	                best_p = pq.top().first ; pq.pop();
-
-	                //if new best is diff, this is the end of this kmer
-	                if(its[best_p]->value()!=previous_kmer )
-	                {
-
-						nbKmersProcessed += nbBankThatHaveKmer;
-						if(nbKmersProcessed > _progressStep){
-							//cout << "queue size:   " << pq.size() << endl;
-							//cout << nbKmersProcessed << endl;
-							_progress->inc(nbKmersProcessed);
-							nbKmersProcessed = 0;
-						}
-
-						//cout << previous_kmer.toString(p.kmerSize) << endl;
-						//for(size_t i=0; i<abundancePerBank.size(); i++){
-						//	cout << abundancePerBank[i] << " ";
-						//}
-						//cout << endl;
-
-				        insert(previous_kmer, abundancePerBank, nbBankThatHaveKmer);
-						//if(nbBankThatHaveKmer > 1)
-						//	_processor->process (_partitionId, previous_kmer, abundancePerBank);
-	                    //this->insert (previous_kmer, solidCounter);
-
-	                    solidCounter->init (its[best_p]->getBankId(), its[best_p]->abundance());
-	                    nbBankThatHaveKmer = 1;
-	                    previous_kmer = its[best_p]->value();
-	                }
-	                else
-	                {
-	                    solidCounter->increase (its[best_p]->getBankId(), its[best_p]->abundance());
-	                    nbBankThatHaveKmer += 1;
-	                }
-	            }
-	            else
-	            {
-	                solidCounter->increase (its[best_p]->getBankId(), its[best_p]->abundance());
-	                nbBankThatHaveKmer += 1;
-	            }
-	        }
-
-	        if(_isDone){
-		        insert(previous_kmer, abundancePerBank, nbBankThatHaveKmer);
-	        }
-	        else{
-	        }
-
-			_currentBuffer = 0;
-			//_bufferIndex = 0;
-        	//cout << nbBankThatHaveKmer << endl;
-
-	    	//cout << previous_kmer.toString(p.kmerSize) << endl;
-	        //for(size_t i=0; i<abundancePerBank.size(); i++){
-	        //	cout << abundancePerBank[i] << " ";
-	        //}
-	        //cout << endl;
-
-	        //last elem
-	        //insert(previous_kmer, abundancePerBank, nbBankThatHaveKmer);
-	        //this->insert (previous_kmer, solidCounter);
-	   // }
-
-
-	    	//cout << "end " << endl;
-    }
 
+/*
+ * K-way merge of the sorted inputs of a partition with a tournament tree of losers: each internal node
+ * keeps the input which lost the match played there, the root winner is the input with the smallest
+ * head kmer. Advancing the winner replays only the matches on the path from its leaf to the root,
+ * one comparison per level (a priority queue needs a pop and a push, twice as many comparisons).
+ * The head kmers of the inputs are kept in an array indexed by input, an exhausted input loses
+ * every match.
+ */
+template<size_t span>
+class SimkaMergeTree
+{
+public:
 
+	typedef typename Kmer<span>::Type                                       Type;
 
+	SimkaMergeTree(vector<StorageIt<span>*>& its) :
+		_its(its), _nbInputs(its.size()), _heads(its.size()), _isDone(its.size()), _losers(its.size()), _winner(0)
+	{
+		for(size_t i=0; i<_nbInputs; i++){
+			_its[i]->_it->first();
+			load(i);
+		}
 
+		if(_nbInputs == 0) return;
 
+		//Winners of the sub trees, the leaf of input i is the node _nbInputs+i
+		vector<u_int32_t> winners(2*_nbInputs);
+		for(size_t i=0; i<_nbInputs; i++) winners[_nbInputs+i] = i;
 
-	void insert(const Type& kmer, const CountVector& counts, size_t nbBankThatHaveKmer){
+		for(size_t node=_nbInputs-1; node>0; node--){
+			u_int32_t left = winners[2*node];
+			u_int32_t right = winners[2*node+1];
+			if(isLess(right, left)){
+				winners[node] = right;
+				_losers[node] = left;
+			}
+			else{
+				winners[node] = left;
+				_losers[node] = right;
+			}
+		}
 
-		_nbDistinctKmers += 1;
+		_winner = winners[1];
+	}
 
-        if(_computeComplexDistances || nbBankThatHaveKmer > 1){
+	bool isDone(){
+		return _nbInputs == 0 || _isDone[_winner];
+	}
 
-        	if(nbBankThatHaveKmer > 1){
-        		_nbSharedDistinctKmers += 1;
-        	}
+	//Input with the smallest head kmer
+	StorageIt<span>* top(){
+		return _its[_winner];
+	}
 
-			//DistanceCommand<span>* cmd = dynamic_cast<DistanceCommand<span>*>(_cmds[_currentBuffer]);
-			//cmd->_bufferKmers[cmd->_bufferIndex] = kmer;
-			//cmd->_bufferCounts[cmd->_bufferIndex] = counts;
-        	_bufferKmers[_currentBuffer][_bufferIndex[_currentBuffer]] = kmer;
-        	_bufferCounts[_currentBuffer][_bufferIndex[_currentBuffer]] = counts;
+	const Type& value(){
+		return _heads[_winner];
+	}
+
+	void next(){
+		_its[_winner]->next();
+		load(_winner);
 
-			_bufferIndex[_currentBuffer] += 1;
-        	if(_bufferIndex[_currentBuffer] >= MERGE_BUFFER_SIZE){
-				//DistanceCommand<span>* cmd = dynamic_cast<DistanceCommand<span>*>(_cmds[_currentBuffer]);
-				//cmd->setup(_bufferKmers[_currentBuffer], _bufferCounts[_currentBuffer]);
+		u_int32_t winner = _winner;
+		for(size_t node=(_nbInputs+_winner)/2; node>0; node/=2){
+			if(isLess(_losers[node], winner)) std::swap(_losers[node], winner);
+		}
+		_winner = winner;
+	}
 
-        		_currentBuffer += 1;
-        		if(_currentBuffer >= _nbCores){
-        			//dispatch();
-        		}
-        		else{
-        			//_bufferIndex = 0;
-        		}
-        	}
-        	//_processor->process (_partitionId, kmer, counts);
-        }
+	/*
+	 * Gives the abundances of all the inputs having the smallest kmer to the counter, and moves them
+	 * to their next kmer. Returns the number of merged records.
+	 */
+	size_t nextRun(Type& kmer, SimkaCounterBuilderMerge& counter){
+
+		kmer = value();
+		counter.init(top()->getBankId(), top()->abundance());
+		size_t nbRecords = 1;
+		next();
+
+		while(!isDone() && value() == kmer){
+			counter.increase(top()->getBankId(), top()->abundance());
+			nbRecords += 1;
+			next();
+		}
 
-    	//_processor->process (_partitionId, kmer, counts);
+		return nbRecords;
+	}
 
+private:
 
-		//cout <<_partitiontId << " "<< kmer.toString(31) << endl;
-		//_processor->process (_partitionId, kmer, counter.get());
+	void load(size_t i){
+		_isDone[i] = _its[i]->_it->isDone();
+		if(!_isDone[i]) _heads[i] = _its[i]->value();
 	}
 
+	bool isLess(u_int32_t i, u_int32_t j){
+		if(_isDone[i]) return false;
+		if(_isDone[j]) return true;
+		return _heads[i] < _heads[j];
+	}
 
+	vector<StorageIt<span>*>& _its;
+	size_t _nbInputs;
+	vector<Type> _heads;
+	vector<u_int8_t> _isDone;
+	vector<u_int32_t> _losers;
+	u_int32_t _winner;
 };
-*/
-
 
 
 template<size_t span>
@@ -648,178 +801,294 @@ public:
 
 	typedef typename StorageIt<span>::Kmer_BankId_Count Kmer_BankId_Count;
 
-	struct kxp{
-		Type _type;
-		u_int32_t _bankId;
-		u_int64_t _count;
-		StorageIt<span>* _it;
-
-		kxp(){
-
-		}
-
-		kxp(Type type, u_int64_t bankId, u_int64_t count, StorageIt<span>* it){
-			_type = type;
-			_bankId = bankId;
-			_count = count;
-			_it = it;
-		}
-	};
-
-	struct kxpcomp { bool operator() (kxp& l, kxp& r) { return (r._type < l._type); } } ;
-
 	string _outputDir;
 	string _outputFilename;
 	vector<size_t>& _datasetIds;
 	size_t _partitionId;
-	Bag<Kmer_BankId_Count>* _outputGzFile;
-	Bag<Kmer_BankId_Count>* _cachedBag;
+	SimkaPartitionPackWriter<Kmer_BankId_Count>* _outputPackFile;
+	BagPartitionPack<Kmer_BankId_Count>* _cachedBag;
+	typename SimkaMergeInput<span>::Prefetcher* _prefetcher;
 
 
 
-    DiskBasedMergeSort(size_t mergeId, const string& outputDir, vector<size_t>& datasetIds, size_t partitionId):
-    	_datasetIds(datasetIds)
+    //Intermediate files are packed files with a single partition, their chunks are compressed at the fastest zlib level
+    DiskBasedMergeSort(size_t mergeId, const string& outputDir, vector<size_t>& datasetIds, size_t partitionId, typename SimkaMergeInput<span>::Prefetcher* prefetcher=0):
+    	_datasetIds(datasetIds), _prefetcher(prefetcher)
     {
     	_outputDir = outputDir;
     	_partitionId = partitionId;
 
-    	_outputFilename = _outputDir + "/solid/part_" + Stringify::format("%i", partitionId) + "/__p__" + Stringify::format("%i", mergeId) + ".gz.temp";
-    	_outputGzFile = new BagGzFile<Kmer_BankId_Count>(_outputFilename);
-    	_cachedBag = new BagCache<Kmer_BankId_Count>(_outputGzFile, 10000);
+    	_outputFilename = SimkaMergeInput<span>::getIntermediateFilename(_outputDir, partitionId, mergeId) + ".temp";
+    	_outputPackFile = new SimkaPartitionPackWriter<Kmer_BankId_Count>(_outputFilename, 1, 1, SIMKA_MERGE_MAX_PENDING_CHUNKS);
+    	_cachedBag = new BagPartitionPack<Kmer_BankId_Count>(*_outputPackFile, 0, SIMKA_MERGE_CHUNK_NB_ITEMS);
 
     }
 
+    //A merge which did not complete removes its partial output
     ~DiskBasedMergeSort(){
+    	if(_outputPackFile == 0) return;
+
+    	_cachedBag->discard();
+    	delete _cachedBag;
+    	delete _outputPackFile;
+    	System::file().remove(_outputFilename);
     }
 
     void execute(){
 
-		vector<IterableGzFile<Kmer_BankId_Count>* > partitions;
 		vector<StorageIt<span>*> its;
 
 		size_t _nbBanks = _datasetIds.size();
 
+		try{
+			for(size_t i=0; i<_nbBanks; i++){
+				//cout << _datasetIds[i] << endl;
+				its.push_back(SimkaMergeInput<span>::create(_outputDir, _partitionId, _datasetIds[i], SimkaKmerRange<span>(), _prefetcher));
+				//nbKmers += partition->estimateNbItems();
+
+				//size_t currentPart = 0;
+				//ifstream file((_outputDir + "/kmercount_per_partition/" +  _datasetIds[i] + ".txt").c_str());
+				//while(getline(file, line)){
+				//	if(line == "") continue;
+				//	if(currentPart == _partitionId){
+				//		//cout << stoull(line) << endl;
+				//		nbKmers += strtoull(line.c_str(), NULL, 10);
+				//		break;
+				//	}
+				//	currentPart += 1;
+				//}
+				//file.close();
+			}
+
+			//u_int64_t progressStep = nbKmers / 1000;
+			//_progress = new ProgressSynchro (
+			//	createIteratorListener (nbKmers, "Merging kmers"),
+			//	System::thread().newSynchronizer());
+			//_progress->init ();
+
+
+
+			//_nbDistinctKmers = 0;
+			//_nbSharedDistinctKmers = 0;
+			//u_int64_t nbKmersProcessed = 0;
+			//size_t nbBankThatHaveKmer = 0;
+			//u_int16_t best_p = 0;
+			SimkaMergeTree<span> mergeTree(its);
+
+			while(!mergeTree.isDone()){
+				StorageIt<span>* bestIt = mergeTree.top();
+				_cachedBag->insert(Kmer_BankId_Count(mergeTree.value(), bestIt->getBankId(), bestIt->abundance()));
+				mergeTree.next();
+			}
+
+			_cachedBag->flush();
+			_outputPackFile->close();
+		}
+		catch(...){
+			for(size_t i=0; i<its.size(); i++){
+				delete its[i];
+			}
+			throw;
+		}
+
+		for(size_t i=0; i<its.size(); i++){
+			delete its[i];
+		}
+
+    	delete _cachedBag;
+    	delete _outputPackFile;
+    	_cachedBag = 0;
+    	_outputPackFile = 0;
+
 		for(size_t i=0; i<_nbBanks; i++){
 			//cout << _datasetIds[i] << endl;
-			string filename = _outputDir + "/solid/part_" +  Stringify::format("%i", _partitionId) + "/__p__" + Stringify::format("%i", _datasetIds[i]) + ".gz";
-			//cout << "\t\t" << filename << endl;
-			IterableGzFile<Kmer_BankId_Count>* partition = new IterableGzFile<Kmer_BankId_Count>(filename, 10000);
-			partitions.push_back(partition);
-			its.push_back(new StorageIt<span>(partition->iterator(), i, _partitionId));
-			//nbKmers += partition->estimateNbItems();
-
-			//size_t currentPart = 0;
-			//ifstream file((_outputDir + "/kmercount_per_partition/" +  _datasetIds[i] + ".txt").c_str());
-			//while(getline(file, line)){
-			//	if(line == "") continue;
-			//	if(currentPart == _partitionId){
-			//		//cout << stoull(line) << endl;
-			//		nbKmers += strtoull(line.c_str(), NULL, 10);
-			//		break;
-			//	}
-			//	currentPart += 1;
-			//}
-			//file.close();
+			SimkaMergeInput<span>::remove(_outputDir, _partitionId, _datasetIds[i]);
 		}
 
-		//u_int64_t progressStep = nbKmers / 1000;
-		//_progress = new ProgressSynchro (
-		//	createIteratorListener (nbKmers, "Merging kmers"),
-		//	System::thread().newSynchronizer());
-		//_progress->init ();
+		string newOutputFilename = _outputFilename;
+		newOutputFilename.erase(_outputFilename.size()-5, 5);
+    	System::file().rename(_outputFilename, newOutputFilename); //remove .temp at the end of new merged file
+    	//_outputFilename = newOutputFilename;
+    }
 
+};
 
 
-		//_nbDistinctKmers = 0;
-		//_nbSharedDistinctKmers = 0;
-		//u_int64_t nbKmersProcessed = 0;
-		//size_t nbBankThatHaveKmer = 0;
-		//u_int16_t best_p = 0;
-		Type previous_kmer;
-		//CountVector abundancePerBank;
-		//abundancePerBank.resize(_nbBanks, 0);
-		//SimkaCounterBuilderMerge* solidCounter = new SimkaCounterBuilderMerge(abundancePerBank);;
-		std::priority_queue< kxp, vector<kxp>,kxpcomp > pq;
-		StorageIt<span>* bestIt;
+/*
+ * Merge tree of the inputs of a partition, used when there are more inputs than the final merge can
+ * read at once. The tree is planned up front from the sizes of the inputs (an intermediate file is as
+ * large as its inputs together). Each level merges just enough of the smallest inputs for the next level,
+ * in groups of similar size, and the merges of a level run concurrently on the cores of the job.
+ * The fan-in of a merge is bounded by the open files limit and by half of the memory of the job, an
+ * input holds a compressed and an uncompressed chunk in memory. The other half holds the chunks decoded
+ * ahead by the prefetcher (see SimkaMergeAlgorithm::execute). The option -max-merge-fan-in lowers it,
+ * to merge small inputs in several levels.
+ */
+template<size_t span>
+class SimkaMergeCascade
+{
+public:
 
+	typedef typename StorageIt<span>::Kmer_BankId_Count Kmer_BankId_Count;
 
-		for(size_t i=0; i<_nbBanks; i++){
-			StorageIt<span>* it = its[i];
-			it->_it->first();
+	struct MergeJob{
+		size_t _id;
+		u_int64_t _size;
+		vector<size_t> _inputIds;
+
+		MergeJob() : _id(0), _size(0) {}
+	};
+
+	struct MergeLevel{
+		vector<MergeJob> _merges;
+		size_t _nbThreads;
+	};
+
+	SimkaMergeCascade(Parameter& p, typename SimkaMergeInput<span>::Prefetcher* prefetcher=0) : p(p), _prefetcher(prefetcher)
+	{
+	}
+
+	//Fan-in of each of nbMerges concurrent merges
+	size_t getFanIn(size_t nbMerges){
+
+		nbMerges = max((size_t)1, nbMerges);
+		u_int64_t fanIn = SIMKA_MERGE_MAX_FILE_USED;
+
+		struct rlimit limit;
+		if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY){
+			u_int64_t nbFiles = limit.rlim_cur > SIMKA_MERGE_RESERVED_FILES ? limit.rlim_cur - SIMKA_MERGE_RESERVED_FILES : 0;
+			fanIn = min(fanIn, nbFiles / nbMerges);
 		}
 
-		//fill the  priority queue with the first elems
-		for (size_t ii=0; ii<_nbBanks; ii++)
-		{
-			//pq.push(Kmer_BankId_Count(ii,its[ii]->value()));
-			pq.push(kxp(its[ii]->value(), its[ii]->getBankId(), its[ii]->abundance(), its[ii]));
+		if(p.maxMemory > 0){
+			u_int64_t inputMemory = 2 * SIMKA_MERGE_CHUNK_NB_ITEMS * sizeof(Kmer_BankId_Count);
+			fanIn = min(fanIn, (p.maxMemory * MBYTE / 2) / (nbMerges * inputMemory));
 		}
 
-		if (pq.size() != 0) // everything empty, no kmer at all
-		{
-			//get first pointer
-			bestIt = pq.top()._it; pq.pop();
-			_cachedBag->insert(Kmer_BankId_Count(bestIt->value(), bestIt->getBankId(), bestIt->abundance()));
-			//best_p = get<1>(pq.top()) ; pq.pop();
-			//previous_kmer = bestIt->value();
-			//solidCounter->init (bestIt->getBankId(), bestIt->abundance());
-			//nbBankThatHaveKmer = 1;
-
-			while(1){
-
-				if (! bestIt->next())
-				{
-					//reaches end of one array
-					if(pq.size() == 0){
-						break;
-					}
+		//One of the files is the output of the merge
+		fanIn = (fanIn < 3) ? 2 : fanIn - 1;
 
-					//otherwise get new best
-					//best_p = get<1>(pq.top()) ; pq.pop();
-					bestIt = pq.top()._it; pq.pop();
-				}
+		if(p.maxFanIn > 0) fanIn = min(fanIn, (u_int64_t)max(p.maxFanIn, (size_t)2));
+		return fanIn;
+	}
 
-				pq.push(kxp(bestIt->value(), bestIt->getBankId(), bestIt->abundance(), bestIt)); //push new val of this pointer in pq, will be counted later
+	//Number of merges of nbInputs inputs which can run concurrently
+	size_t getNbConcurrentMerges(size_t nbInputs){
+		size_t nbMerges = 1;
+		while(nbMerges < p.nbCores && getFanIn(nbMerges+1) >= nbInputs) nbMerges += 1;
+		return nbMerges;
+	}
+
+	/*
+	 * Levels of the merge tree, the inputs left after the last level can be merged at once.
+	 * A level runs as many concurrent merges as possible while still reducing the inputs to the final
+	 * fan-in, otherwise it uses the largest fan-in. The merged file takes the id of its first input.
+	 * A group of a single input is not merged, the input goes to the next level as it is.
+	 */
+	vector<MergeLevel> plan(vector<sortItem_Size_Filename_ID> inputs){
+
+		vector<MergeLevel> levels;
+		size_t finalFanIn = getFanIn(1);
+
+		while(inputs.size() > finalFanIn){
+
+			size_t nbInputs = inputs.size();
+			size_t nbThreads = 1;
+			size_t fanIn = finalFanIn;
+
+			for(size_t t=p.nbCores; t>1; t--){
+				if(getNbMerges(nbInputs, getFanIn(t), finalFanIn) > finalFanIn) continue;
+				nbThreads = t;
+				fanIn = getFanIn(t);
+				break;
+			}
 
-		    	bestIt = pq.top()._it; pq.pop();
-		    	_cachedBag->insert(Kmer_BankId_Count(bestIt->value(), bestIt->getBankId(), bestIt->abundance()));
-		    	//cout << bestIt->value().toString(31) << " " << bestIt->getBankId() <<  " "<< bestIt->abundance() << endl;
-				//bestIt = get<3>(pq.top()); pq.pop();
+			//Each merge of k inputs removes k-1 inputs, if there are too many merges all the inputs are merged
+			size_t nbMerges = getNbMerges(nbInputs, fanIn, finalFanIn);
+			size_t nbMergedInputs = nbInputs - finalFanIn + nbMerges;
+			if(nbMerges > finalFanIn){
+				nbMerges = (nbInputs + fanIn - 1) / fanIn;
+				nbMergedInputs = nbInputs;
+			}
 
+			sort(inputs.begin(), inputs.end(), sortFileBySize);
 
-				//pq.push(kxp(bestIt->value(), bestIt->getBankId(), bestIt->abundance(), bestIt));
+			//The largest inputs are given first to the smallest merge which is not full
+			size_t maxMergeInputs = (nbMergedInputs + nbMerges - 1) / nbMerges;
+			MergeLevel level;
+			level._merges.resize(nbMerges);
 
+			for(size_t i=nbMergedInputs; i>0; i--){
+				size_t best = nbMerges;
+				for(size_t j=0; j<nbMerges; j++){
+					MergeJob& merge = level._merges[j];
+					if(merge._inputIds.size() >= maxMergeInputs) continue;
+					if(best == nbMerges || merge._size < level._merges[best]._size) best = j;
+				}
+				level._merges[best]._inputIds.push_back(inputs[i-1]._datasetID);
+				level._merges[best]._size += inputs[i-1]._size;
 			}
 
+			inputs.erase(inputs.begin(), inputs.begin() + nbMergedInputs);
+			vector<MergeJob> merges;
+			for(size_t j=0; j<nbMerges; j++){
+				MergeJob& merge = level._merges[j];
+				merge._id = merge._inputIds[0];
+				inputs.push_back(sortItem_Size_Filename_ID(merge._size, merge._id));
+				if(merge._inputIds.size() > 1) merges.push_back(merge);
+			}
 
-	    	//_outputGzFile->insert(Kmer_BankId_Count(bestIt->value(), bestIt->getBankId(), bestIt->abundance()));
-	    	//cout << bestIt->value().toString(31) << " " << bestIt->getBankId() <<  " "<< bestIt->abundance() << endl;
+			level._merges.swap(merges);
+			level._nbThreads = min(nbThreads, level._merges.size());
+			levels.push_back(level);
 		}
 
-		for(size_t i=0; i<partitions.size(); i++){
-			delete partitions[i];
-		}
+		return levels;
+	}
 
-		for(size_t i=0; i<its.size(); i++){
-			delete its[i];
-		}
+	//Merges the inputs until the final merge can read them at once, returns the ids of the remaining inputs
+	vector<size_t> execute(const vector<sortItem_Size_Filename_ID>& inputs){
 
+		vector<MergeLevel> levels = plan(inputs);
 
-		_cachedBag->flush();
-    	delete _cachedBag;
+		vector<size_t> ids;
+		for(size_t i=0; i<inputs.size(); i++) ids.push_back(inputs[i]._datasetID);
 
-		for(size_t i=0; i<_nbBanks; i++){
-			//cout << _datasetIds[i] << endl;
-			string filename = _outputDir + "/solid/part_" +  Stringify::format("%i", _partitionId) + "/__p__" + Stringify::format("%i", _datasetIds[i]) + ".gz";
-			System::file().remove(filename);
+		for(size_t l=0; l<levels.size(); l++){
+
+			vector<MergeJob>& merges = levels[l]._merges;
+
+			//A failed merge removes its .temp output, the error is rethrown by runThreads
+			SimkaCommons::runThreads(merges.size(), levels[l]._nbThreads, [&](size_t i){
+				try{
+					DiskBasedMergeSort<span> diskBasedMergeSort(merges[i]._id, p.outputDir, merges[i]._inputIds, p.partitionId, _prefetcher);
+					diskBasedMergeSort.execute();
+				}
+				catch(Exception& e){
+					throw Exception ("merge of partition %d failed: %s", (int)p.partitionId, e.getMessage().c_str());
+				}
+			});
+
+			for(size_t i=0; i<merges.size(); i++){
+				for(size_t j=0; j<merges[i]._inputIds.size(); j++){
+					ids.erase(std::find(ids.begin(), ids.end(), merges[i]._inputIds[j]));
+				}
+				ids.push_back(merges[i]._id);
+			}
 		}
 
-		string newOutputFilename = _outputFilename;
-		newOutputFilename.erase(_outputFilename.size()-5, 5);
-    	System::file().rename(_outputFilename, newOutputFilename); //remove .temp at the end of new merged file
-    	//_outputFilename = newOutputFilename;
-    }
+		return ids;
+	}
+
+private:
 
+	//Number of merges of fanIn inputs reducing nbInputs to finalFanIn
+	static size_t getNbMerges(size_t nbInputs, size_t fanIn, size_t finalFanIn){
+		return (nbInputs - finalFanIn + fanIn - 2) / (fanIn - 1);
+	}
+
+	Parameter& p;
+	typename SimkaMergeInput<span>::Prefetcher* _prefetcher;
 };
 
 
@@ -837,7 +1106,6 @@ public:
     //typedef tuple<Type, u_int64_t, u_int64_t, StorageIt<span>*> kxp;
 
 	typedef typename DiskBasedMergeSort<span>::Kmer_BankId_Count Kmer_BankId_Count;
-	typedef typename DiskBasedMergeSort<span>::kxp kxp;
 
 
 	/*
@@ -880,7 +1148,6 @@ public:
 	//typedef std::pair<u_int16_t, Type> kxp; //id pointer in vec_pointer , value
     //typedef std::pair<u_int16_t, Type> kxp; //id pointer in vec_pointer , value
 	//struct kxpcomp { bool operator() (Kmer_BankId_Count l,Kmer_BankId_Count r) { return ((r.second) < (l.second)); } } ;
-	struct kxpcomp { bool operator() (kxp& l,kxp& r) { return (r._type < l._type); } } ;
 
 	Parameter& p;
 
@@ -951,111 +1218,28 @@ public:
 		createDatasetIdList(p);
 		_nbBanks = _datasetIds.size();
 
-		string partDir = p.outputDir + "/solid/part_" + Stringify::format("%i", _partitionId) + "/";
-		vector<string> filenames = System::file().listdir(partDir);
-		//cout << filenames.size() << endl;
-		vector<string> partFilenames;
-		vector<sortItem_Size_Filename_ID> filenameSizes;
-
-		for(size_t i=0; i<filenames.size(); i++){
-			if(filenames[i].find("__p__") != std::string::npos){
-
-
-				string id = string(filenames[i]);
-				id.erase(0, 5);
-				std::string::size_type pos = id.find(".gz");
-				id.erase(pos, 3);
-
-				size_t datasetId = atoll(id.c_str());
-				//cout << filenames[i] << " " << datasetId << endl;
-
-				filenameSizes.push_back(sortItem_Size_Filename_ID(getFileSize(partDir+filenames[i]), datasetId));
-				//cout << filenames[i] << " " << size << endl;
-				//cout << filenames[i] << endl;
-			}
-		}
-
-		//cout << "mettre un while ici" << endl;
-		while(filenameSizes.size() > SIMKA_MERGE_MAX_FILE_USED){
-
-			//cout << "Start merging pass" << endl;
-			sort(filenameSizes.begin(),filenameSizes.end(),sortFileBySize);
-
-			vector<size_t> mergeDatasetIds;
-			vector<size_t> toRemoveItem;
-
-
-			for(size_t i=0; i<SIMKA_MERGE_MAX_FILE_USED; i++){
-				sortItem_Size_Filename_ID sfi = filenameSizes[i];
-				mergeDatasetIds.push_back(sfi._datasetID);
-				//datasetIndex += 1;
-				//if(datasetIndex >= _nbBanks) break;
+		SimkaMergeInput<span>::removeIntermediates(p.outputDir, _partitionId);
 
-				//cout << mergeDatasetIds[i] << endl;
-				//cout << "First val must never be greater than second:   " << i << "  " << _nbBanks << endl;
-				//cout << "\t" << get<1>(sfi) << endl;
-			}
-
-			for(size_t i=0; i<mergeDatasetIds.size(); i++){
-				filenameSizes.erase(filenameSizes.begin());
-			}
-
-			size_t mergedId = mergeDatasetIds[0];
-			DiskBasedMergeSort<span> diskBasedMergeSort(mergedId, p.outputDir, mergeDatasetIds, _partitionId);
-			diskBasedMergeSort.execute();
-
-			filenameSizes.push_back(sortItem_Size_Filename_ID(getFileSize(diskBasedMergeSort._outputFilename), mergedId));
+		vector<sortItem_Size_Filename_ID> filenameSizes;
 
-			//cout << "\tmerged id: " <<  mergedId << endl;
-			//cout << "\tremainging files: " << filenameSizes.size() << endl;
+		for(size_t i=0; i<_nbBanks; i++){
+			filenameSizes.push_back(sortItem_Size_Filename_ID(SimkaMergeInput<span>::getSize(p.outputDir, _partitionId, i), i));
 		}
 
-		//cout << filenameSizes.size() << endl;
-		//for(size_t i=0; i<filenameSizes.size(); i++){
-		//	cout << filenameSizes[i].first << endl;
-		//}
-
-		//size_t nbMerges = 0;
-		/*
-		//cout << partFilenames.size() << endl;
-		exit(1);
-
-		size_t nbMerges = ceil((float)_nbBanks / (float)SIMKA_MERGE_MAX_FILE_USED);
-		cout << "nb Merges: " << nbMerges << endl;
-		size_t datasetIndex = 0;
-
-		for(size_t i=0; i<nbMerges; i++){
-
-			vector<string> mergeDatasetIds;
-
-			for(size_t j=0; j<SIMKA_MERGE_MAX_FILE_USED; j++){
-				mergeDatasetIds.push_back(_datasetIds[datasetIndex]);
-				datasetIndex += 1;
-				if(datasetIndex >= _nbBanks) break;
-			}
-
-			cout << "doivent etre égaux a la dernière passe:    " << _nbBanks << " " << mergeDatasetIds.size() << " " << datasetIndex << endl;
+		//The statistics of the partition and the private statistics of the distance threads are charged
+		//to the memory of the job (half of it at most), the merge uses the remaining memory
+		u_int64_t statsMemory = SimkaStatistics::getMemorySize(_nbBanks, p.computeSimpleDistances, p.computeComplexDistances);
+		_nbDistanceThreads = getNbDistanceThreads(statsMemory);
+		if(p.maxMemory > 0) p.maxMemory -= min((_nbDistanceThreads+1) * statsMemory / MBYTE, p.maxMemory / 2);
 
-			DiskBasedMergeSort<span> diskBasedMergeSort(i, p.outputDir, mergeDatasetIds, _partitionId);
-			diskBasedMergeSort.execute();
+		//The next chunk of every input is decoded in the background, in half of the memory of the job
+		u_int64_t prefetchMemory = p.maxMemory > 0 ? p.maxMemory * MBYTE / 2 : SIMKA_MERGE_PREFETCH_MEMORY;
+		typename SimkaMergeInput<span>::Prefetcher prefetcher(p.nbCores, prefetchMemory);
 
-		}*/
+		SimkaMergeCascade<span> mergeCascade(p, &prefetcher);
+		vector<size_t> inputIds = mergeCascade.execute(filenameSizes);
 
 		//exit(1);
-		/* PARALLEL
-		for (size_t i=0; i<_nbCores; i++)
-	    {
-		//cout << i << endl;
-	        ICommand* cmd = 0;
-	        cmd = new DistanceCommand<span>(p.outputDir, _datasetIds, _partitionId, _nbBanks, _computeSimpleDistances, _computeComplexDistances, _kmerSize, _abundanceThreshold, _minShannonIndex);
-	        //cmd->use();
-	        _cmds.push_back (cmd);
-
-                        //cout << _cmds[i] << endl;
-	    }
-
-		resetCommands();
-		*/
 
 
 		//SimkaDistanceParam distanceParams(p.props);
@@ -1064,302 +1248,152 @@ public:
 
 		//createProcessor(p);
 
-		//PARALLEL line to remove
 		_stats = new SimkaStatistics(_nbBanks, p.computeSimpleDistances, p.computeComplexDistances, p.outputDir, _datasetIds);
-		_processor = new SimkaCountProcessorSimple<span> (_stats, _nbBanks, p.kmerSize, _abundanceThreshold, SUM, false, p.minShannonIndex);
-		//_processor->use();
-
 
+		//Update mode: the pairs of datasets of the previous run are not computed again
+		if(p.nbPreviousBanks > 0){
+			string previousFilename = p.outputDir + "/stats/part_" + SimkaAlgorithm<>::toString(p.partitionId) + ".prev.gz";
+			_stats->loadPrevious(previousFilename, p.nbPreviousBanks, p.outputDir, _datasetIds);
+		}
 
+		size_t nbRanges = min(mergeCascade.getNbConcurrentMerges(inputIds.size()), _nbDistanceThreads);
+		vector<SimkaKmerRange<span> > ranges = SimkaMergeInput<span>::getRanges(p.outputDir, _partitionId, inputIds, nbRanges);
 
+		if(ranges.size() > 1){
+			mergeRanges(p, inputIds, ranges, prefetcher);
+		}
+		else{
+			merge(p, inputIds, prefetcher);
+		}
 
 
-		string line;
-		vector<IterableGzFile<Kmer_BankId_Count>* > partitions;
-		vector<StorageIt<span>*> its;
-		u_int64_t nbKmers = 0;
-
-    	for(size_t i=0; i<filenameSizes.size(); i++){
-    		size_t datasetId = filenameSizes[i]._datasetID;
-    		string filename = p.outputDir + "/solid/part_" + Stringify::format("%i", p.partitionId) + "/__p__" + Stringify::format("%i", datasetId) + ".gz";
-    		//cout << filename << endl;
-    		IterableGzFile<Kmer_BankId_Count>* partition = new IterableGzFile<Kmer_BankId_Count>(filename, 10000);
-    		partitions.push_back(partition);
-    		its.push_back(new StorageIt<span>(partition->iterator(), i, _partitionId));
-    		//nbKmers += partition->estimateNbItems();
-
-    		size_t currentPart = 0;
-	    	ifstream file((p.outputDir + "/kmercount_per_partition/" +  _datasetIds[i] + ".txt").c_str());
-			while(getline(file, line)){
-				if(line == "") continue;
-				if(currentPart == _partitionId){
-					//cout << stoull(line) << endl;
-					nbKmers += strtoull(line.c_str(), NULL, 10);
-					break;
-				}
-				currentPart += 1;
-			}
-			file.close();
-    	}
+		saveStats(p);
 
 
-		/*
-		//vector<Iterator<Count>* > partitionIts;
-    	for(size_t i=0; i<_nbBanks; i++){
-    		string filename = p.outputDir + "/solid/" +  _datasetIds[i] + "/" + "part" + Stringify::format("%i", _partitionId);
-    		//cout << filename << endl;
-    		IterableGzFile<Kmer_BankId_Count>* partition = new IterableGzFile<Kmer_BankId_Count>(filename, 1000);
-    		partitions.push_back(partition);
-    		its.push_back(new StorageIt<span>(partition->iterator(), i, _partitionId));
-    		//nbKmers += partition->estimateNbItems();
-
-    		size_t currentPart = 0;
-	    	ifstream file((p.outputDir + "/kmercount_per_partition/" +  _datasetIds[i] + ".txt").c_str());
-			while(getline(file, line)){
-				if(line == "") continue;
-				if(currentPart == _partitionId){
-					//cout << stoull(line) << endl;
-					nbKmers += strtoull(line.c_str(), NULL, 10);
-					break;
-				}
-				currentPart += 1;
-			}
-			file.close();
-    	}*/
-
-    	//u_int64_t progressStep = nbKmers / 1000;
-    	//_progress = new ProgressSynchro (
-    	//	createIteratorListener (nbKmers, "Merging kmers"),
-    	//	System::thread().newSynchronizer());
-    	//_progress->init ();
+		delete _stats;
 
+		writeFinishSignal(p);
+		//_progress->finish();
 
-		/* PARALLEL
-		_mergeCommand = new MergeCommand<span>(
-    		_partitionId,
-    		_nbBanks,
-			_progress,
-			its,
-			progressStep,
-			_nbCores,
-			p.computeComplexDistances);
-		//_mergeCommand->use();
-		_cmds.push_back(_mergeCommand);
+	}
 
+	//Merges all the kmers of the partition, the distances are computed by the threads of a DistanceDispatcher
+	void merge(Parameter& p, const vector<size_t>& inputIds, typename SimkaMergeInput<span>::Prefetcher& prefetcher){
 
-		//cout << "CMDS SIZE:" << _cmds.size() << endl;
+		vector<StorageIt<span>*> its;
+		for(size_t i=0; i<inputIds.size(); i++){
+			its.push_back(SimkaMergeInput<span>::create(p.outputDir, _partitionId, inputIds[i], SimkaKmerRange<span>(), &prefetcher));
+		}
 
+		_distanceDispatcher = new DistanceDispatcher<span>(p, *_stats, _nbDistanceThreads, _abundanceThreshold);
 
-		MergeCommand<span>* mergeCmd = dynamic_cast<MergeCommand<span>*>(_mergeCommand);
-		mergeCmd->execute();
+		Type kmer;
+		SparseCountVector abundancePerBank;
+		SimkaCounterBuilderMerge* solidCounter = new SimkaCounterBuilderMerge(abundancePerBank);
+		SimkaMergeTree<span> mergeTree(its);
 
-		while(!mergeCmd->_isDone){
-			//cout << mergeCmd->_isDone << endl;
-			//mergeCmd->execute();
-			dispatch();
+		while(!mergeTree.isDone()){
+			size_t nbBankThatHaveKmer = mergeTree.nextRun(kmer, *solidCounter);
+			if(countKmer(*_stats, nbBankThatHaveKmer)) _distanceDispatcher->process(kmer, abundancePerBank);
 		}
 
-	    dispatch();*/
-
-		_nbDistinctKmers = 0;
-		_nbSharedDistinctKmers = 0;
-		u_int64_t nbKmersProcessed = 0;
-		size_t nbBankThatHaveKmer = 0;
-		u_int16_t best_p = 0;
-		Type previous_kmer;
-	    CountVector abundancePerBank;
-		abundancePerBank.resize(_nbBanks, 0);
-		SimkaCounterBuilderMerge* solidCounter = new SimkaCounterBuilderMerge(abundancePerBank);;
-		std::priority_queue< kxp, vector<kxp>,kxpcomp > pq;
-
-    	StorageIt<span>* bestIt;
+		_distanceDispatcher->end(*_stats);
 
+		delete _distanceDispatcher;
+		delete solidCounter;
 		for(size_t i=0; i<its.size(); i++){
-			StorageIt<span>* it = its[i];
-			it->_it->first();
+			delete its[i];
 		}
+	}
 
-	    //fill the  priority queue with the first elems
-	    for (size_t ii=0; ii<its.size(); ii++)
-	    {
-	    	//pq.push(Kmer_BankId_Count(ii,its[ii]->value()));
-	    	pq.push(kxp(its[ii]->value(), its[ii]->getBankId(), its[ii]->abundance(), its[ii]));
-	    }
-
-	    if (pq.size() != 0) // everything empty, no kmer at all
-	    {
-	        //get first pointer
-	    	bestIt = pq.top()._it; pq.pop();
-	        //best_p = get<1>(pq.top()) ; pq.pop();
-	        previous_kmer = bestIt->value();
-	        solidCounter->init (bestIt->getBankId(), bestIt->abundance());
-	        nbBankThatHaveKmer = 1;
-
-			while(1){
-
-				if (! bestIt->next())
-				{
-					//reaches end of one array
-					if(pq.size() == 0){
-						break;
-					}
-
-					//otherwise get new best
-					//best_p = get<1>(pq.top()) ; pq.pop();
-			    	bestIt = pq.top()._it; pq.pop();
-				}
-
-		    	//cout << bestIt->value().toString(31) << " " << bestIt->getBankId() <<  " "<< bestIt->abundance() << endl;
-
-				if (bestIt->value() != previous_kmer )
-				{
-					//if diff, changes to new array, get new min pointer
-					pq.push(kxp(bestIt->value(), bestIt->getBankId(), bestIt->abundance(), bestIt)); //push new val of this pointer in pq, will be counted later
-
-			    	bestIt = pq.top()._it; pq.pop();
-					//best_p = get<1>(pq.top()) ; pq.pop();
-
-					//if new best is diff, this is the end of this kmer
-					if(bestIt->value()!=previous_kmer )
-					{
-
-						//nbKmersProcessed += nbBankThatHaveKmer;
-						//if(nbKmersProcessed > progressStep){
-							//cout << "queue size:   " << pq.size() << endl;
-							//cout << nbKmersProcessed << endl;
-							//_progress->inc(nbKmersProcessed);
-						//nbKmersProcessed = 0;
-						//}
-
-						//cout << previous_kmer.toString(p.kmerSize) << endl;
-						//for(size_t i=0; i<abundancePerBank.size(); i++){
-						//	cout << abundancePerBank[i] << " ";
-						//}
-						//cout << endl;
-
-						insert(previous_kmer, abundancePerBank, nbBankThatHaveKmer);
-						//if(nbBankThatHaveKmer > 1)
-						//	_processor->process (_partitionId, previous_kmer, abundancePerBank);
-						//this->insert (previous_kmer, solidCounter);
-
-						solidCounter->init (bestIt->getBankId(), bestIt->abundance());
-						nbBankThatHaveKmer = 1;
-						previous_kmer = bestIt->value();
-					}
-					else
-					{
-						solidCounter->increase (bestIt->getBankId(), bestIt->abundance());
-						nbBankThatHaveKmer += 1;
-					}
-				}
-				else
-				{
-					//cout << "increase" << endl;
-					solidCounter->increase (bestIt->getBankId(), bestIt->abundance());
-					nbBankThatHaveKmer += 1;
-				}
-			}
-
-			insert(previous_kmer, abundancePerBank, nbBankThatHaveKmer);
-	    }
-
-
-		_processor->end();
-
-		//cout << "lala" << endl;
-		for(size_t i=0; i<partitions.size(); i++){
-			delete partitions[i];
+	/*
+	 * Merges each kmer range of the partition on its own thread. A thread reads its range in every input,
+	 * from the chunk holding the start of the range, and computes the distances in its own statistics,
+	 * which are summed at the end.
+	 */
+	void mergeRanges(Parameter& p, const vector<size_t>& inputIds, const vector<SimkaKmerRange<span> >& ranges, typename SimkaMergeInput<span>::Prefetcher& prefetcher){
+
+		vector<DistanceCommand<span>*> cmds(ranges.size());
+		vector<vector<StorageIt<span>*> > its(ranges.size());
+		std::exception_ptr error;
+
+		for(size_t r=0; r<ranges.size(); r++){
+			cmds[r] = new DistanceCommand<span>(*_stats, _partitionId, p.kmerSize, _abundanceThreshold, p.minShannonIndex, p.nbPreviousBanks);
 		}
 
+		try{
+			SimkaCommons::runThreads(ranges.size(), ranges.size(), [&](size_t r){
 
-		saveStats(p);
-
+				DistanceCommand<span>* cmd = cmds[r];
 
-		delete _stats;
-		delete _processor;
-		//for(size_t i=0; i<its.size(); i++){
-		//	delete its[i];
-		//}
+				try{
+					for(size_t i=0; i<inputIds.size(); i++){
+						its[r].push_back(SimkaMergeInput<span>::create(p.outputDir, _partitionId, inputIds[i], ranges[r], &prefetcher));
+					}
 
-		/* PARALLEL
-		saveStats(p, mergeCmd->_nbDistinctKmers, mergeCmd->_nbSharedDistinctKmers);
+					Type kmer;
+					SparseCountVector abundancePerBank;
+					SimkaCounterBuilderMerge solidCounter(abundancePerBank);
+					SimkaMergeTree<span> mergeTree(its[r]);
 
+					while(!mergeTree.isDone()){
+						size_t nbBankThatHaveKmer = mergeTree.nextRun(kmer, solidCounter);
+						if(countKmer(*cmd->_stats, nbBankThatHaveKmer)) cmd->_processor->process(_partitionId, kmer, abundancePerBank);
+					}
 
-		//cout << _cmds.size() << endl;
-		for(size_t i=0; i<_cmds.size(); i++){
-			//cout << _cmds[i] << endl;
-			//_cmds[i]->forget();
-			delete _cmds[i];		
+					cmd->_processor->end();
+				}
+				catch(Exception& e){
+					throw Exception ("merge of partition %d failed: %s", (int)_partitionId, e.getMessage().c_str());
+				}
+			});
 		}
-		//_cmds.clear();
-		//delete _mergeCommand;
-		*/
-		delete solidCounter;
-		for(size_t i=0; i<its.size(); i++){
-			delete its[i];
+		catch(...){
+			error = std::current_exception();
 		}
 
-		writeFinishSignal(p);
-		//_progress->finish();
+		//The inputs and the commands are released whatever the error of runThreads
+		for(size_t r=0; r<ranges.size(); r++){
+			for(size_t i=0; i<its[r].size(); i++){
+				delete its[r][i];
+			}
+			(*_stats) += *cmds[r]->_stats;
+			delete cmds[r];
+		}
 
+		if(error) std::rethrow_exception(error);
 	}
 
-	void insert(const Type& kmer, const CountVector& counts, size_t nbBankThatHaveKmer){
-
-		//cout << kmer.toString(31) << endl;
-		//for(size_t i=0; i<counts.size(); i++){
-		//	cout << counts[i] << " ";
-		//}
-		//cout << endl;
+	/*
+	 * Each distance thread has its own statistics, with the N² matrices of the statistics of the partition.
+	 * They use half of the memory of the job at most.
+	 */
+	size_t getNbDistanceThreads(u_int64_t statsMemory){
 
-		_stats->_nbDistinctKmers += 1;
+		size_t nbThreads = max((size_t)1, p.nbCores);
+		if(p.maxMemory == 0 || statsMemory == 0) return nbThreads;
 
-		if(_computeComplexDistances || nbBankThatHaveKmer > 1){
+		u_int64_t nbStats = (p.maxMemory * MBYTE / 2) / statsMemory;
+		if(nbStats < 2) return 1;
+		return min((u_int64_t)nbThreads, nbStats - 1);
+	}
 
-			if(nbBankThatHaveKmer > 1){
-				_stats->_nbSharedKmers += 1;
-			}
+	//Counts a merged kmer in stats, returns true if its distances have to be computed
+	bool countKmer(SimkaStatistics& stats, size_t nbBankThatHaveKmer){
 
-			_processor->process(_partitionId, kmer, counts);
+		stats._nbDistinctKmers += 1;
+		if(nbBankThatHaveKmer > 1) stats._nbSharedKmers += 1;
 
-		}
+		return _computeComplexDistances || nbBankThatHaveKmer > 1;
 	}
 
 	void createDatasetIdList(Parameter& p){
 
-		string datasetIdFilename = p.outputDir + "/" + "datasetIds";
-		IFile* inputFile = System::file().newFile(datasetIdFilename, "rb");
-		//IFile* bankFile = System::file().newFile(_banksInputFilename, "wb");
+		SimkaDatasetCatalogFile catalog(p.outputDir + "/datasets.bin");
 
-		inputFile->seeko(0, SEEK_END);
-		u_int64_t size = inputFile->tell();
-		inputFile->seeko(0, SEEK_SET);
-		char buffer2[size];
-		inputFile->fread(buffer2, size, size);
-		string fileContents(buffer2, size);
-
-		string line;
-		string linePart;
-		vector<string> linePartList;
-		stringstream fileContentsStream(fileContents);
-
-		//string bankFileContents = "";
-
-		//u_int64_t lineIndex = 0;
-
-		while(getline(fileContentsStream, line)){
-
-			if(line == "") continue;
-
-			_datasetIds.push_back(line);
+		for(size_t i=0; i<catalog.size(); i++){
+			_datasetIds.push_back(catalog.getId(i));
 		}
-
-		//bankFileContents.erase(bankFileContents.size()-1);
-		//bankFileContents.pop_back(); // "remove last /n
-
-		//bankFile->fwrite(bankFileContents.c_str(), bankFileContents.size(), 1);
-
-		delete inputFile;
 	}
 
 	void createProcessor(Parameter& p){
@@ -1372,40 +1406,6 @@ public:
 		//_processors.push_back(proc);
 	}
 
-	void resetCommands(){
-		for (size_t i=0; i<_nbCores; i++){
-			DistanceCommand<span>* cmd = dynamic_cast<DistanceCommand<span>*>(_cmds[i]);
-			cmd->_bufferIndex = 0;
-		}
-
-	}
-
-	/*
-	void dispatch(){
-
-
-		MergeCommand<span>* mergeCommand = dynamic_cast<MergeCommand<span>*>(_mergeCommand);
-		for (size_t i=0; i<_nbCores; i++){
-			//cout << mergeCommand->_bufferKmers.size() << endl;
-			//cout << i << endl;
-			DistanceCommand<span>* cmd = dynamic_cast<DistanceCommand<span>*>(_cmds[i]);
-			cmd->setup(mergeCommand->_bufferIndex[i], mergeCommand->_bufferKmers[i], mergeCommand->_bufferCounts[i]);
-		}
-
-
-		//MergeCommand<span>* mergeCommand = dynamic_cast<MergeCommand<span>*>(_mergeCommand);
-		mergeCommand->reset();
-
-		//cout << "start dispatch" << endl;
-	    getDispatcher()->dispatchCommands(_cmds, 0);
-
-
-		//cout << "end dispatch" << endl;
-	    resetCommands();
-
-
-	}*/
-
 
 	void removeStorage(Parameter& p){
 		//Storage* storage = 0;
@@ -1414,40 +1414,6 @@ public:
 	}
 
 
-	/* PARALLEL
-	void saveStats(Parameter& p, const u_int64_t nbDistinctKmers, const u_int64_t nbSharedDistinctKmers){
-
-		_stats = new SimkaStatistics(_nbBanks, p.computeSimpleDistances, p.computeComplexDistances, p.outputDir, _datasetIds);
-
-		for (size_t i=0; i<_nbCores; i++){
-			DistanceCommand<span>* cmd = dynamic_cast<DistanceCommand<span>*>(_cmds[i]);
-			cmd->_processor->end();
-			(*_stats) += (*cmd->_stats);
-		}
-		//loadCountInfo();
-
-		string filename = p.outputDir + "/stats/part_" + SimkaAlgorithm<>::toString(p.partitionId) + ".gz";
-
-		_stats->_nbDistinctKmers = nbDistinctKmers;
-		_stats->_nbSharedKmers = nbSharedDistinctKmers;
-		_stats->save(filename); //storage->getGroup(""));
-
-		
-		delete _stats;
-		//string filename = p.outputDir + "/stats/part_" + SimkaAlgorithm<>::toString(p.partitionId) + ".gz";
-		//_processor->finishClones(_processors);
-		//Storage* storage = 0;
-		//storage = StorageFactory(STORAGE_HDF5).create (p.outputDir + "/stats/part_" + SimkaAlgorithm<>::toString(p.partitionId) + ".stats", true, false);
-		//LOCAL (storage);
-		//_stats->save(filename); //storage->getGroup(""));
-
-		//cout << _stats->_nbKmers << endl;
-
-		//_processors[0]->forget();
-		//_processor->forget();
-
-	}*/
-
 	void saveStats(Parameter& p){
 
 		string filename = p.outputDir + "/stats/part_" + SimkaAlgorithm<>::toString(p.partitionId) + ".gz";
@@ -1489,13 +1455,12 @@ private:
 
 	IteratorListener* _progress;
 
-    vector<ICommand*> _cmds;
-	ICommand* _mergeCommand;
 	size_t _nbCores;
+	size_t _nbDistanceThreads;
 
 
 	SimkaStatistics* _stats;
-	SimkaCountProcessorSimple<span>* _processor;
+	DistanceDispatcher<span>* _distanceDispatcher;
 	u_int64_t _nbDistinctKmers;
 	u_int64_t _nbSharedDistinctKmers;
 };
@@ -1538,6 +1503,8 @@ public:
         getParser()->push_back (new OptionOneParam ("-nb-cores",   "bank name", true));
         getParser()->push_back (new OptionOneParam ("-max-memory",   "bank name", true));
         getParser()->push_back (new OptionOneParam (STR_SIMKA_MIN_KMER_SHANNON_INDEX,   "bank name", true));
+        getParser()->push_back (new OptionOneParam ("-update-from",   "number of datasets of the previous run (update mode)", false, "0"));
+        getParser()->push_back (new OptionOneParam (STR_SIMKA_MAX_MERGE_FAN_IN,   "max number of inputs of a merge, 0: bounded by the open files limit and the memory", false, "0"));
 
         getParser()->push_back (new OptionNoParam (STR_SIMKA_COMPUTE_ALL_SIMPLE_DISTANCES.c_str(), "compute simple distances"));
         getParser()->push_back (new OptionNoParam (STR_SIMKA_COMPUTE_ALL_COMPLEX_DISTANCES.c_str(), "compute complex distances"));
@@ -1555,8 +1522,11 @@ public:
     	double minShannonIndex =   getInput()->getDouble(STR_SIMKA_MIN_KMER_SHANNON_INDEX);
     	bool computeSimpleDistances =   getInput()->get(STR_SIMKA_COMPUTE_ALL_SIMPLE_DISTANCES);
     	bool computeComplexDistances =   getInput()->get(STR_SIMKA_COMPUTE_ALL_COMPLEX_DISTANCES);
+    	size_t nbPreviousBanks =   getInput()->getInt("-update-from");
+    	u_int64_t maxMemory =   getInput()->getInt("-max-memory");
+    	size_t maxFanIn =   getInput()->getInt(STR_SIMKA_MAX_MERGE_FAN_IN);
 
-    	Parameter params(getInput(), inputFilename, outputDir, partitionId, kmerSize, minShannonIndex, computeSimpleDistances, computeComplexDistances, nbCores);
+    	Parameter params(getInput(), inputFilename, outputDir, partitionId, kmerSize, minShannonIndex, computeSimpleDistances, computeComplexDistances, nbCores, nbPreviousBanks, maxMemory, maxFanIn);
 
         Integer::apply<Functor,Parameter> (kmerSize, params);
 
@@ -129,15 +129,81 @@ template<size_t span> struct Functor  {  void operator ()  (Parameter p)
 #endif*/
 }};
 
+//The read cache dir only holds spill files
+static void removeReadCache(const string& readCacheDir){
+	if(!System::file().doesExist(readCacheDir)) return;
+
+	vector<string> filenames = System::file().listdir(readCacheDir);
+	for(size_t i=0; i<filenames.size(); i++){
+		if(filenames[i] == "." || filenames[i] == "..") continue;
+		System::file().remove(readCacheDir + "/" + filenames[i]);
+	}
+	System::file().rmdir(readCacheDir);
+}
+
 void SimkaPotara::execute ()
 {
 	IProperties* input = getInput();
 	//Parameter params(*this, getInput());
 	Parameter params(input, _execFilename);
 
-	size_t kmerSize = getInput()->getInt (STR_KMER_SIZE);
+	vector<size_t> kmerSizes;
+	stringstream kmerSizeStream(input->getStr(STR_KMER_SIZE));
+	string kmerSizeStr;
+	while(getline(kmerSizeStream, kmerSizeStr, ',')){
+		if(kmerSizeStr == "") continue;
+		size_t kmerSize = atoi(kmerSizeStr.c_str());
+		if(kmerSize == 0){
+			cerr << "ERROR: invalid kmer size " << kmerSizeStr << endl;
+			exit(1);
+		}
+		kmerSizes.push_back(kmerSize);
+	}
+
+	if(kmerSizes.size() <= 1){
+		size_t kmerSize = getInput()->getInt (STR_KMER_SIZE);
+	    Integer::apply<Functor,Parameter> (kmerSize, params);
+	    return;
+	}
 
-    Integer::apply<Functor,Parameter> (kmerSize, params);
+	/*
+	 * Several kmer sizes: one run per kmer size, with its own temp dir (out-tmp/k<k>) and result dir
+	 * (out/k<k>). The reads are filtered by the first run and written in out-tmp/reads, the counting jobs
+	 * of the following runs read them instead of parsing the input files again.
+	 * The spill files do not record the inputs nor the read filters they were written with, spill files
+	 * left by a previous run (interrupted, or with -keep-tmp) are removed so that they are not reused.
+	 */
+	string outputDir = input->getStr(STR_URI_OUTPUT);
+	string outputDirTemp = input->getStr(STR_URI_OUTPUT_TMP);
+	System::file().mkdir(outputDir, -1);
+	System::file().mkdir(outputDirTemp, -1);
+
+	string readCacheDir = System::file().getRealPath(outputDirTemp) + "/reads/";
+	removeReadCache(readCacheDir);
+	System::file().mkdir(readCacheDir, -1);
+	input->add(0, STR_SIMKA_READ_CACHE, readCacheDir);
+
+	//Options modified by a run
+	string maxMemory = input->getStr(STR_MAX_MEMORY);
+	string nbCores = input->getStr(STR_NB_CORES);
+
+	for(size_t i=0; i<kmerSizes.size(); i++){
+
+		string suffix = "/k" + Stringify::format("%d", (int)kmerSizes[i]);
+		cout << endl << "Kmer size: " << kmerSizes[i] << endl;
+
+		input->setInt(STR_KMER_SIZE, kmerSizes[i]);
+		input->setStr(STR_URI_OUTPUT, outputDir + suffix);
+		input->setStr(STR_URI_OUTPUT_TMP, outputDirTemp + suffix);
+		input->setStr(STR_MAX_MEMORY, maxMemory);
+		input->setStr(STR_NB_CORES, nbCores);
+
+	    Integer::apply<Functor,Parameter> (kmerSizes[i], params);
+	}
+
+	if(!input->get(STR_SIMKA_KEEP_TMP_FILES)){
+		removeReadCache(readCacheDir);
+	}
 }
 
 
@@ -26,6 +26,8 @@
 #include <SimkaAlgorithm.hpp>
 #include <KmerCountCompressor.hpp>
 #include <Simka.hpp>
+#include <SimkaCountCache.hpp>
+#include <SimkaPartitionPack.hpp>
 
 #include <gatb/kmer/impl/RepartitionAlgorithm.hpp>
 #include <gatb/kmer/impl/ConfigurationAlgorithm.hpp>
@@ -37,6 +39,8 @@
 //#define CLUSTER
 //#define SERIAL
 #define SLEEP_TIME_SEC 1
+#define SIMKA_FIXED_REPARTITION_NB_READS 100000
+#define SIMKA_FIXED_REPARTITION_READ_SIZE 150
 
 const string STR_SIMKA_CLUSTER_MODE = "-cluster";
 const string STR_SIMKA_NB_JOB_COUNT = "-max-count";
@@ -72,6 +76,41 @@ private:
 };
 
 
+/*
+ * Random reads generated from a fixed seed. Used to compute a repartition of the kmers which does not
+ * depend on the input datasets (see option -fixed-partitions): the count files of a dataset are then
+ * the same in any run using the same parameters.
+ */
+class SimkaBankRandom : public BankStrings
+{
+public:
+
+	SimkaBankRandom (u_int64_t nbReads, size_t readSize) : BankStrings (createReads(nbReads, readSize))  {}
+
+private:
+
+	static vector<string> createReads(u_int64_t nbReads, size_t readSize){
+
+		static const char nucleotides[4] = {'A', 'C', 'G', 'T'};
+
+		vector<string> reads(nbReads);
+		u_int64_t state = 0x9e3779b97f4a7c15ULL;
+
+		for(size_t i=0; i<nbReads; i++){
+			reads[i].resize(readSize);
+			for(size_t j=0; j<readSize; j++){
+				state ^= state << 13;
+				state ^= state >> 7;
+				state ^= state << 17;
+				reads[i][j] = nucleotides[state >> 62];
+			}
+		}
+
+		return reads;
+	}
+};
+
+
 
 
 
@@ -268,6 +307,8 @@ public:
 
 		stats();
 
+		if(this->_update) finishUpdate();
+
 
 		if(this->_options->getInt(STR_VERBOSE) != 0){
 			cout << endl;
@@ -283,6 +324,8 @@ public:
 			system(command.c_str());
 			command = "rm -rf " + this->_outputDirTemp + "/count_synchro/";
 			system(command.c_str());
+			command = "rm -rf " + this->_outputDirTemp + "/count_cache/";
+			system(command.c_str());
 			command = "rm -rf " + this->_outputDirTemp + "/merge_synchro/";
 			system(command.c_str());
 			command = "rm -rf " + this->_outputDirTemp + "/stats/";
@@ -299,7 +342,7 @@ public:
 
 			command = "rm " + this->_outputDirTemp + "/config.h5";
 			system(command.c_str());
-			command = "rm " + this->_outputDirTemp + "/datasetIds";
+			command = "rm " + this->_outputDirTemp + "/datasets.bin";
 			system(command.c_str());
 			//cout << command << endl;
 			//System::file().rmdir(this->_outputDirTemp);
@@ -414,27 +457,93 @@ public:
 		SimkaAlgorithm<span>::setup();
 
 		createDirs();
+		_nbPreviousBanks = 0;
+		if(this->_update) setupUpdate();
 		layoutInputFilename();
 
 	}
 
-	void layoutInputFilename(){
+	/*
+	 * Update mode: the datasets of the previous run are placed before the datasets of the input file, so that
+	 * their count files and the statistics of the previous run can be used as is. The statistics of each
+	 * partition are moved to stats/part_<i>.prev.gz, the merge only computes the pairs involving a new dataset.
+	 */
+	void setupUpdate(){
 
-		//SimkaAlgorithm<span>::layoutInputFilename();
+		string catalogFilename = this->_outputDirTemp + "/datasets.bin";
+		string previousCatalogFilename = this->_outputDirTemp + "/datasets.prev.bin";
 
-		string datasetIdFilename = this->_outputDirTemp + "/" + "datasetIds";
-		IFile* datasetIdFile = System::file().newFile(datasetIdFilename, "wb");
+		//When resuming an interrupted update, the previous files have already been moved
+		if(!System::file().doesExist(previousCatalogFilename)){
 
-		for(size_t i=0; i<this->_bankNames.size(); i++){
-			string bankName = this->_bankNames[i];
+			if(!System::file().doesExist(catalogFilename) || !System::file().doesExist(this->_outputDirTemp + "/stats/part_0.gz")){
+				cerr << "ERROR: " << STR_SIMKA_UPDATE << " requires the temporary files of the previous run (same -out-tmp, run with " << STR_SIMKA_KEEP_TMP_FILES << ")" << endl;
+				exit(1);
+			}
+
+			string statsDir = this->_outputDirTemp + "/stats/";
+			vector<string> filenames = System::file().listdir(statsDir);
+			for(size_t i=0; i<filenames.size(); i++){
+				if(filenames[i].find("part_") != 0) continue;
+				string previousFilename = filenames[i].substr(0, filenames[i].size()-3) + ".prev.gz";
+				System::file().rename(statsDir + filenames[i], statsDir + previousFilename);
+			}
+
+			string mergeSynchroDir = this->_outputDirTemp + "/merge_synchro/";
+			filenames = System::file().listdir(mergeSynchroDir);
+			for(size_t i=0; i<filenames.size(); i++){
+				if(filenames[i] == "." || filenames[i] == "..") continue;
+				System::file().remove(mergeSynchroDir + filenames[i]);
+			}
+
+			System::file().rename(catalogFilename, previousCatalogFilename);
+		}
+
+		vector<string> bankNames;
+		vector<size_t> nbBankPerDataset;
+		SimkaDatasetCatalog catalog;
 
-			string bankIdLine = bankName + '\n';
-			datasetIdFile->fwrite(bankIdLine.c_str(), bankIdLine.size(), 1);
+		SimkaDatasetCatalogFile previousCatalog(previousCatalogFilename);
+		for(size_t i=0; i<previousCatalog.size(); i++){
+
+			SimkaDataset dataset = previousCatalog.get(i);
+
+			if(!System::file().doesExist(this->_outputDirTemp + "/count_synchro/" + dataset._id + ".ok")){
+				cerr << "ERROR: counts of previous dataset " << dataset._id << " not found" << endl;
+				exit(1);
+			}
+
+			bankNames.push_back(dataset._id);
+			nbBankPerDataset.push_back(dataset._nbPaired); //Not used, previous datasets are not counted again
+			catalog.add(dataset);
+		}
+
+		_nbPreviousBanks = bankNames.size();
+
+		for(size_t i=0; i<this->_bankNames.size(); i++){
+			if(std::find(bankNames.begin(), bankNames.begin() + _nbPreviousBanks, this->_bankNames[i]) != bankNames.begin() + _nbPreviousBanks){
+				cerr << "ERROR: dataset " << this->_bankNames[i] << " is already in the results of the previous run" << endl;
+				exit(1);
+			}
+			bankNames.push_back(this->_bankNames[i]);
+			nbBankPerDataset.push_back(this->_nbBankPerDataset[i]);
+			catalog.add(this->_catalog[i]);
 		}
 
-		datasetIdFile->flush();
-		delete datasetIdFile;
+		this->_bankNames = bankNames;
+		this->_catalog = catalog;
+		this->_nbBankPerDataset = nbBankPerDataset;
+		this->_nbBanks = this->_bankNames.size();
+
+		cout << "Update: " << _nbPreviousBanks << " previous datasets, " << (this->_nbBanks - _nbPreviousBanks) << " new datasets" << endl << endl;
+	}
+
+	//The sub commands read the datasets of the run from the catalog
+	void layoutInputFilename(){
 
+		//SimkaAlgorithm<span>::layoutInputFilename();
+
+		this->_catalog.save(this->_outputDirTemp + "/datasets.bin");
 	}
 
 
@@ -463,6 +572,8 @@ public:
 		System::file().mkdir(this->_outputDirTemp + "/job_count/", -1);
 		System::file().mkdir(this->_outputDirTemp + "/job_merge/", -1);
 		System::file().mkdir(this->_outputDirTemp + "/kmercount_per_partition/", -1);
+		System::file().mkdir(this->_outputDirTemp + "/count_cache/", -1);
+		if(this->_countCacheDir != "") System::file().mkdir(this->_countCacheDir, -1);
 
 	}
 
@@ -525,10 +636,14 @@ public:
 		_coresPerMergeJob = maxCores / _maxJobMerge;
 		_coresPerMergeJob = max((size_t)1, _coresPerMergeJob);
 
+		//Bounds the fan-in of the intermediate merges of a partition (see SimkaMergeCascade)
+		_memoryPerMergeJob = maxMemory / _maxJobMerge;
+		_memoryPerMergeJob = max(_memoryPerMergeJob, (size_t)minMemoryPerJobMB);
+
 		cout << endl;
 		cout << "Maximum ressources used by Simka: " << endl;
 		cout << "\t - " << _maxJobCount << " simultaneous processes for counting the kmers (per job: " << _coresPerJob << " cores, " << _memoryPerJob << " MB memory)" << endl;
-		cout << "\t - " << _maxJobMerge << " simultaneous processes for merging the kmer counts (per job: " << _coresPerMergeJob << " cores, memory undefined)" << endl;
+		cout << "\t - " << _maxJobMerge << " simultaneous processes for merging the kmer counts (per job: " << _coresPerMergeJob << " cores, " << _memoryPerMergeJob << " MB memory)" << endl;
 		cout << endl;
 
 
@@ -563,6 +678,10 @@ public:
 				_nbPartitions = config->_nb_partitions;
 				delete config;
 
+				if(this->_fixedPartitions && _nbPartitions != this->_fixedPartitions){
+					throw Exception ("config has %d partitions instead of %d", (int)_nbPartitions, (int)this->_fixedPartitions);
+				}
+
 				Repartitor* repartitor = new Repartitor();
 				//LOCAL(repartitor);
 				repartitor->load(storage->getGroup(""));
@@ -594,11 +713,20 @@ public:
     	SimkaSequenceFilter dummyFilter(0, 0);
     	//vector<SimkaBankFiltered<SimkaSequenceFilter>*> banksToDelete;
 
-    	string inputDir = this->_outputDirTemp + "/input/";
     	u_int64_t maxPart = 0;
+    	bool hasStreamDatasets = false;
+
+    	if(this->_profiles.size() != this->_nbBanks) this->computeProfiles();
+
     	for (size_t i=0; i<this->_nbBanks; i++){
 
-    		IBank* bank = Bank::open(inputDir + this->_bankNames[i]);
+    		//Pipes are read only once, by simkaCount
+    		if(this->isStreamDataset(i)){
+    			hasStreamDatasets = true;
+    			continue;
+    		}
+
+    		IBank* bank = new SimkaBankProfile(this->_profiles[i]);
     		LOCAL(bank);
 
     		//size_t nbBank_ = bank->getCompositionNb();
@@ -636,12 +764,28 @@ public:
 
 
 
+		if(hasStreamDatasets && !this->_fixedPartitions){
+			cerr << "ERROR: datasets read from pipes require " << STR_SIMKA_FIXED_PARTITIONS << " (the number of partitions can't be computed from their size)" << endl;
+			exit(1);
+		}
+
+		//A pipe of this host can't be read by the counting jobs of the cluster nodes
+		if(hasStreamDatasets && _isClusterMode){
+			cerr << "ERROR: datasets read from pipes can't be counted in cluster mode (" << STR_SIMKA_JOB_COUNT_COMMAND << ")" << endl;
+			exit(1);
+		}
+
 		this->_options->setInt(STR_MAX_MEMORY, _memoryPerJob);
 
-    	IBank* inputbank = Bank::open(this->_banksInputFilename);
-    	LOCAL(inputbank);
+		//With pipes, the configuration is computed on the largest regular dataset (or on random reads)
+		IBank* inputbank = 0;
+		if(hasStreamDatasets) inputbank = new SimkaBankRandom(SIMKA_FIXED_REPARTITION_NB_READS, SIMKA_FIXED_REPARTITION_READ_SIZE);
+		else inputbank = Bank::open(this->_banksInputFilename);
+		LOCAL(inputbank);
 
-		IBank* bank = Bank::open(this->_outputDirTemp + "/input/" + this->_bankNames[chosenBankId]);
+		IBank* bank = 0;
+		if(maxPart == 0) bank = new SimkaBankRandom(SIMKA_FIXED_REPARTITION_NB_READS, SIMKA_FIXED_REPARTITION_READ_SIZE);
+		else bank = Bank::open(this->_outputDirTemp + "/input/" + this->_bankNames[chosenBankId]);
 		LOCAL(bank);
 
 		//IBank* bank = Bank::open(_outputDirTemp + "/input/" + _bankNames[0]);
@@ -686,14 +830,36 @@ public:
 		_nbPartitions = max((size_t)maxPart, (size_t)_maxJobMerge);
 		//_nbPartitions = max(_nbPartitions, (size_t)32);
 
+		if(this->_fixedPartitions){
+			if(this->_fixedPartitions < maxPart){
+				cout << "WARNING: " << STR_SIMKA_FIXED_PARTITIONS << " " << this->_fixedPartitions << " is lower than the number of partitions required by the largest dataset (" << maxPart << "), counting will use more memory" << endl;
+			}
+			_nbPartitions = this->_fixedPartitions;
+		}
+
 		cout << "Nb partitions: " << _nbPartitions << " partitions" << endl << endl << endl;
 		//_nbPartitions = max((int)_nbPartitions, (int)30);
 
 		config1._nb_partitions = _nbPartitions;
 		config2._nb_partitions = _nbPartitions;
 
-        RepartitorAlgorithm<span> repart (inputbank, storage->getGroup(""), config1);
-        repart.execute ();
+		if(this->_fixedPartitions){
+			//The repartition only depends on the kmer size, the minimizer parameters and the number of partitions
+			IBank* randomBank = new SimkaBankRandom(SIMKA_FIXED_REPARTITION_NB_READS, SIMKA_FIXED_REPARTITION_READ_SIZE);
+			LOCAL(randomBank);
+
+			ConfigurationAlgorithm<span> randomConfig(randomBank, this->_options);
+			randomConfig.execute();
+			Configuration config3 = randomConfig.getConfiguration();
+			config3._nb_partitions = _nbPartitions;
+
+			RepartitorAlgorithm<span> repart (randomBank, storage->getGroup(""), config3);
+			repart.execute ();
+		}
+		else{
+			RepartitorAlgorithm<span> repart (inputbank, storage->getGroup(""), config1);
+			repart.execute ();
+		}
 
 
 		uint64_t memoryUsageCachedItems;
@@ -815,6 +981,30 @@ public:
 			}
 			//else{
 
+			string countCacheKeyFilename = "";
+			//The fingerprint of a pipe does not identify its contents
+			if(this->_countCacheDir != "" && !this->isStreamDataset(i)){
+				string key = getCountCacheKey(i);
+				string entryDir = SimkaCountCache::getEntryDir(this->_countCacheDir, key);
+
+				if(SimkaCountCache::isValid(entryDir, key)){
+					string packFilename = this->_outputDirTemp + "/solid/__p__" + SimkaAlgorithm<>::toString(i) + ".pack";
+					string kmerCountFilename = this->_outputDirTemp + "/kmercount_per_partition/" + this->_bankNames[i] + ".txt";
+					SimkaCountCache::restore(entryDir, packFilename, kmerCountFilename, finishFilename);
+					removeMergeSynchro();
+
+					_progress->inc(1);
+					cout << "	" << this->_bankNames[i] << " found in count cache (" << entryDir << ")" << endl;
+					continue;
+				}
+
+				countCacheKeyFilename = this->_outputDirTemp + "/count_cache/" + this->_bankNames[i] + ".txt";
+				IFile* keyFile = System::file().newFile(countCacheKeyFilename, "w");
+				keyFile->fwrite(key.c_str(), key.size(), 1);
+				keyFile->flush();
+				delete keyFile;
+			}
+
 			string tempDir = this->_outputDirTemp + "/temp/" + this->_bankNames[i];
 
 			string command = "nohup " + _execDir + "/simkaCountProcess " + _execDir + "/simkaCount ";
@@ -831,8 +1021,13 @@ public:
 			command += " " + string(STR_KMER_ABUNDANCE_MAX) + " " + SimkaAlgorithm<>::toString(this->_abundanceThreshold.second);
 			command += " " + string(STR_SIMKA_MIN_READ_SIZE) + " " + SimkaAlgorithm<>::toString(this->_minReadSize);
 			command += " " + string(STR_SIMKA_MIN_READ_SHANNON_INDEX) + " " + Stringify::format("%f", this->_minReadShannonIndex);
+			command += " " + string(STR_SIMKA_MIN_KMER_SHANNON_INDEX) + " " + Stringify::format("%f", this->_minKmerShannonIndex);
+			if(this->_singletonFilter) command += " " + string(STR_SIMKA_SINGLETON_FILTER);
+			command += " " + string(STR_SIMKA_SCALED) + " " + SimkaAlgorithm<>::toString(this->_scaled);
 			command += " " + string(STR_SIMKA_MAX_READS) + " " + SimkaAlgorithm<>::toString(this->_maxNbReads);
 			command += " -nb-partitions " + SimkaAlgorithm<>::toString(_nbPartitions);
+			if(countCacheKeyFilename != "") command += " " + string(STR_SIMKA_COUNT_CACHE) + " " + this->_countCacheDir + " -count-cache-key " + countCacheKeyFilename;
+			if(this->_readCacheDir != "") command += " " + string(STR_SIMKA_READ_CACHE) + " " + this->_readCacheDir;
 			//command += " -verbose " + Stringify::format("%d", this->_options->getInt(STR_VERBOSE));
 			command += " >> " + logFilename + " 2>&1";
 
@@ -941,6 +1136,29 @@ public:
 
 	    _progress->finish();
 	    delete _progress;
+
+	    if(this->_countCacheDir != "") SimkaCountCache::evict(this->_countCacheDir, this->_countCacheMaxSize);
+	}
+
+	/*
+	 * Everything the count files of a dataset depend on: the input files and the counting parameters.
+	 */
+	string getCountCacheKey(size_t i){
+
+		string key = "";
+		key += "pack-version " + SimkaAlgorithm<>::toString(SIMKA_PACK_VERSION) + "\n";
+		key += "kmer-size " + SimkaAlgorithm<>::toString(this->_kmerSize) + "\n";
+		key += "partitions " + SimkaAlgorithm<>::toString(this->_fixedPartitions) + " " + SimkaAlgorithm<>::toString(SIMKA_FIXED_REPARTITION_NB_READS) + " " + SimkaAlgorithm<>::toString(SIMKA_FIXED_REPARTITION_READ_SIZE) + "\n";
+		key += "minimizers " + this->_options->getStr(STR_MINIMIZER_SIZE) + " " + this->_options->getStr(STR_MINIMIZER_TYPE) + " " + this->_options->getStr(STR_REPARTITION_TYPE) + "\n";
+		key += "abundance " + SimkaAlgorithm<>::toString(this->_abundanceThreshold.first) + " " + SimkaAlgorithm<>::toString(this->_abundanceThreshold.second) + "\n";
+		key += "read-filter " + SimkaAlgorithm<>::toString(this->_minReadSize) + " " + Stringify::format("%f", this->_minReadShannonIndex) + "\n";
+		key += "kmer-filter " + Stringify::format("%f", this->_minKmerShannonIndex) + " " + SimkaAlgorithm<>::toString(this->_scaled) + "\n";
+		//The false positives of the singleton filter depend on the size of its Bloom filter
+		if(this->_singletonFilter) key += "singleton-filter " + SimkaAlgorithm<>::toString(_memoryPerJob) + "\n";
+		key += "max-reads " + SimkaAlgorithm<>::toString(this->_maxNbReads) + " " + SimkaAlgorithm<>::toString(this->_nbBankPerDataset[i]) + "\n";
+		key += SimkaCountCache::getDatasetFingerprint(this->_outputDirTemp + "/input/" + this->_bankNames[i]);
+
+		return key;
 	}
 
 	void merge(){
@@ -987,9 +1205,11 @@ public:
 				command += " " + string(STR_URI_INPUT) + " " + this->_inputFilename;
 				command += " " + string("-out-tmp-simka") + " " + this->_outputDirTemp;
 				command += " -partition-id " + SimkaAlgorithm<>::toString(i);
-				command += " " + string(STR_MAX_MEMORY) + " " + SimkaAlgorithm<>::toString(this->_maxMemory / this->_nbCores);
+				command += " " + string(STR_MAX_MEMORY) + " " + SimkaAlgorithm<>::toString(_memoryPerMergeJob);
 				command += " " + string(STR_NB_CORES) + " " + SimkaAlgorithm<>::toString(_coresPerMergeJob);
 				command += " " + string(STR_SIMKA_MIN_KMER_SHANNON_INDEX) + " " + Stringify::format("%f", this->_minKmerShannonIndex);
+				if(_nbPreviousBanks > 0) command += " -update-from " + SimkaAlgorithm<>::toString(_nbPreviousBanks);
+				if(this->_maxMergeFanIn > 0) command += " " + STR_SIMKA_MAX_MERGE_FAN_IN + " " + SimkaAlgorithm<>::toString(this->_maxMergeFanIn);
 				command += " -verbose " + Stringify::format("%d", this->_options->getInt(STR_VERBOSE));
 				if(this->_computeSimpleDistances) command += " " + string(STR_SIMKA_COMPUTE_ALL_SIMPLE_DISTANCES);
 				if(this->_computeComplexDistances) command += " " + string(STR_SIMKA_COMPUTE_ALL_COMPLEX_DISTANCES);
@@ -1121,6 +1341,18 @@ public:
 
 	}*/
 
+	//The results now include the new datasets, they are the previous results of the next update
+	void finishUpdate(){
+
+		string statsDir = this->_outputDirTemp + "/stats/";
+		for(size_t i=0; i<_nbPartitions; i++){
+			string previousFilename = statsDir + "part_" + SimkaAlgorithm<>::toString(i) + ".prev.gz";
+			if(System::file().doesExist(previousFilename)) System::file().remove(previousFilename);
+		}
+
+		System::file().remove(this->_outputDirTemp + "/datasets.prev.bin");
+	}
+
 	void stats(){
 		cout << endl << "Computing stats..." << endl;
 		//cout << this->_nbBanks << endl;
@@ -1164,6 +1396,7 @@ public:
 	size_t _memoryPerJob;
 	size_t _coresPerJob;
 	size_t _coresPerMergeJob;
+	size_t _memoryPerMergeJob;
 
 	//IBank* _banks;
 	//IProperties* _options;
@@ -1171,6 +1404,7 @@ public:
 	//vector<string> _bankNames;
 	//vector<size_t> _nbBankPerDataset;
     size_t _nbPartitions;
+    size_t _nbPreviousBanks;
     //size_t _nbBanks;
 	//vector<u_int64_t> _nbReadsPerDataset;
     //string _banksInputFilename;
@@ -28,6 +28,7 @@ IOptionsParser* Simka::createOptionsParser (IOptionsParser* parent)
 
 	//Main parser
     parser->push_front (new OptionNoParam (STR_SIMKA_COMPUTE_DATA_INFO, "compute (and display) information before running Simka, such as the number of reads per dataset", false));
+    parser->push_front (new OptionNoParam (STR_SIMKA_UPDATE, "add the datasets of the input file to the results of a previous run (same -out-tmp, run with " + STR_SIMKA_KEEP_TMP_FILES + ")", false));
     parser->push_front (new OptionNoParam (STR_SIMKA_KEEP_TMP_FILES, "keep temporary files", false));
     parser->push_front (new OptionOneParam (STR_URI_OUTPUT_TMP, "output directory for temporary files", true));
     parser->push_front (new OptionOneParam (STR_URI_OUTPUT, "output directory for result files (distance matrices)", false, "./simka_results"));
@@ -60,7 +61,7 @@ IOptionsParser* Simka::createOptionsParser (IOptionsParser* parent)
 
 	//Kmer parser
     IOptionsParser* kmerParser = new OptionsParser ("kmer");
-    kmerParser->push_back (new OptionOneParam (STR_KMER_SIZE, "size of a kmer", false, "21"));
+    kmerParser->push_back (new OptionOneParam (STR_KMER_SIZE, "size of a kmer (comma separated list of sizes to compute the results of each size, e.g. 15,21,31)", false, "21"));
     //kmerParser->push_back(dskParser->getParser (STR_KMER_SIZE));
     //kmerParser->push_back(new OptionOneParam (STR_KMER_PER_READ.c_str(), "number of selected kmers per read", false, "0"));
     //kmerParser->push_back (new OptionOneParam (STR_KMER_ABUNDANCE_MIN, "min abundance a kmer need to be considered", false, "1"));
@@ -75,6 +76,8 @@ IOptionsParser* Simka::createOptionsParser (IOptionsParser* parent)
     //kmerParser->getParser (STR_SOLIDITY_KIND)->setHelp("TODO");
     //kmerParser->push_back (new OptionNoParam (STR_SIMKA_SOLIDITY_PER_DATASET.c_str(), "do not take into consideration multi-counting when determining solid kmers", false ));
     kmerParser->push_back (new OptionOneParam (STR_SIMKA_MIN_KMER_SHANNON_INDEX.c_str(), "minimal Shannon index a kmer should have to be kept. Float in [0,2]", false, "0" ));
+    kmerParser->push_back (new OptionOneParam (STR_SIMKA_SCALED.c_str(), "keep only the kmers whose hash is below 2^64/s (about 1 kmer out of s). 1: keep all kmers", false, "1" ));
+    kmerParser->push_back (new OptionNoParam (STR_SIMKA_SINGLETON_FILTER.c_str(), "filter out kmers seen one time (potentially erroneous) with a Bloom filter before counting", false));
 
 
     //Read filter parser
@@ -87,6 +90,10 @@ IOptionsParser* Simka::createOptionsParser (IOptionsParser* parent)
     IOptionsParser* coreParser = new OptionsParser ("core");
     coreParser->push_back(new OptionOneParam(STR_NB_CORES, "number of cores", false, "0"));
     coreParser->push_back (new OptionOneParam (STR_MAX_MEMORY, "max memory (MB)", false, "5000"));
+    coreParser->push_back (new OptionOneParam (STR_SIMKA_FIXED_PARTITIONS.c_str(), "number of partitions of a repartition of the kmers independent of the input datasets, required to reuse count files in other runs. 0: computed from the datasets", false, "0"));
+    coreParser->push_back (new OptionOneParam (STR_SIMKA_COUNT_CACHE.c_str(), "directory of a cache of the kmer counts shared by several runs (requires " + STR_SIMKA_FIXED_PARTITIONS + ")", false, ""));
+    coreParser->push_back (new OptionOneParam (STR_SIMKA_COUNT_CACHE_MAX_SIZE.c_str(), "max size of the count cache (MB), least recently used counts are removed first. 0: unlimited", false, "0"));
+    coreParser->push_back (new OptionOneParam (STR_SIMKA_MAX_MERGE_FAN_IN.c_str(), "max number of count files read at once by a merge, the count files of a partition are first merged into intermediate files above it. 0: bounded by the open files limit and the memory", false, "0"));
     //coreParser->push_back(dskParser->getParser ());
     //coreParser->push_back(dskParser->getParser (STR_MAX_DISK));
 
@@ -19,6 +19,7 @@
  *****************************************************************************/
 
 #include "SimkaAlgorithm.hpp"
+#include "SimkaInputReader.hpp"
 
 static const char* strProgressPartitionning = "Simka: Step 1: partitioning    ";
 static const char* strProgressCounting =      "Simka: Step 2: counting kmers  ";
@@ -162,7 +163,7 @@ bool SimkaAlgorithm<span>::setup() {
 		layoutInputFilename();
 	}
 	catch (Exception& e){
-		cout << "Syntax error in input file" << endl;
+		cout << "Syntax error in input file (" << e.getMessage() << ")" << endl;
 		return false;
 	}
 
@@ -204,6 +205,26 @@ void SimkaAlgorithm<span>::parseArgs() {
 	_minKmerShannonIndex = std::max(_minKmerShannonIndex, 0.0);
 	_minKmerShannonIndex = std::min(_minKmerShannonIndex, 2.0);
 
+	_singletonFilter = _options->get(STR_SIMKA_SINGLETON_FILTER);
+	_update = _options->get(STR_SIMKA_UPDATE);
+	_scaled = std::max(_options->getInt(STR_SIMKA_SCALED), (int64_t)1);
+	_fixedPartitions = std::max(_options->getInt(STR_SIMKA_FIXED_PARTITIONS), (int64_t)0);
+
+	_countCacheDir = _options->getStr(STR_SIMKA_COUNT_CACHE);
+	_readCacheDir = _options->get(STR_SIMKA_READ_CACHE) ? _options->getStr(STR_SIMKA_READ_CACHE) : "";
+	_countCacheMaxSize = std::max(_options->getInt(STR_SIMKA_COUNT_CACHE_MAX_SIZE), (int64_t)0);
+	_maxMergeFanIn = std::max(_options->getInt(STR_SIMKA_MAX_MERGE_FAN_IN), (int64_t)0);
+	if(_countCacheDir != "" && _fixedPartitions == 0){
+		cerr << "ERROR: " << STR_SIMKA_COUNT_CACHE << " requires " << STR_SIMKA_FIXED_PARTITIONS << " (the count files must not depend on the input datasets)" << endl;
+		exit(1);
+	}
+
+	//The counts of the previous datasets must have been computed with the same number of reads
+	if(_update && _maxNbReads == 0){
+		cerr << "ERROR: " << STR_SIMKA_UPDATE << " requires the value of " << STR_SIMKA_MAX_READS << " used by the previous run (-1 for all reads)" << endl;
+		exit(1);
+	}
+
 	if(!System::file().doesExist(_inputFilename)){
 		cerr << "ERROR: Input filename does not exist" << endl;
 		exit(1);
@@ -249,135 +270,126 @@ void SimkaAlgorithm<span>::layoutInputFilename(){
 	}
 
 	string inputDir = _outputDirTemp + "/input/";
-	ifstream inputFile(_inputFilename.c_str());
 
-	_banksInputFilename =  inputDir + "__input_simka__"; //_inputFilename + "_dsk_dataset_temp__";
-	IFile* bankFile = System::file().newFile(_banksInputFilename, "wb");
-
-	string line;
-	string linePart;
-	vector<string> lineIdDatasets;
-	vector<string> linepartPairedDatasets;
-	vector<string> linepartDatasets;
+	_catalog = SimkaDatasetCatalog();
+	_catalog.parse(_inputFilename);
 
+	_banksInputFilename =  inputDir + "__input_simka__"; //_inputFilename + "_dsk_dataset_temp__";
 	string bankFileContents = "";
 
-	u_int64_t lineIndex = 0;
-
-	while(getline(inputFile, line)){
+	for(size_t i=0; i<_catalog.size(); i++){
 
-		line.erase(std::remove(line.begin(),line.end(),' '),line.end());
-		if(line == "") continue;
+		const SimkaDataset& dataset = _catalog[i];
 
-		//cout << line << endl;
-		lineIdDatasets.clear();
-		linepartPairedDatasets.clear();
-		//vector<string> filenames;
+		SimkaDatasetCatalog::writeBankFile(inputDir + dataset._id, dataset);
 
-		stringstream lineStream(line);
-		while(getline(lineStream, linePart, ':')){
-			lineIdDatasets.push_back(linePart);
-		}
+		if(i > 0) bankFileContents += "\n";
+		bankFileContents += inputDir + "/" + dataset._id;
 
-		string bankId = lineIdDatasets[0];
-		string linePairedDatasets = lineIdDatasets[1];
+		_bankNames.push_back(dataset._id);
+		_nbBankPerDataset.push_back(dataset._nbPaired);
+	}
 
-		stringstream linePairedDatasetsStream(linePairedDatasets);
-		while(getline(linePairedDatasetsStream, linePart, ';')){
-			linepartPairedDatasets.push_back(linePart);
-		}
+	IFile* bankFile = System::file().newFile(_banksInputFilename, "wb");
+	bankFile->fwrite(bankFileContents.c_str(), bankFileContents.size(), 1);
+	bankFile->flush();
+	delete bankFile;
 
-		string subBankFilename = inputDir + bankId;
-		IFile* subBankFile = System::file().newFile(subBankFilename, "wb");
-		//cout << subBankFile->getPath() << endl;
-		string subBankContents = "";
-		_nbBankPerDataset.push_back(linepartPairedDatasets.size());
 
-		for(size_t i=0; i<linepartPairedDatasets.size(); i++){
-			string lineDatasets = linepartPairedDatasets[i];
+	if(_options->getInt(STR_VERBOSE) != 0){
+		cout << "\tNb input datasets: " << _bankNames.size() << endl;
+		cout << endl;
+	}
 
-			linepartDatasets.clear();
+}
 
-			stringstream lineDatasetsStream(lineDatasets);
-			while(getline(lineDatasetsStream, linePart, ',')){
-				linepartDatasets.push_back(linePart);
-				//cout << "\t" << linePart << endl;
-			}
 
-			//bankFileContents += linepartDatasets[0] + "\n";
+template<size_t span>
+bool SimkaAlgorithm<span>::isInputValid(){
 
+	//The datasets are opened by a pool of threads, opening a bank reads the beginning of its files
+	vector<bool> isValid(_nbBanks, true);
+	std::mutex mutex;
 
-			for(size_t i=0; i<linepartDatasets.size(); i++){
-				string filename = linepartDatasets[i];
-				if(filename.at(0) == '/'){
-					subBankContents +=  filename + "\n";
-				}
-				else{
-					string dir = System::file().getRealPath(_inputFilename);
-					dir = System::file().getDirectory(dir);
-					subBankContents +=  dir + "/" + filename + "\n";
-				}
-			}
+	SimkaCommons::runThreads(_nbBanks, _nbCores, [&](size_t i){
+		bool valid = isDatasetValid(i);
 
-		}
+		std::lock_guard<std::mutex> lock(mutex);
+		isValid[i] = valid;
+	});
 
-		subBankContents.erase(subBankContents.size()-1);
-		subBankFile->fwrite(subBankContents.c_str(), subBankContents.size(), 1);
-		subBankFile->flush();
-		delete subBankFile;
+	bool isInputValid = true;
+	for (size_t i=0; i<_nbBanks; i++){
+		if(isValid[i]) continue;
+		cerr << "ERROR: Can't open dataset: " << _bankNames[i] << endl;
+		isInputValid = false;
+	}
 
-		bankFileContents += inputDir + "/" + bankId + "\n";
-		lineIndex += 1;
+	return isInputValid;
+}
 
-		_bankNames.push_back(bankId);
+template<size_t span>
+bool SimkaAlgorithm<span>::isDatasetValid(size_t i){
 
+	string inputDir = _outputDirTemp + "/input/";
 
+	vector<string> filenames = SimkaBankFastx::getFilenames(inputDir + _bankNames[i]);
+	for(size_t j=0; j<filenames.size(); j++){
+		if(SimkaBankFastx::isStandardInput(filenames[j])){
+			cerr << "ERROR: the standard input of simka can't be read by the counting jobs (" << filenames[j] << "), use a named pipe" << endl;
+			return false;
+		}
 	}
 
+	//A pipe can be read only once, by simkaCount
+	if(isStreamDataset(i)){
+		for(size_t j=0; j<filenames.size(); j++){
+			if(!System::file().doesExist(filenames[j])) return false;
+		}
+		return true;
+	}
 
-	inputFile.close();
-
-	bankFileContents.erase(bankFileContents.size()-1);
-	bankFile->fwrite(bankFileContents.c_str(), bankFileContents.size(), 1);
-	bankFile->flush();
-	delete bankFile;
-
-
-	if(_options->getInt(STR_VERBOSE) != 0){
-		cout << "\tNb input datasets: " << _bankNames.size() << endl;
-		cout << endl;
+	try{
+		IBank* bank = Bank::open(inputDir + _bankNames[i]);
+		LOCAL(bank);
+	}
+	catch (Exception& e){
+		return false;
 	}
 
+	return true;
 }
 
+template<size_t span>
+bool SimkaAlgorithm<span>::isStreamDataset(size_t i){
+	return SimkaBankFastx::isStream(_outputDirTemp + "/input/" + _bankNames[i]);
+}
 
+/*
+ * Estimated size of each dataset, the profiles are cached in the temp dir (see SimkaDatasetProfiler).
+ * Datasets read from pipes are not profiled.
+ */
 template<size_t span>
-bool SimkaAlgorithm<span>::isInputValid(){
+void SimkaAlgorithm<span>::computeProfiles(){
 
 	string inputDir = _outputDirTemp + "/input/";
 
+	vector<string> bankFilenames;
 	for (size_t i=0; i<_nbBanks; i++){
-
-		try{
-			IBank* bank = Bank::open(inputDir + _bankNames[i]);
-			LOCAL(bank);
-		}
-		catch (Exception& e){
-			cerr << "ERROR: Can't open dataset: " << _bankNames[i] << endl;
-			return false;
-		}
-
+		bankFilenames.push_back(isStreamDataset(i) ? "" : inputDir + _bankNames[i]);
 	}
 
-	return true;
+	SimkaDatasetProfiler profiler(_outputDirTemp + "/profiles.txt");
+	_profiles = profiler.profile(bankFilenames, _nbCores);
 
+	if(_options->getInt(STR_VERBOSE) != 0){
+		cout << "Dataset profiles: " << profiler.getNbCached() << " cached, " << (_nbBanks - profiler.getNbCached()) << " computed" << endl;
+	}
 }
 
 template<size_t span>
 void SimkaAlgorithm<span>::computeMaxReads(){
 
-	string inputDir = _outputDirTemp + "/input/";
-
 	//if(_maxNbReads != 0){
 	//	return;
 	//}
@@ -396,12 +408,24 @@ void SimkaAlgorithm<span>::computeMaxReads(){
 
 	if(_maxNbReads == 0 || _options->get(STR_SIMKA_COMPUTE_DATA_INFO)){
 
+		if(_profiles.size() != _nbBanks) computeProfiles();
+
+		u_int64_t nbEstimatedBanks = 0;
+
 		for (size_t i=0; i<_nbBanks; i++){
 
-			IBank* bank = Bank::open(inputDir + _bankNames[i]);
-			LOCAL(bank);
+			//The size of a pipe is unknown
+			if(isStreamDataset(i)){
+				if(_maxNbReads == 0){
+					cerr << "ERROR: the number of reads of dataset " << _bankNames[i] << " can't be estimated (input read from a pipe), use option " << STR_SIMKA_MAX_READS << endl;
+					exit(1);
+				}
+				continue;
+			}
+
+			nbEstimatedBanks += 1;
 
-			u_int64_t nbReads = bank->estimateNbItems();
+			u_int64_t nbReads = _profiles[i]._nbReads;
 			nbReads /= _nbBankPerDataset[i];
 			totalReads += nbReads;
 			if(nbReads < minReads){
@@ -415,7 +439,7 @@ void SimkaAlgorithm<span>::computeMaxReads(){
 
 		}
 
-		meanReads = totalReads / _nbBanks;
+		meanReads = nbEstimatedBanks > 0 ? totalReads / nbEstimatedBanks : 0;
 
 		if(_options->getInt(STR_VERBOSE) != 0){
 			cout << "Smaller sample contains: " << minReads << " reads" << endl;
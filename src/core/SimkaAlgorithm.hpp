@@ -37,6 +37,7 @@
 //#define MULTI_DISK
 //#define SIMKA_MIN
 #include "SimkaDistance.hpp"
+#include "SimkaDatasetProfiler.hpp"
 
 
 
@@ -50,6 +51,22 @@ enum SIMKA_SOLID_KIND{
 typedef u_int16_t bankIdType;
 
 
+/*
+ * Count of a kmer in a dataset. The counts of a merged kmer are only given for the datasets which
+ * have it, by increasing bank id (see SimkaCounterBuilderMerge): most kmers are in a few datasets.
+ */
+struct SimkaSparseCount
+{
+	bankIdType _bankId;
+	CountNumber _count;
+
+	SimkaSparseCount() : _bankId(0), _count(0) {}
+	SimkaSparseCount(bankIdType bankId, CountNumber count) : _bankId(bankId), _count(count) {}
+};
+
+typedef vector<SimkaSparseCount> SparseCountVector;
+
+
 
 
 
@@ -138,12 +155,14 @@ private:
 
     u_int64_t _nbKmerCounted;
     double _minKmerShannonIndex;
+    size_t _firstNewBank;
 
     //vector<size_t> _banksOks;
 
     vector<u_int16_t> _sharedBanks;
+    CountVector _denseCounts;
 
-	typedef std::pair<double, CountVector> chi2val_Abundances;
+	typedef std::pair<double, SparseCountVector> chi2val_Abundances;
 	struct _chi2ValueSorterFunction { bool operator() (chi2val_Abundances l,chi2val_Abundances r) { return r.first < l.first; } } ;
 	std::priority_queue< chi2val_Abundances, vector<chi2val_Abundances>, _chi2ValueSorterFunction> _chi2ValueSorter;
 	size_t _maxChi2Values;
@@ -163,25 +182,32 @@ public:
 
     	_nbBanks = nbBanks;
     	_kmerSize = kmerSize;
+    	_denseCounts.resize(_nbBanks, 0);
     	//_abundanceThreshold = abundanceThreshold;
     	_minKmerShannonIndex = minKmerShannonIndex;
 
     	//_localStats = new SimkaStatistics(_nbBanks, _stats._distanceParams);
 
     	_nbKmerCounted = 0;
+    	_firstNewBank = 0;
     	//isAbundanceThreshold = _abundanceThreshold.first > 1 || _abundanceThreshold.second < 1000000;
 
 
     }
 
 
+    //Update mode: the pairs of banks lower than firstNewBank have been computed by the previous run
+    void setFirstNewBank(size_t firstNewBank){
+    	_firstNewBank = firstNewBank;
+    }
+
     void end(){
 		#ifdef CHI2_TEST
 
 			size_t nbValues = _chi2ValueSorter.size();
 			for(size_t i=0; i<nbValues; i++){
 				double val = _chi2ValueSorter.top().first;
-				CountVector counts = _chi2ValueSorter.top().second;
+				SparseCountVector counts = _chi2ValueSorter.top().second;
 
 
 				//cout << val << endl;
@@ -197,7 +223,8 @@ public:
 		#endif
     }
 
-    void process (size_t partId, const typename Kmer<span>::Type& kmer, const CountVector& counts){
+    //counts are the counts of the datasets which have the kmer, by increasing bank id
+    void process (size_t partId, const typename Kmer<span>::Type& kmer, const SparseCountVector& counts){
 
     	//cout << kmer.toString(_kmerSize) << endl;
     	//for(size_t i=0; i<counts.size(); i++){
@@ -212,35 +239,31 @@ public:
 
     	for(size_t i=0; i<counts.size(); i++){
 
-    		CountNumber abundance = counts[i];
+    		CountNumber abundance = counts[i]._count;
     		//_nbKmerCounted += abundance;
     		//_stats._speciesAbundancePerDataset[i].push_back(abundance);
 
     		//cout << counts[i] << " ";
     		_stats->_nbKmers += abundance;
-    		_stats->_nbKmersPerBank[i] += abundance;
+    		_stats->_nbKmersPerBank[counts[i]._bankId] += abundance;
     		_totalAbundance += abundance;
     	}
 #endif
 
-    	/* A DEPLACER PENDANT LE COMPTAGE DES KMERS
-    	if(_minKmerShannonIndex != 0){
-    		double shannonIndex = getShannonIndex(kmer);
-    		if(shannonIndex < _minKmerShannonIndex){
-    			return;
-    		}
-    	}*/
+    	//Kmers with a low Shannon index are removed during the counting (see SimkaKmerFilter)
 
 #ifdef CHI2_TEST
     	float X2j = 0;
 
+    	CountVector denseCounts(_nbBanks, 0);
     	_totalAbundance = 0;
     	for(size_t i=0; i<counts.size(); i++){
-    		_totalAbundance += counts[i];
+    		denseCounts[counts[i]._bankId] = counts[i]._count;
+    		_totalAbundance += counts[i]._count;
     	}
 
-    	for(size_t i=0; i<counts.size(); i++){
-    		X2j += pow((counts[i]/_totalAbundance - _stats->_datasetNbReads[i]/_stats->_totalReads), 2) / (_stats->_datasetNbReads[i] / (_stats->_totalReads*_totalAbundance));
+    	for(size_t i=0; i<denseCounts.size(); i++){
+    		X2j += pow((denseCounts[i]/_totalAbundance - _stats->_datasetNbReads[i]/_stats->_totalReads), 2) / (_stats->_datasetNbReads[i] / (_stats->_totalReads*_totalAbundance));
     	}
 
     	//std::chi_squared_distribution<double> distribution(_nbBanks-1);
@@ -263,13 +286,13 @@ public:
     	if(_chi2ValueSorter.size() > _maxChi2Values){
 
         	if(X2j > _chi2ValueSorter.top().first){
-            	_chi2ValueSorter.push(pair<double, CountVector>(X2j, counts));
+            	_chi2ValueSorter.push(pair<double, SparseCountVector>(X2j, counts));
         		_chi2ValueSorter.pop();
         	}
 
     	}
     	else{
-        	_chi2ValueSorter.push(pair<double, CountVector>(X2j, counts));
+        	_chi2ValueSorter.push(pair<double, SparseCountVector>(X2j, counts));
     	}
 
 
@@ -338,36 +361,47 @@ public:
     	//_stats->_nbSolidKmers += 1;
     }
 
-    void updateDistance(const CountVector& counts){
+    /*
+     * The default and simple distances only need the pairs of datasets which share the kmer, they are
+     * computed from the sparse counts. The complex distances also need the pairs where one of the datasets
+     * does not have the kmer, they are computed from the dense counts, whose entries are set for the kmer
+     * and reset after.
+     */
+    void updateDistance(const SparseCountVector& counts){
 		_sharedBanks.clear();
 
 		for(size_t i=0; i<counts.size(); i++)
-			if(counts[i]) _sharedBanks.push_back(i);
+			_sharedBanks.push_back(counts[i]._bankId);
 
 		updateDistanceDefault(counts);
 
     	if(_stats->_computeSimpleDistances)
     		updateDistanceSimple(counts);
 
-    	if(_stats->_computeComplexDistances)
-    		updateDistanceComplex(counts);
+    	if(_stats->_computeComplexDistances){
+    		for(size_t i=0; i<counts.size(); i++) _denseCounts[counts[i]._bankId] = counts[i]._count;
+    		updateDistanceComplex(_denseCounts);
+    		for(size_t i=0; i<counts.size(); i++) _denseCounts[counts[i]._bankId] = 0;
+    	}
     }
 
-	void updateDistanceDefault(const CountVector& counts){
+	void updateDistanceDefault(const SparseCountVector& counts){
+
 
+		for(size_t ii=0; ii<counts.size(); ii++){
+			for(size_t jj=ii+1; jj<counts.size(); jj++){
 
-		for(size_t ii=0; ii<_sharedBanks.size(); ii++){
-			for(size_t jj=ii+1; jj<_sharedBanks.size(); jj++){
+				u_int16_t i = counts[ii]._bankId;
+				u_int16_t j = counts[jj]._bankId;
+				if(j < _firstNewBank) continue;
 
-				u_int16_t i = _sharedBanks[ii];
-				u_int16_t j = _sharedBanks[jj];
 				size_t symetricIndex = j + ((_nbBanks-1)*i) - (i*(i-1)/2);
 
-				u_int64_t abundanceI = counts[i];
-				u_int64_t abundanceJ = counts[j];
+				u_int64_t abundanceI = counts[ii]._count;
+				u_int64_t abundanceJ = counts[jj]._count;
 
-				_stats->_matrixNbSharedKmers[i][j] += counts[i];
-				_stats->_matrixNbSharedKmers[j][i] += counts[j];
+				_stats->_matrixNbSharedKmers[i][j] += abundanceI;
+				_stats->_matrixNbSharedKmers[j][i] += abundanceJ;
 				_stats->_matrixNbDistinctSharedKmers[symetricIndex] += 1;
 
 				//cout << i << " " << j << "    " << (j + ((_nbBanks-1)*i) - (i*(i-1)/2)) << endl;
@@ -378,17 +412,18 @@ public:
 	}
 
 
-	void updateDistanceSimple(const CountVector& counts){
+	void updateDistanceSimple(const SparseCountVector& counts){
 
 
-		for(size_t ii=0; ii<_sharedBanks.size(); ii++){
-			for(size_t jj=ii+1; jj<_sharedBanks.size(); jj++){
+		for(size_t ii=0; ii<counts.size(); ii++){
+			for(size_t jj=ii+1; jj<counts.size(); jj++){
 
-				u_int16_t i = _sharedBanks[ii];
-				u_int16_t j = _sharedBanks[jj];
+				u_int16_t i = counts[ii]._bankId;
+				u_int16_t j = counts[jj]._bankId;
+				if(j < _firstNewBank) continue;
 
-				u_int64_t abundanceI = counts[i];
-				u_int64_t abundanceJ = counts[j];
+				u_int64_t abundanceI = counts[ii]._count;
+				u_int64_t abundanceJ = counts[jj]._count;
 
 
 				//cout << _stats->_chord_sqrt_N2[i] << endl;
@@ -416,7 +451,7 @@ public:
 
 		for(size_t i=0; i<counts.size(); i++){
 			if(counts[i]){
-				for(size_t j=i+1; j<counts.size(); j++){
+				for(size_t j=max(i+1, _firstNewBank); j<counts.size(); j++){
 
 					//In this loop we know that (abundanceI > 0)
 					double abundanceI = counts[i];
@@ -493,6 +528,7 @@ public:
 
 					u_int16_t j = _sharedBanks[jj];
 					if(i > j) continue;
+					if(j < _firstNewBank) continue;
 
 					double abundanceI = counts[i];
 					double abundanceJ = counts[j];
@@ -631,32 +667,6 @@ public:
 	}
 
 	//inline bool isSolidVector(const CountVector& counts);
-	double getShannonIndex(const Type&  kmer){
-		float index = 0;
-		//float freq [5];
-
-		vector<float> _freqs(4, 0);
-
-		//char* seqStr = seq.getDataBuffer();
-
-	    for (size_t i=0; i<_kmerSize; i++){
-	    	_freqs[kmer[i]] += 1.0;
-	    	//seq[sizeKmer-i-1] = bin2NT [(*this)[i]];
-	    }
-
-		// Frequency of each letter (A, C, G, T or N)
-		//for(size_t i=0; i < seq.size(); i++)
-		//	_freqs[nt2binTab[(unsigned char)seq[i]]] += 1.0;
-
-		// Shannon index calculation
-		for (size_t i=0; i<_freqs.size(); i++){
-			_freqs[i] /= (float) _kmerSize;
-			if (_freqs[i] != 0)
-				index += _freqs[i] * log (_freqs[i]) / log(2);
-		}
-		return abs(index);
-	}
-
 	double approx_gamma(double Z)
 	{
 	    const double RECIP_E = 0.36787944117144232159552377016147;  // RECIP_E = (E^-1) = (1.0 / E)
@@ -954,9 +964,12 @@ protected:
 
     bool setup();
     bool isInputValid();
+    bool isDatasetValid(size_t i);
+    bool isStreamDataset(size_t i);
     void parseArgs();
     bool createDirs();
     void computeMaxReads();
+    void computeProfiles();
 	void layoutInputFilename();
 	void createBank();
 	void count();
@@ -983,6 +996,14 @@ protected:
 	size_t _minReadSize;
 	double _minReadShannonIndex;
 	double _minKmerShannonIndex;
+	bool _singletonFilter;
+	bool _update;
+	u_int64_t _scaled;
+	size_t _fixedPartitions;
+	string _countCacheDir;
+	string _readCacheDir;
+	u_int64_t _countCacheMaxSize;
+	size_t _maxMergeFanIn;
 	size_t _nbMinimizers;
 	//size_t _nbCores;
 
@@ -995,6 +1016,8 @@ protected:
 	IProperties* _options;
 
 	vector<string> _bankNames;
+	SimkaDatasetCatalog _catalog;
+	vector<SimkaDatasetProfile> _profiles;
 	//vector<u_int64_t> _nbReadsPerDataset;
 
 	string _outputFilenameSuffix;
@@ -9,16 +9,34 @@
 #define SIMKA1_4_SRC_CORE_SIMKACOMMONS_HPP_
 
 #include <thread>
+#include <mutex>
+#include <deque>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include "SimkaDatasetCatalog.hpp"
+#include "SimkaInputReader.hpp"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 const string STR_SIMKA_SOLIDITY_PER_DATASET = "-solidity-single";
 const string STR_SIMKA_MAX_READS = "-max-reads";
 const string STR_SIMKA_MIN_READ_SIZE = "-min-read-size";
 const string STR_SIMKA_MIN_READ_SHANNON_INDEX = "-min-shannon-index";
 const string STR_SIMKA_MIN_KMER_SHANNON_INDEX = "-kmer-shannon-index";
+const string STR_SIMKA_SINGLETON_FILTER = "-filter";
+const string STR_SIMKA_SCALED = "-scaled";
+const string STR_SIMKA_FIXED_PARTITIONS = "-fixed-partitions";
+const string STR_SIMKA_COUNT_CACHE = "-count-cache";
+const string STR_SIMKA_COUNT_CACHE_MAX_SIZE = "-count-cache-max-size";
+const string STR_SIMKA_MAX_MERGE_FAN_IN = "-max-merge-fan-in";
 const string STR_KMER_PER_READ = "-kmer-per-read";
 const string STR_SIMKA_COMPUTE_ALL_SIMPLE_DISTANCES= "-simple-dist";
 const string STR_SIMKA_COMPUTE_ALL_COMPLEX_DISTANCES = "-complex-dist";
 const string STR_SIMKA_KEEP_TMP_FILES = "-keep-tmp";
+const string STR_SIMKA_UPDATE = "-update";
+const string STR_SIMKA_READ_CACHE = "-read-cache";
 const string STR_SIMKA_COMPUTE_DATA_INFO = "-data-info";
 
 
@@ -28,117 +46,102 @@ public:
 	SimkaCommons();
 	virtual ~SimkaCommons();
 
+	/*
+	 * Calls function(i) for i in [0, nbItems) with a pool of nbThreads threads.
+	 * The first exception thrown by function stops the pool (the items not started are skipped) and is
+	 * rethrown once all the threads are joined.
+	 */
+	static void runThreads(size_t nbItems, size_t nbThreads, const std::function<void(size_t)>& function){
+
+		size_t nextItem = 0;
+		std::exception_ptr error;
+		std::mutex mutex;
+
+		auto run = [&](){
+			while(true){
+				size_t i;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if(nextItem == nbItems) return;
+					i = nextItem++;
+				}
 
-	static void checkInputValidity(const string& outputDirTemp, const string& inputFilename, u_int64_t& nbDatasets){
-
-		if(!System::file().doesExist(inputFilename)){
-			cout << "ERROR: Input does not exists (" + inputFilename + ")" << endl;
-			exit(1);
-		}
-
-		nbDatasets = 0;
-		bool error = false;
-
-		//string inputDir = _outputDirTemp; // + "/input/";
-		ifstream inputFile(inputFilename.c_str());
-
-		//ofstream outputFileIds(_outputFilenameIds.c_str(), ios::binary);
-		//_banksInputFilename =  inputDir + "__input_simka__"; //_inputFilename + "_dsk_dataset_temp__";
-		//IFile* bankFile = System::file().newFile(_banksInputFilename, "wb");
-
-		string line;
-		string linePart;
-		vector<string> lineIdDatasets;
-		vector<string> linepartPairedDatasets;
-		vector<string> linepartDatasets;
-
-		//string bankFileContents = "";
-
-		u_int64_t lineIndex = 0;
-		u_int64_t bankIdBytePos = 0;
-
-		while(getline(inputFile, line)){
-
-			line.erase(std::remove(line.begin(),line.end(),' '),line.end());
-			if(line == "") continue;
-
-			//cout << line << endl;
-			lineIdDatasets.clear();
-			linepartPairedDatasets.clear();
-			//vector<string> filenames;
-
-			stringstream lineStream(line);
-			while(getline(lineStream, linePart, ':')){
-				lineIdDatasets.push_back(linePart);
-			}
-
-			string bankId = lineIdDatasets[0];
-			string linePairedDatasets = lineIdDatasets[1];
-
-			stringstream linePairedDatasetsStream(linePairedDatasets);
-			while(getline(linePairedDatasetsStream, linePart, ';')){
-				linepartPairedDatasets.push_back(linePart);
+				try{
+					function(i);
+				}
+				catch(...){
+					std::lock_guard<std::mutex> lock(mutex);
+					if(!error) error = std::current_exception();
+					nextItem = nbItems;
+					return;
+				}
 			}
+		};
 
-			string subBankFilename = outputDirTemp + bankId;
-			IFile* subBankFile = System::file().newFile(subBankFilename, "wb");
-			//cout << subBankFile->getPath() << endl;
-			string subBankContents = "";
-			//_nbBankPerDataset.push_back(linepartPairedDatasets.size());
+		nbThreads = std::min(std::max(nbThreads, (size_t)1), std::max(nbItems, (size_t)1));
 
-			for(size_t i=0; i<linepartPairedDatasets.size(); i++){
-				string lineDatasets = linepartPairedDatasets[i];
+		vector<std::thread> threads;
+		for(size_t i=0; i<nbThreads; i++) threads.push_back(std::thread(run));
+		for(size_t i=0; i<threads.size(); i++) threads[i].join();
 
-				linepartDatasets.clear();
-
-				stringstream lineDatasetsStream(lineDatasets);
-				while(getline(lineDatasetsStream, linePart, ',')){
-					linepartDatasets.push_back(linePart);
-					//cout << "\t" << linePart << endl;
-				}
+		if(error) std::rethrow_exception(error);
+	}
 
-				//bankFileContents += linepartDatasets[0] + "\n";
 
+	/*
+	 * Parses the input file and opens each dataset. The datasets are opened by a pool of nbThreads threads.
+	 */
+	static void checkInputValidity(const string& outputDirTemp, const string& inputFilename, u_int64_t& nbDatasets, size_t nbThreads){
 
-				for(size_t i=0; i<linepartDatasets.size(); i++){
-					string filename = linepartDatasets[i];
-					if(filename.at(0) == '/'){
-						subBankContents +=  filename + "\n";
-					}
-					else{
-						string dir = System::file().getRealPath(inputFilename);
-						dir = System::file().getDirectory(dir);
-						subBankContents +=  dir + "/" + filename + "\n";
-					}
-				}
+		if(!System::file().doesExist(inputFilename)){
+			cout << "ERROR: Input does not exists (" + inputFilename + ")" << endl;
+			exit(1);
+		}
 
-			}
+		SimkaDatasetCatalog catalog;
+		try{
+			catalog.parse(inputFilename);
+		}
+		catch (Exception& e){
+			cerr << "ERROR: " << e.getMessage() << endl;
+			exit(1);
+		}
 
-			subBankContents.erase(subBankContents.size()-1);
-			subBankFile->fwrite(subBankContents.c_str(), subBankContents.size(), 1);
-			subBankFile->flush();
-			delete subBankFile;
+		vector<bool> isValid(catalog.size(), true);
+		std::mutex mutex;
 
-			//bankFileContents += inputDir + "/" + bankId + "\n";
-			lineIndex += 1;
+		runThreads(catalog.size(), nbThreads, [&](size_t i){
 
+			string subBankFilename = outputDirTemp + catalog[i]._id;
+			SimkaDatasetCatalog::writeBankFile(subBankFilename, catalog[i]);
 
+			bool valid = true;
 			try{
 				IBank* bank = Bank::open(subBankFilename);
 				LOCAL(bank);
-				nbDatasets += 1;
 			}
 			catch (Exception& e){
-				cerr << "ERROR: Can't open dataset: " << bankId << endl;
-				error = true;
+				valid = false;
 			}
 
 			System::file().remove(subBankFilename);
 
-		}
+			std::lock_guard<std::mutex> lock(mutex);
+			isValid[i] = valid;
+		});
 
+		nbDatasets = 0;
+		bool error = false;
 
-		inputFile.close();
+		for(size_t i=0; i<catalog.size(); i++){
+			if(isValid[i]){
+				nbDatasets += 1;
+			}
+			else{
+				cerr << "ERROR: Can't open dataset: " << catalog[i]._id << endl;
+				error = true;
+			}
+		}
 
 		if(error) exit(1);
 
@@ -156,164 +159,285 @@ public:
 
 
 
+#define SIMKA_INPUT_MAX_READERS 8
+#define SIMKA_INPUT_BATCH_SIZE (1*MBYTE)
+
+/*
+ * Reads of a dataset, filtered. The input files are read concurrently by reader threads, which give
+ * the reads to the iterator in batches through a bounded queue.
+ *
+ * The composition of the input iterator is made of nbBanks paired files, each one made of the same
+ * number of parts. With maxReads, the parts of a paired file are read in order by a single thread
+ * which stops after maxReads filtered reads, so that the same reads are counted as with a sequential
+ * reading. Without maxReads, each part is read by its own thread.
+ * The order of the reads of different threads is not defined.
+ *
+ * The reads of a SimkaFastxIterator are not copied: a batch keeps the decoded chunks (or the mapping)
+ * in which they are and their position. The other reads are copied in the batch.
+ */
 template <class Item, typename Filter> class SimkaInputIterator : public Iterator<Item>
 {
 public:
 
 	/** Constructor.
-	* \param[in] ref : the referred iterator
-	* \param[in] initRef : will call 'first' on the reference if true
+	* \param[in] refs : the composite iterator of the input files of the dataset
+	* \param[in] nbBanks : the number of paired files of the dataset
 	*/
 	SimkaInputIterator(Iterator<Item>* refs, size_t nbBanks, u_int64_t maxReads, Filter filter)
-	:  _filter(filter), _mainref(0) {
+	:  _filter(filter), _mainref(0), _isDone(true), _index(0), _batchPos(0), _maxPendingBatches(0), _nextGroup(0), _nbActiveReaders(0), _isCancelled(false), _hasError(false) {
 
 		setMainref(refs);
-		_ref = _mainref->getComposition()[0];
-		_isDone = false;
 		_nbDatasets = nbBanks;
 		_nbBanks = _mainref->getComposition().size() / _nbDatasets;
 		_maxReads = maxReads;
-		_nbReadProcessed = 0;
-		_currentBank = 0;
-		_currentInternalBank = 0;
-		_currentDataset = 0;
-
 	}
 
+	~SimkaInputIterator(){
+		stopReaders();
+		setMainref(0);
+	}
 
-    bool isFinished(){
-        if(_currentDataset == _nbDatasets){
-                _isDone = true;
-                return true;
-        }
-        return false;
+    void first()
+    {
+    	stopReaders();
+
+    	_refs = _mainref->getComposition();
+    	_groups.clear();
+    	if(_maxReads){
+    		for(size_t i=0; i<_nbDatasets; i++) _groups.push_back(make_pair(i*_nbBanks, (i+1)*_nbBanks));
+    	}
+    	else{
+    		for(size_t i=0; i<_refs.size(); i++) _groups.push_back(make_pair(i, i+1));
+    	}
+
+    	_batches.clear();
+    	_batch.clear();
+    	_batchPos = 0;
+    	_index = 0;
+    	_error = "";
+    	_hasError = false;
+    	_isCancelled = false;
+    	_nextGroup = 0;
+
+    	size_t nbReaders = min(_groups.size(), (size_t)SIMKA_INPUT_MAX_READERS);
+    	_maxPendingBatches = nbReaders * 2;
+    	_nbActiveReaders = nbReaders;
+    	for(size_t i=0; i<nbReaders; i++){
+    		_readers.push_back(std::thread(&SimkaInputIterator::readGroups, this));
+    	}
+
+    	next();
     }
 
-	void nextDataset(){
-		_currentDataset += 1;
-
-		if(isFinished()) return;
-
-		_currentBank = _currentDataset * _nbBanks;
+	void next(){
 
-		_currentInternalBank = 0;
-		_nbReadProcessed = 0;
+		while(_batchPos == _batch._reads.size()){
+			if(!popBatch()){
+				_isDone = true;
+				return;
+			}
+		}
 
-		if(isFinished()) return;
+		const BatchRead& read = _batch._reads[_batchPos];
+		const char* buffer = read._buffer ? read._buffer : _batch._data.data() + read._offset;
+		Data& data = this->_item->getData();
+		data.setRef((char*) buffer, read._size);
+		data.setEncoding(Data::ASCII);
+		this->_item->setIndex(_index++);
 
-		_ref = _mainref->getComposition()[_currentBank];
+		_batchPos += 1;
 		_isDone = false;
-		first();
-		//nextBank();
 	}
 
-	void nextBank(){
-		//cout << "next bank" << endl;
-		//cout << "next bank "<< endl;
-		_currentInternalBank += 1;
-		if(_currentInternalBank == _nbBanks){
-			nextDataset();
-		}
-		else{
-			_isDone = false;
-			_currentBank += 1;
-			_ref = _mainref->getComposition()[_currentBank];
-			first();
-		}
-	}
+    /** \copydoc  Iterator::isDone */
+    bool isDone()  {  return _isDone;  }
 
-    void first()
-    {
+    /** \copydoc  Iterator::item */
+    Item& item ()  {  return *(this->_item);  }
 
-        _ref->first();
 
-        while (!_ref->isDone() && _filter(_ref->item())==false)
-                _ref->next();
+private:
 
-        _isDone = _ref->isDone();
+    struct BatchRead{
+    	const char* _buffer; //0 if the read is copied in the _data of the batch
+    	u_int64_t _offset;
+    	u_int64_t _size;
+    };
+
+    struct Batch{
+    	vector<std::shared_ptr<const void> > _owners; //owners of the buffers of the reads
+    	vector<char> _data; //copied reads
+    	vector<BatchRead> _reads;
+    	u_int64_t _size; //total size of the reads
+
+    	Batch() : _size(0) {}
+
+    	void clear(){
+    		_owners.clear();
+    		_data.clear();
+    		_reads.clear();
+    		_size = 0;
+    	}
+
+    	void swap(Batch& batch){
+    		_owners.swap(batch._owners);
+    		_data.swap(batch._data);
+    		_reads.swap(batch._reads);
+    		std::swap(_size, batch._size);
+    	}
+    };
+
+    bool popBatch(){
+
+    	std::unique_lock<std::mutex> lock(_mutex);
+    	_batchAvailable.wait(lock, [&]{ return _batches.size() > 0 || _nbActiveReaders == 0 || _hasError; });
+    	if(_hasError) throw Exception ("%s", _error.c_str());
+    	if(_batches.size() == 0) return false;
+
+    	_batch.swap(_batches.front());
+    	_batches.pop_front();
+    	_batchPos = 0;
+    	_batchTaken.notify_one();
+    	return true;
+    }
 
-        if(!_isDone) *(this->_item) = _ref->item();
+    bool pushBatch(Batch& batch){
 
-    }
+    	if(batch._reads.size() == 0) return true;
 
-	void next(){
+    	std::unique_lock<std::mutex> lock(_mutex);
+    	_batchTaken.wait(lock, [&]{ return _batches.size() < _maxPendingBatches || _isCancelled; });
+    	if(_isCancelled) return false;
 
+    	_batches.push_back(Batch());
+    	_batches.back().swap(batch);
+    	_batchAvailable.notify_one();
+    	return true;
+    }
 
-		if(isFinished()){
-			_isDone = true;
-			return;
-		}
+    void readGroups(){
+
+    	Filter filter(_filter);
+
+    	try{
+    		while(true){
+    			size_t group;
+    			{
+    				std::lock_guard<std::mutex> lock(_mutex);
+    				if(_isCancelled || _nextGroup == _groups.size()) break;
+    				group = _nextGroup++;
+    			}
+    			if(!readGroup(group, filter)) break;
+    		}
+    	}
+    	catch (Exception& e){
+    		setError(e.getMessage());
+    	}
+    	catch (std::exception& e){
+    		setError(e.what());
+    	}
+
+    	std::lock_guard<std::mutex> lock(_mutex);
+    	_nbActiveReaders -= 1;
+    	_batchAvailable.notify_all();
+    }
 
-		//cout << "haha" << endl;
+    //Reads the parts of a paired file (or a single part), returns false if the iterator is stopped
+    bool readGroup(size_t group, Filter& filter){
 
-		_ref->next();
-		while (!_ref->isDone() && _filter(_ref->item())==false) _ref->next();
+    	Batch batch;
+    	u_int64_t nbReads = 0;
 
-		_isDone = _ref->isDone();
+    	for(size_t i=_groups[group].first; i<_groups[group].second; i++){
 
-		//cout << "haha" << endl;
-		//if(!_isDone){
-			//cout << _currentBank << "  " << _isDone << endl;
+    		Iterator<Item>* it = _refs[i];
+    		SimkaFastxIterator* fastxIt = dynamic_cast<SimkaFastxIterator*>(it);
 
-		//}
+    		for(it->first(); !it->isDone(); it->next()){
 
-		//cout << _nbReadProcessed << "  " << _currentBank << "    " << _nbBanks << "   " << _maxReads << endl;
+    			if(filter(it->item()) == false) continue;
 
+    			Data& data = it->item().getData();
+    			BatchRead read;
+    			read._size = data.size();
 
-		if(_isDone){
-			if(isFinished()){
-				//cout << _nbReadProcessed << endl;
-				return;
-			}
-			else{
-				//cout << _nbReadProcessed << endl;
-				nextBank();
-				if(isFinished()){
-					//cout << _nbReadProcessed << endl;
-					return;
-				}
-			}
-		}
-		else{
-			*(this->_item) = _ref->item();
-			_nbReadProcessed += 1;
-		}
+    			std::shared_ptr<const void> owner;
+    			if(fastxIt) owner = fastxIt->getItemOwner();
 
-		if(_maxReads && _nbReadProcessed >= _maxReads){
-			if(isFinished())
-				return;
-			else
-				nextDataset();
-		}
+    			if(owner){
+    				if(batch._owners.empty() || batch._owners.back() != owner) batch._owners.push_back(owner);
+    				read._buffer = data.getBuffer();
+    				read._offset = 0;
+    			}
+    			else{
+    				read._buffer = 0;
+    				read._offset = batch._data.size();
+    				batch._data.insert(batch._data.end(), data.getBuffer(), data.getBuffer() + data.size());
+    			}
 
-	}
+    			batch._reads.push_back(read);
+    			batch._size += read._size;
+    			nbReads += 1;
 
-    /** \copydoc  Iterator::isDone */
-    bool isDone()  {  return _isDone;  }
+    			if(_maxReads && nbReads >= _maxReads) return pushBatch(batch);
+    			if(batch._size >= SIMKA_INPUT_BATCH_SIZE && !pushBatch(batch)) return false;
+    		}
+    	}
 
-    /** \copydoc  Iterator::item */
-    Item& item ()  {  return *(this->_item);  }
+    	return pushBatch(batch);
+    }
 
+    void setError(const string& error){
+    	std::lock_guard<std::mutex> lock(_mutex);
+    	if(!_hasError) _error = error;
+    	_hasError = true;
+    	_isCancelled = true;
+    	_batchTaken.notify_all();
+    	_batchAvailable.notify_all();
+    }
 
-private:
+    void stopReaders(){
+    	{
+    		std::lock_guard<std::mutex> lock(_mutex);
+    		_isCancelled = true;
+    		_batchTaken.notify_all();
+    	}
+    	for(size_t i=0; i<_readers.size(); i++) _readers[i].join();
+    	_readers.clear();
+    }
 
-    bool            _isDone;
-    size_t _currentBank;
-    //vector<Iterator<Item>* > _refs;
-    Iterator<Item>* _ref;
-    size_t _nbBanks;
     u_int64_t _maxReads;
     Filter _filter;
-    u_int64_t _nbReadProcessed;
-    size_t _currentInternalBank;
-	size_t _currentDataset;
+    size_t _nbBanks;
 	size_t _nbDatasets;
 
     Iterator<Item>* _mainref;
     void setMainref (Iterator<Item>* mainref)  { SP_SETATTR(mainref); }
+
+    vector<Iterator<Item>*> _refs;
+    vector<pair<size_t, size_t> > _groups; //range of parts read by a thread
+
+    bool _isDone;
+    u_int64_t _index;
+    Batch _batch;
+    size_t _batchPos;
+
+    std::deque<Batch> _batches;
+    size_t _maxPendingBatches;
+    size_t _nextGroup;
+    size_t _nbActiveReaders;
+    bool _isCancelled;
+    bool _hasError;
+    string _error;
+    std::mutex _mutex;
+    std::condition_variable _batchAvailable;
+    std::condition_variable _batchTaken;
+    vector<std::thread> _readers;
 };
 
 
+#define SIMKA_SHANNON_TABLE_SIZE 1024
+
 struct SimkaSequenceFilter
 {
 	//u_int64_t _maxNbReads;
@@ -395,40 +519,91 @@ struct SimkaSequenceFilter
 		return getShannonIndex(seq) >= _minShannonIndex;
 	}
 
+	/*
+	 * Letters are counted in 5 classes: C, G, T, N and A (A and any other character).
+	 * The counts are computed 16 bytes at a time with SSE2 and the entropy uses a table of c*log2(c).
+	 */
 	float getShannonIndex(Sequence& seq){
 
-		static char nt2binTab[128] = {
-			0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-			0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-			0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-			0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-			0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-			0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-			0, 0, 0, 0, 0, 0, 0, 1, 0, 0, //69
-			0, 3, 0, 0, 0, 0, 0, 0, 4, 0, //79
-			0, 0, 0, 0, 2, 0, 0, 0, 0, 0,
-			0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-			};
-
-		float index = 0;
-		//float freq [5];
-
-		vector<float> _freqs(5, 0);
-
-		char* seqStr = seq.getDataBuffer();
-
-		// Frequency of each letter (A, C, G, T or N)
-		for(size_t i=0; i < seq.getDataSize(); i++)
-			_freqs[nt2binTab[(unsigned char)seqStr[i]]] += 1.0;
-
-		// Shannon index calculation
-		for (size_t i=0; i<_freqs.size(); i++){
-			_freqs[i] /= (float) seq.getDataSize();
-			if (_freqs[i] != 0)
-				index += _freqs[i] * log (_freqs[i]) / log(2);
+		size_t size = seq.getDataSize();
+		if(size == 0) return 0;
+
+		u_int64_t counts[5];
+		countLetters(seq.getDataBuffer(), size, counts);
+
+		// H = log2(n) - 1/n * sum(c * log2(c))
+		double sum = 0;
+		for(size_t i=0; i<5; i++) sum += getCLog2C(counts[i]);
+
+		double index = log2((double) size) - sum / (double) size;
+		return abs((float) index);
+	}
+
+	static void countLetters(const char* seqStr, size_t size, u_int64_t* counts){
+
+		counts[1] = counts[2] = counts[3] = counts[4] = 0;
+		size_t i = 0;
+
+#ifdef __SSE2__
+		const __m128i C = _mm_set1_epi8('C');
+		const __m128i G = _mm_set1_epi8('G');
+		const __m128i T = _mm_set1_epi8('T');
+		const __m128i N = _mm_set1_epi8('N');
+		const __m128i zero = _mm_setzero_si128();
+
+		while(i+16 <= size){
+
+			// Byte counters are flushed before they can overflow
+			size_t nbBlocks = min((size-i)/16, (size_t)255);
+			__m128i accC = zero, accG = zero, accT = zero, accN = zero;
+
+			for(size_t b=0; b<nbBlocks; b++, i+=16){
+				__m128i bytes = _mm_loadu_si128((const __m128i*) (seqStr + i));
+				accC = _mm_sub_epi8(accC, _mm_cmpeq_epi8(bytes, C));
+				accG = _mm_sub_epi8(accG, _mm_cmpeq_epi8(bytes, G));
+				accT = _mm_sub_epi8(accT, _mm_cmpeq_epi8(bytes, T));
+				accN = _mm_sub_epi8(accN, _mm_cmpeq_epi8(bytes, N));
+			}
+
+			counts[1] += horizontalSum(accC);
+			counts[3] += horizontalSum(accG);
+			counts[2] += horizontalSum(accT);
+			counts[4] += horizontalSum(accN);
+		}
+#endif
+
+		for(; i<size; i++){
+			switch(seqStr[i]){
+				case 'C': counts[1] += 1; break;
+				case 'T': counts[2] += 1; break;
+				case 'G': counts[3] += 1; break;
+				case 'N': counts[4] += 1; break;
+				default: break;
+			}
 		}
-		return abs(index);
 
+		counts[0] = size - counts[1] - counts[2] - counts[3] - counts[4];
+	}
+
+#ifdef __SSE2__
+	static u_int64_t horizontalSum(__m128i acc){
+		__m128i sums = _mm_sad_epu8(acc, _mm_setzero_si128());
+		return (u_int64_t) _mm_cvtsi128_si32(sums) + (u_int64_t) _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+	}
+#endif
+
+	static double getCLog2C(u_int64_t c){
+
+		static const vector<double> table = createCLog2CTable();
+
+		if(c < table.size()) return table[c];
+		return c * log2((double) c);
+	}
+
+	static vector<double> createCLog2CTable(){
+		vector<double> table(SIMKA_SHANNON_TABLE_SIZE, 0);
+		for(size_t c=1; c<table.size(); c++) table[c] = c * log2((double) c);
+		return table;
 	}
 
 	size_t _minReadSize;
@@ -0,0 +1,219 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_SIMKACOUNTCACHE_HPP_
+#define TOOLS_SIMKA_SRC_SIMKACOUNTCACHE_HPP_
+
+#include <gatb/gatb_core.hpp>
+#include <fstream>
+#include <algorithm>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <utime.h>
+#include <unistd.h>
+
+/*
+ * Cache of the count files of the datasets, shared by several runs of Simka (option -count-cache).
+ *
+ * An entry is a directory named after the hash of its key. The key is made of the fingerprint of
+ * the input files of the dataset (path, size, modification time), of the version of the pack format
+ * and of all the parameters which change the count files. An entry holds:
+ * 		counts.pack		the packed count file of the dataset (see SimkaPartitionPack.hpp)
+ * 		kmercount.txt	the number of distinct kmers per partition
+ * 		count.ok		the content of the count_synchro file (nb reads, nb kmers...)
+ * 		key.txt			the key of the entry
+ *
+ * Entries are written in a temporary directory by simkaCount and renamed when complete, files are
+ * hard linked when the cache and the temporary dir are on the same file system. The modification
+ * time of count.ok is updated on each use and the least recently used entries are evicted first.
+ */
+class SimkaCountCache
+{
+public:
+
+	static string getDatasetFingerprint(const string& bankFilename){
+
+		string fingerprint = "";
+
+		ifstream bankFile(bankFilename.c_str());
+		string filename;
+
+		while(getline(bankFile, filename)){
+			if(filename == "") continue;
+
+			struct stat st;
+			if(stat(filename.c_str(), &st) != 0) throw Exception ("unable to stat input file %s", filename.c_str());
+
+			fingerprint += filename + " " + Stringify::format("%llu", (u_int64_t)st.st_size) + " " + Stringify::format("%llu", (u_int64_t)st.st_mtime) + "\n";
+		}
+
+		return fingerprint;
+	}
+
+	//FNV-1a, the name of an entry must be the same for all the builds of Simka
+	static string getEntryName(const string& key){
+
+		u_int64_t hash = 0xcbf29ce484222325ULL;
+		for(size_t i=0; i<key.size(); i++){
+			hash ^= (u_int8_t) key[i];
+			hash *= 0x100000001b3ULL;
+		}
+
+		return Stringify::format("%016llx", hash);
+	}
+
+	static string getEntryDir(const string& cacheDir, const string& key){
+		return cacheDir + "/" + getEntryName(key);
+	}
+
+	static bool isValid(const string& entryDir, const string& key){
+
+		if(!System::file().doesExist(entryDir + "/count.ok")) return false;
+		return readKey(entryDir + "/key.txt") == key;
+	}
+
+	static string readKey(const string& keyFilename){
+		ifstream keyFile(keyFilename.c_str());
+		return string((istreambuf_iterator<char>(keyFile)), istreambuf_iterator<char>());
+	}
+
+	/*
+	 * Called by simkaCount once the count files of a dataset are written.
+	 */
+	static void store(const string& cacheDir, const string& key, const string& packFilename, const string& kmerCountFilename, const string& okContents){
+
+		string entryDir = getEntryDir(cacheDir, key);
+		string tempDir = entryDir + ".temp." + Stringify::format("%d", (int)getpid());
+		System::file().mkdir(tempDir, -1);
+
+		linkOrCopy(packFilename, tempDir + "/counts.pack");
+		linkOrCopy(kmerCountFilename, tempDir + "/kmercount.txt");
+		writeFile(tempDir + "/key.txt", key);
+		writeFile(tempDir + "/count.ok", okContents);
+
+		//An other run may have stored the same dataset meanwhile
+		if(rename(tempDir.c_str(), entryDir.c_str()) != 0){
+			removeDir(tempDir);
+		}
+	}
+
+	/*
+	 * Links the files of an entry in the temp dir of a run, as if the dataset had been counted.
+	 */
+	static void restore(const string& entryDir, const string& packFilename, const string& kmerCountFilename, const string& finishFilename){
+
+		linkOrCopy(entryDir + "/counts.pack", packFilename);
+		linkOrCopy(entryDir + "/kmercount.txt", kmerCountFilename);
+
+		//Written last, the dataset is considered as counted as soon as this file exists
+		linkOrCopy(entryDir + "/count.ok", finishFilename + ".temp");
+		System::file().rename(finishFilename + ".temp", finishFilename);
+
+		utime((entryDir + "/count.ok").c_str(), NULL);
+	}
+
+	/*
+	 * Removes the least recently used entries until the cache size is lower than maxSizeMB.
+	 */
+	static void evict(const string& cacheDir, u_int64_t maxSizeMB){
+
+		if(maxSizeMB == 0) return;
+
+		vector<CacheEntry> entries;
+		u_int64_t totalSize = 0;
+
+		vector<string> filenames = System::file().listdir(cacheDir);
+		for(size_t i=0; i<filenames.size(); i++){
+			if(filenames[i] == "." || filenames[i] == "..") continue;
+			if(filenames[i].find(".temp.") != string::npos) continue;
+
+			string entryDir = cacheDir + "/" + filenames[i];
+
+			struct stat st;
+			if(stat((entryDir + "/count.ok").c_str(), &st) != 0) continue;
+
+			CacheEntry entry;
+			entry._dir = entryDir;
+			entry._lastUse = st.st_mtime;
+			entry._size = getFileSize(entryDir + "/counts.pack") + getFileSize(entryDir + "/kmercount.txt");
+			entries.push_back(entry);
+
+			totalSize += entry._size;
+		}
+
+		std::sort(entries.begin(), entries.end(), sortEntry);
+
+		u_int64_t maxSize = maxSizeMB * MBYTE;
+		for(size_t i=0; i<entries.size() && totalSize > maxSize; i++){
+			cout << "\tRemoving " << entries[i]._dir << " from count cache" << endl;
+			removeDir(entries[i]._dir);
+			totalSize -= entries[i]._size;
+		}
+	}
+
+private:
+
+	struct CacheEntry{
+		string _dir;
+		time_t _lastUse;
+		u_int64_t _size;
+	};
+
+	static bool sortEntry(const CacheEntry& l, const CacheEntry& r){
+		return l._lastUse < r._lastUse;
+	}
+
+	static u_int64_t getFileSize(const string& filename){
+		struct stat st;
+		if(stat(filename.c_str(), &st) != 0) return 0;
+		return st.st_size;
+	}
+
+	static void linkOrCopy(const string& src, const string& dest){
+
+		if(System::file().doesExist(dest)) System::file().remove(dest);
+		if(link(src.c_str(), dest.c_str()) == 0) return;
+
+		ifstream in(src.c_str(), ios::binary);
+		ofstream out(dest.c_str(), ios::binary);
+		out << in.rdbuf();
+
+		if(!in || !out) throw Exception ("unable to copy %s to %s", src.c_str(), dest.c_str());
+	}
+
+	static void writeFile(const string& filename, const string& contents){
+		IFile* file = System::file().newFile(filename, "w");
+		file->fwrite(contents.c_str(), contents.size(), 1);
+		file->flush();
+		delete file;
+	}
+
+	static void removeDir(const string& dir){
+		vector<string> filenames = System::file().listdir(dir);
+		for(size_t i=0; i<filenames.size(); i++){
+			if(filenames[i] == "." || filenames[i] == "..") continue;
+			System::file().remove(dir + "/" + filenames[i]);
+		}
+		System::file().rmdir(dir);
+	}
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_SIMKACOUNTCACHE_HPP_ */
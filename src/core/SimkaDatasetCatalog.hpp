@@ -0,0 +1,272 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_SIMKADATASETCATALOG_HPP_
+#define TOOLS_SIMKA_SRC_SIMKADATASETCATALOG_HPP_
+
+#include <gatb/gatb_core.hpp>
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Datasets of a run: the input file is parsed once, the catalog is saved in the temp dir as a single
+ * binary file (datasets.bin) which is mapped in memory by the sub commands (see SimkaDatasetCatalogFile).
+ *
+ * 		header		char[8] "SIMKACAT" | u_int32_t version | u_int32_t 0 | u_int64_t nbDatasets
+ * 		index		nbDatasets * u_int64_t offset of the record of the dataset
+ * 		record		u_int32_t nbPaired | u_int32_t nbFiles | string id | nbFiles * string filename
+ *
+ * Strings are stored as u_int32_t size | chars. The files of the paired files of a dataset follow each
+ * other, in the order of the input file.
+ */
+#define SIMKA_CATALOG_MAGIC "SIMKACAT"
+#define SIMKA_CATALOG_VERSION 1
+#define SIMKA_CATALOG_HEADER_SIZE 24
+
+struct SimkaDataset
+{
+	string _id;
+	size_t _nbPaired;
+	vector<string> _filenames;
+};
+
+
+class SimkaDatasetCatalog
+{
+public:
+
+	/*
+	 * One dataset per line: "ID: file1, file2 ; pairedFile1, pairedFile2". Relative filenames are relative
+	 * to the directory of the input file.
+	 */
+	void parse(const string& inputFilename){
+
+		ifstream inputFile(inputFilename.c_str());
+		if(!inputFile) throw Exception ("unable to open input file %s", inputFilename.c_str());
+
+		string inputDir = System::file().getDirectory(System::file().getRealPath(inputFilename));
+		string line;
+		string linePart;
+
+		while(getline(inputFile, line)){
+
+			line.erase(std::remove(line.begin(),line.end(),' '),line.end());
+			if(line == "") continue;
+
+			size_t separator = line.find(':');
+			if(separator == string::npos || separator == 0) throw Exception ("syntax error in input file: %s", line.c_str());
+
+			SimkaDataset dataset;
+			dataset._id = line.substr(0, separator);
+			dataset._nbPaired = 0;
+
+			stringstream linePairedDatasetsStream(line.substr(separator+1));
+			while(getline(linePairedDatasetsStream, linePart, ';')){
+				dataset._nbPaired += 1;
+
+				stringstream lineDatasetsStream(linePart);
+				string filename;
+				while(getline(lineDatasetsStream, filename, ',')){
+					if(filename == "") throw Exception ("syntax error in input file: %s", line.c_str());
+					if(filename.at(0) != '/') filename = inputDir + "/" + filename;
+					dataset._filenames.push_back(filename);
+				}
+			}
+
+			if(dataset._filenames.size() == 0) throw Exception ("syntax error in input file: %s", line.c_str());
+
+			_datasets.push_back(dataset);
+		}
+	}
+
+	void add(const SimkaDataset& dataset){
+		_datasets.push_back(dataset);
+	}
+
+	size_t size() const { return _datasets.size(); }
+	const SimkaDataset& operator[] (size_t i) const { return _datasets[i]; }
+
+	//Bank file of a dataset, the list of its files as a gatb album
+	static void writeBankFile(const string& filename, const SimkaDataset& dataset){
+
+		string contents = "";
+		for(size_t i=0; i<dataset._filenames.size(); i++){
+			if(i > 0) contents += "\n";
+			contents += dataset._filenames[i];
+		}
+
+		IFile* file = System::file().newFile(filename, "wb");
+		file->fwrite(contents.c_str(), contents.size(), 1);
+		file->flush();
+		delete file;
+	}
+
+	void save(const string& filename) const {
+
+		string records = "";
+		vector<u_int64_t> offsets;
+		u_int64_t recordsOffset = SIMKA_CATALOG_HEADER_SIZE + _datasets.size() * sizeof(u_int64_t);
+
+		for(size_t i=0; i<_datasets.size(); i++){
+			offsets.push_back(recordsOffset + records.size());
+			appendU32(records, _datasets[i]._nbPaired);
+			appendU32(records, _datasets[i]._filenames.size());
+			appendString(records, _datasets[i]._id);
+			for(size_t j=0; j<_datasets[i]._filenames.size(); j++) appendString(records, _datasets[i]._filenames[j]);
+		}
+
+		string header(SIMKA_CATALOG_MAGIC, 8);
+		appendU32(header, SIMKA_CATALOG_VERSION);
+		appendU32(header, 0);
+		u_int64_t nbDatasets = _datasets.size();
+		header.append((const char*) &nbDatasets, sizeof(nbDatasets));
+
+		//Written in a temp file, a catalog is either complete or absent
+		string tempFilename = filename + ".temp";
+		FILE* file = fopen(tempFilename.c_str(), "wb");
+		if(file == 0) throw Exception ("unable to write dataset catalog %s", tempFilename.c_str());
+
+		bool isWritten = fwrite(header.c_str(), 1, header.size(), file) == header.size();
+		if(offsets.size() > 0) isWritten = isWritten && fwrite(&offsets[0], sizeof(u_int64_t), offsets.size(), file) == offsets.size();
+		isWritten = isWritten && fwrite(records.c_str(), 1, records.size(), file) == records.size();
+		if(fclose(file) != 0 || !isWritten) throw Exception ("unable to write dataset catalog %s", tempFilename.c_str());
+
+		System::file().rename(tempFilename, filename);
+	}
+
+private:
+
+	static void appendU32(string& buffer, u_int32_t value){
+		buffer.append((const char*) &value, sizeof(value));
+	}
+
+	static void appendString(string& buffer, const string& value){
+		appendU32(buffer, value.size());
+		buffer += value;
+	}
+
+	vector<SimkaDataset> _datasets;
+};
+
+
+/*
+ * Saved catalog, mapped in memory. Records are decoded on demand.
+ */
+class SimkaDatasetCatalogFile
+{
+public:
+
+	SimkaDatasetCatalogFile(const string& filename) : _filename(filename), _data(0), _size(0), _nbDatasets(0)
+	{
+		int fd = open(filename.c_str(), O_RDONLY);
+		if(fd < 0) throw Exception ("unable to open dataset catalog %s", filename.c_str());
+
+		struct stat st;
+		if(fstat(fd, &st) != 0 || st.st_size < SIMKA_CATALOG_HEADER_SIZE){
+			close(fd);
+			throw Exception ("corrupted dataset catalog %s", filename.c_str());
+		}
+
+		void* data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(data == MAP_FAILED) throw Exception ("unable to map dataset catalog %s", filename.c_str());
+
+		_data = (const char*) data;
+		_size = st.st_size;
+
+		memcpy(&_nbDatasets, _data + 16, sizeof(_nbDatasets));
+		if(memcmp(_data, SIMKA_CATALOG_MAGIC, 8) != 0 || readU32(8) != SIMKA_CATALOG_VERSION || _nbDatasets > (_size - SIMKA_CATALOG_HEADER_SIZE) / sizeof(u_int64_t)){
+			munmap((void*) _data, _size);
+			throw Exception ("corrupted dataset catalog %s", filename.c_str());
+		}
+	}
+
+	~SimkaDatasetCatalogFile(){
+		munmap((void*) _data, _size);
+	}
+
+	size_t size(){ return _nbDatasets; }
+
+	string getId(size_t i){
+		u_int64_t pos = getRecordOffset(i) + 8;
+		return readString(pos);
+	}
+
+	SimkaDataset get(size_t i){
+
+		u_int64_t pos = getRecordOffset(i);
+
+		SimkaDataset dataset;
+		dataset._nbPaired = readU32(pos);
+		u_int32_t nbFiles = readU32(pos + 4);
+		pos += 8;
+
+		dataset._id = readString(pos);
+		for(u_int32_t j=0; j<nbFiles; j++) dataset._filenames.push_back(readString(pos));
+
+		return dataset;
+	}
+
+	void get(SimkaDatasetCatalog& catalog){
+		for(size_t i=0; i<_nbDatasets; i++) catalog.add(get(i));
+	}
+
+private:
+
+	u_int64_t getRecordOffset(size_t i){
+		if(i >= _nbDatasets) throw Exception ("dataset %d is not in catalog %s", (int)i, _filename.c_str());
+
+		u_int64_t offset;
+		memcpy(&offset, _data + SIMKA_CATALOG_HEADER_SIZE + i*sizeof(u_int64_t), sizeof(offset));
+		if(offset + 8 > _size) throw Exception ("corrupted dataset catalog %s", _filename.c_str());
+		return offset;
+	}
+
+	u_int32_t readU32(u_int64_t pos){
+		if(pos + 4 > _size) throw Exception ("corrupted dataset catalog %s", _filename.c_str());
+		u_int32_t value;
+		memcpy(&value, _data + pos, sizeof(value));
+		return value;
+	}
+
+	//Reads the string at pos and moves pos after it
+	string readString(u_int64_t& pos){
+		u_int32_t size = readU32(pos);
+		if(pos + 4 + size > _size) throw Exception ("corrupted dataset catalog %s", _filename.c_str());
+		string value(_data + pos + 4, size);
+		pos += 4 + size;
+		return value;
+	}
+
+	string _filename;
+	const char* _data;
+	u_int64_t _size;
+	u_int64_t _nbDatasets;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_SIMKADATASETCATALOG_HPP_ */
@@ -0,0 +1,186 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_SIMKADATASETPROFILER_HPP_
+#define TOOLS_SIMKA_SRC_SIMKADATASETPROFILER_HPP_
+
+#include <gatb/gatb_core.hpp>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include "SimkaCommons.hpp"
+#include "SimkaCountCache.hpp"
+
+/*
+ * Estimated size of a dataset: number of reads, number of bases and size of the longest read given
+ * by the gatb bank (which reads the beginning of the files), and size of the input files.
+ */
+struct SimkaDatasetProfile
+{
+	u_int64_t _nbReads;
+	u_int64_t _totalSize;
+	u_int64_t _maxSize;
+	u_int64_t _fileSize;
+
+	SimkaDatasetProfile() : _nbReads(0), _totalSize(0), _maxSize(0), _fileSize(0) {}
+
+	//Bytes of the input files per base
+	double getCompressionRatio() const {
+		if(_totalSize == 0) return 0;
+		return (double) _fileSize / (double) _totalSize;
+	}
+};
+
+
+/*
+ * Profiles of the datasets, used to estimate -max-reads and the configuration of the counting.
+ * The datasets are profiled by a pool of threads, the profiles are cached in a text file by the
+ * fingerprint of the input files of the dataset (path, size, modification time, see SimkaCountCache):
+ * 		<fingerprint hash> <nb reads> <total size> <max size> <file size>
+ */
+class SimkaDatasetProfiler
+{
+public:
+
+	SimkaDatasetProfiler(const string& cacheFilename) : _cacheFilename(cacheFilename), _nbCached(0)
+	{
+		ifstream cacheFile(cacheFilename.c_str());
+		string line;
+
+		while(getline(cacheFile, line)){
+			stringstream lineStream(line);
+			string key;
+			SimkaDatasetProfile profile;
+			if(lineStream >> key >> profile._nbReads >> profile._totalSize >> profile._maxSize >> profile._fileSize){
+				_profiles[key] = profile;
+			}
+		}
+	}
+
+	/*
+	 * Profiles of the datasets given by their bank file (see SimkaAlgorithm::layoutInputFilename). The profile
+	 * of an empty bank filename is empty.
+	 */
+	vector<SimkaDatasetProfile> profile(const vector<string>& bankFilenames, size_t nbThreads){
+
+		vector<SimkaDatasetProfile> profiles(bankFilenames.size());
+		vector<string> keys(bankFilenames.size());
+		std::mutex mutex;
+
+		SimkaCommons::runThreads(bankFilenames.size(), nbThreads, [&](size_t i){
+
+			if(bankFilenames[i] == "") return;
+
+			string key = SimkaCountCache::getEntryName(SimkaCountCache::getDatasetFingerprint(bankFilenames[i]));
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				keys[i] = key;
+				if(_profiles.find(key) != _profiles.end()){
+					profiles[i] = _profiles[key];
+					_nbCached += 1;
+					return;
+				}
+			}
+
+			SimkaDatasetProfile profile = computeProfile(bankFilenames[i]);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			profiles[i] = profile;
+			_profiles[key] = profile;
+		});
+
+		save();
+		return profiles;
+	}
+
+	//Number of profiles found in the cache by the last calls to profile()
+	u_int64_t getNbCached(){
+		return _nbCached;
+	}
+
+private:
+
+	static SimkaDatasetProfile computeProfile(const string& bankFilename){
+
+		SimkaDatasetProfile profile;
+
+		IBank* bank = Bank::open(bankFilename);
+		LOCAL(bank);
+		bank->estimate(profile._nbReads, profile._totalSize, profile._maxSize);
+
+		ifstream bankFile(bankFilename.c_str());
+		string filename;
+		while(getline(bankFile, filename)){
+			struct stat st;
+			if(filename != "" && stat(filename.c_str(), &st) == 0) profile._fileSize += st.st_size;
+		}
+
+		return profile;
+	}
+
+	void save(){
+
+		string tempFilename = _cacheFilename + ".temp";
+		ofstream cacheFile(tempFilename.c_str());
+
+		for(map<string, SimkaDatasetProfile>::iterator it=_profiles.begin(); it!=_profiles.end(); ++it){
+			const SimkaDatasetProfile& profile = it->second;
+			cacheFile << it->first << " " << profile._nbReads << " " << profile._totalSize << " " << profile._maxSize << " " << profile._fileSize << "\n";
+		}
+
+		cacheFile.close();
+		if(cacheFile) System::file().rename(tempFilename, _cacheFilename);
+	}
+
+	string _cacheFilename;
+	map<string, SimkaDatasetProfile> _profiles;
+	u_int64_t _nbCached;
+};
+
+
+/*
+ * Bank giving the estimations of a profile, used instead of opening the dataset again.
+ */
+class SimkaBankProfile : public BankDelegate
+{
+public:
+
+	SimkaBankProfile(const SimkaDatasetProfile& profile) : BankDelegate(new BankStrings(vector<string>())), _profile(profile)
+	{
+	}
+
+	int64_t estimateNbItems(){
+		return _profile._nbReads;
+	}
+
+	void estimate(u_int64_t& number, u_int64_t& totalSize, u_int64_t& maxSize){
+		number = _profile._nbReads;
+		totalSize = _profile._totalSize;
+		maxSize = _profile._maxSize;
+	}
+
+private:
+
+	SimkaDatasetProfile _profile;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_SIMKADATASETPROFILER_HPP_ */
@@ -24,7 +24,14 @@
 
 
 
-SimkaStatistics::SimkaStatistics(size_t nbBanks, bool computeSimpleDistances, bool computeComplexDistances, const string& tmpDir, const vector<string>& datasetIds)
+SimkaStatistics::SimkaStatistics(size_t nbBanks, bool computeSimpleDistances, bool computeComplexDistances, const string& tmpDir, const vector<string>& datasetIds) :
+	SimkaStatistics(nbBanks, computeSimpleDistances, computeComplexDistances)
+{
+	loadDatasets(tmpDir, datasetIds);
+}
+
+
+SimkaStatistics::SimkaStatistics(size_t nbBanks, bool computeSimpleDistances, bool computeComplexDistances)
 {
 
 	_nbBanks = nbBanks;
@@ -111,6 +118,25 @@ SimkaStatistics::SimkaStatistics(size_t nbBanks, bool computeSimpleDistances, bo
 
 
 
+	_totalReads = 0;
+}
+
+
+u_int64_t SimkaStatistics::getMemorySize(size_t nbBanks, bool computeSimpleDistances, bool computeComplexDistances){
+
+	u_int64_t matrixSize = (u_int64_t) nbBanks * nbBanks;
+
+	//Shared kmers (full matrix), distinct shared kmers and Bray Curtis (half matrices)
+	u_int64_t size = matrixSize * sizeof(u_int64_t) * 2;
+	if(computeSimpleDistances) size += matrixSize * (sizeof(long double) + 2*sizeof(u_int64_t));
+	if(computeComplexDistances) size += matrixSize * (sizeof(long double) + 2*sizeof(u_int64_t));
+
+	return size;
+}
+
+
+void SimkaStatistics::loadDatasets(const string& tmpDir, const vector<string>& datasetIds){
+
 	_totalReads = 0;
 
 	for(size_t i=0; i<_nbBanks; i++){
@@ -153,6 +179,15 @@ SimkaStatistics::SimkaStatistics(size_t nbBanks, bool computeSimpleDistances, bo
 }
 
 
+void SimkaStatistics::copyDatasets(const SimkaStatistics& other){
+	_datasetNbReads = other._datasetNbReads;
+	_nbSolidDistinctKmersPerBank = other._nbSolidDistinctKmersPerBank;
+	_nbSolidKmersPerBank = other._nbSolidKmersPerBank;
+	_chord_sqrt_N2 = other._chord_sqrt_N2;
+	_totalReads = other._totalReads;
+}
+
+
 SimkaStatistics& SimkaStatistics::operator+=  (const SimkaStatistics& other){
 
 
@@ -350,8 +385,14 @@ void SimkaStatistics::load(const string& filename){
 	it->first();
 
 	//_nbBanks = it->item(); it->next();
-	_computeSimpleDistances = it->item(); it->next();
-	_computeComplexDistances = it->item(); it->next();
+	bool computeSimpleDistances = it->item(); it->next();
+	bool computeComplexDistances = it->item(); it->next();
+
+	//The matrices of the distances which are not computed are not allocated
+	if(computeSimpleDistances != _computeSimpleDistances || computeComplexDistances != _computeComplexDistances){
+		delete file;
+		throw Exception ("statistics file %s has not been computed with the same distance options (-simple-dist, -complex-dist)", filename.c_str());
+	}
 	//cout << _computeSimpleDistances << "   " << _computeComplexDistances << endl;
 	_nbKmers = it->item(); it->next();
 	_nbErroneousKmers = it->item(); it->next();
@@ -452,6 +493,54 @@ void SimkaStatistics::load(const string& filename){
         */
 }
 
+/*
+ * Update mode: loads the statistics of a partition computed by the previous run, whose datasets are the
+ * first nbPreviousBanks datasets of this run. Only the values of the pairs of previous datasets are
+ * loaded, the kmer counts of the partition are computed again by the merge.
+ */
+void SimkaStatistics::loadPrevious(const string& filename, size_t nbPreviousBanks, const string& tmpDir, const vector<string>& datasetIds){
+
+	vector<string> previousDatasetIds(datasetIds.begin(), datasetIds.begin() + nbPreviousBanks);
+	SimkaStatistics previous(nbPreviousBanks, _computeSimpleDistances, _computeComplexDistances, tmpDir, previousDatasetIds);
+	previous.load(filename);
+
+	for(size_t i=0; i<nbPreviousBanks; i++){
+		for(size_t j=0; j<nbPreviousBanks; j++){
+			_matrixNbSharedKmers[i][j] = previous._matrixNbSharedKmers[i][j];
+		}
+	}
+
+	//The symetric index of a pair depends on the number of banks
+	for(size_t i=0; i<nbPreviousBanks; i++){
+		for(size_t j=i; j<nbPreviousBanks; j++){
+			size_t symetricIndex = j + ((_nbBanks-1)*i) - (i*(i-1)/2);
+			size_t previousSymetricIndex = j + ((nbPreviousBanks-1)*i) - (i*(i-1)/2);
+			_matrixNbDistinctSharedKmers[symetricIndex] = previous._matrixNbDistinctSharedKmers[previousSymetricIndex];
+			_brayCurtisNumerator[symetricIndex] = previous._brayCurtisNumerator[previousSymetricIndex];
+		}
+	}
+
+	if(_computeSimpleDistances){
+		for(size_t i=0; i<nbPreviousBanks; i++){
+			for(size_t j=0; j<nbPreviousBanks; j++){
+				_chord_NiNj[i][j] = previous._chord_NiNj[i][j];
+				_hellinger_SqrtNiNj[i][j] = previous._hellinger_SqrtNiNj[i][j];
+				_kulczynski_minNiNj[i][j] = previous._kulczynski_minNiNj[i][j];
+			}
+		}
+	}
+
+	if(_computeComplexDistances){
+		for(size_t i=0; i<nbPreviousBanks; i++){
+			for(size_t j=0; j<nbPreviousBanks; j++){
+				_canberra[i][j] = previous._canberra[i][j];
+				_whittaker_minNiNj[i][j] = previous._whittaker_minNiNj[i][j];
+				_kullbackLeibler[i][j] = previous._kullbackLeibler[i][j];
+			}
+		}
+	}
+}
+
 void SimkaStatistics::save (const string& filename){
 
 
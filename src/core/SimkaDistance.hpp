@@ -70,9 +70,20 @@ class SimkaStatistics{
 public:
 
 	SimkaStatistics(size_t nbBanks, bool computeSimpleDistances, bool computeComplexDistances, const string& tmpDir, const vector<string>& datasetIds);
+	//Empty statistics, without the counts of the datasets (see loadDatasets and copyDatasets)
+	SimkaStatistics(size_t nbBanks, bool computeSimpleDistances, bool computeComplexDistances);
+
+	//Approximate size of the matrices of the statistics of nbBanks datasets
+	static u_int64_t getMemorySize(size_t nbBanks, bool computeSimpleDistances, bool computeComplexDistances);
+
+	//Counts of the datasets, read from their count_synchro/<id>.ok file
+	void loadDatasets(const string& tmpDir, const vector<string>& datasetIds);
+	void copyDatasets(const SimkaStatistics& other);
+
 	SimkaStatistics& operator+=  (const SimkaStatistics& other);
 	void print();
 	void load(const string& filename);
+	void loadPrevious(const string& filename, size_t nbPreviousBanks, const string& tmpDir, const vector<string>& datasetIds);
 	void save(const string& filename);
 	void outputMatrix(const string& outputDir, const vector<string>& _bankNames);
 
@@ -0,0 +1,1190 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_SIMKAINPUTREADER_HPP_
+#define TOOLS_SIMKA_SRC_SIMKAINPUTREADER_HPP_
+
+#include <gatb/gatb_core.hpp>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef SIMKA_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Input layer of the counting: the input files of a dataset are decompressed by background threads
+ * and given to the fasta/fastq parser as a stream of chunks.
+ *
+ * 		plain file		mapped in memory (read by the parser thread if it can not be mapped)
+ * 		gzip			inflated by one decoder thread, in parallel with the parsing
+ * 		BGZF			blocks are read by one thread and inflated in parallel by nbThreads threads
+ * 		zstd			decoded by one decoder thread (build option SIMKA_ZSTD)
+ * 		seekable zstd	frames are decoded in parallel by nbThreads threads (build option SIMKA_ZSTD)
+ *
+ * Decoded chunks go through a bounded queue which gives them back in file order.
+ *
+ * Input files can be named pipes or process substitutions (/dev/stdin, <(...)): each file is opened
+ * once and read sequentially, the format is detected on the first bytes of the stream.
+ */
+
+#define SIMKA_INPUT_CHUNK_SIZE (1*MBYTE)
+#define SIMKA_INPUT_MAX_PENDING_CHUNKS 16
+#define SIMKA_BGZF_BLOCKS_PER_JOB 64
+#define SIMKA_BGZF_HEADER_SIZE 12
+#define SIMKA_BGZF_TRAILER_SIZE 8
+
+
+/*
+ * Decoded chunks indexed by their position in the file. push() waits while the chunk is too far
+ * ahead of the chunk expected by pop(), so that at most capacity chunks are in memory.
+ */
+class SimkaChunkQueue
+{
+public:
+
+	SimkaChunkQueue(size_t capacity) : _capacity(capacity), _next(0), _isFinished(false), _isCancelled(false)
+	{
+	}
+
+	bool push(u_int64_t index, vector<char>& chunk){
+		std::unique_lock<std::mutex> lock(_mutex);
+		_notFull.wait(lock, [&]{ return index < _next + _capacity || _isCancelled; });
+		if(_isCancelled) return false;
+
+		_chunks[index].swap(chunk);
+		_notEmpty.notify_all();
+		return true;
+	}
+
+	bool pop(vector<char>& chunk){
+		std::unique_lock<std::mutex> lock(_mutex);
+		_notEmpty.wait(lock, [&]{ return _chunks.count(_next) > 0 || _isFinished || _error != ""; });
+		if(_error != "") throw Exception ("%s", _error.c_str());
+
+		std::map<u_int64_t, vector<char> >::iterator it = _chunks.find(_next);
+		if(it == _chunks.end()) return false;
+
+		chunk.swap(it->second);
+		_chunks.erase(it);
+		_next += 1;
+		_notFull.notify_all();
+		return true;
+	}
+
+	//Called once all the chunks are pushed
+	void finish(){
+		std::lock_guard<std::mutex> lock(_mutex);
+		_isFinished = true;
+		_notEmpty.notify_all();
+	}
+
+	void setError(const string& error){
+		std::lock_guard<std::mutex> lock(_mutex);
+		if(_error == "") _error = error;
+		_notEmpty.notify_all();
+	}
+
+	void cancel(){
+		std::lock_guard<std::mutex> lock(_mutex);
+		_isCancelled = true;
+		_notFull.notify_all();
+	}
+
+	bool isCancelled(){
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _isCancelled;
+	}
+
+private:
+
+	size_t _capacity;
+	u_int64_t _next;
+	bool _isFinished;
+	bool _isCancelled;
+	string _error;
+	std::map<u_int64_t, vector<char> > _chunks;
+	std::mutex _mutex;
+	std::condition_variable _notEmpty;
+	std::condition_variable _notFull;
+};
+
+
+/*
+ * Input file opened once. The first bytes read by peek() to detect the format are given again by
+ * read(), so that non seekable files (pipes) do not have to be opened twice.
+ */
+class SimkaInputFile
+{
+public:
+
+	SimkaInputFile(const string& filename) : _filename(filename), _prefixPos(0)
+	{
+		_file = fopen(filename.c_str(), "rb");
+		if(_file == 0) throw Exception ("unable to open input file %s", filename.c_str());
+
+		struct stat st;
+		_isStream = fstat(fileno(_file), &st) != 0 || !S_ISREG(st.st_mode);
+	}
+
+	~SimkaInputFile(){
+		fclose(_file);
+	}
+
+	//Reads the first bytes of the file, they are read again by read()
+	size_t peek(u_int8_t* buffer, size_t size){
+		_prefix.resize(size);
+		_prefix.resize(fread(&_prefix[0], 1, size, _file));
+		_prefixPos = 0;
+		if(_prefix.size() > 0) memcpy(buffer, &_prefix[0], _prefix.size());
+		return _prefix.size();
+	}
+
+	size_t read(void* buffer, size_t size){
+		size_t prefixSize = min(size, _prefix.size() - _prefixPos);
+		if(prefixSize > 0){
+			memcpy(buffer, &_prefix[_prefixPos], prefixSize);
+			_prefixPos += prefixSize;
+		}
+		if(prefixSize == size) return size;
+		return prefixSize + fread((char*) buffer + prefixSize, 1, size - prefixSize, _file);
+	}
+
+	//Back to the beginning of a regular file, after reading its end (see SimkaSeekableZstdSource)
+	void rewind(){
+		fseeko(_file, 0, SEEK_SET);
+		_prefix.clear();
+		_prefixPos = 0;
+	}
+
+	const string& getFilename(){ return _filename; }
+	FILE* getFile(){ return _file; }
+	int getDescriptor(){ return fileno(_file); }
+
+	//Pipes, character devices... can only be read once, from the beginning to the end
+	bool isStream(){ return _isStream; }
+
+	static bool isStream(const string& filename){
+		struct stat st;
+		return stat(filename.c_str(), &st) == 0 && !S_ISREG(st.st_mode);
+	}
+
+private:
+
+	string _filename;
+	FILE* _file;
+	bool _isStream;
+	vector<u_int8_t> _prefix;
+	size_t _prefixPos;
+};
+
+
+/*
+ * Decompressed content of an input file, chunk after chunk.
+ */
+class SimkaInputSource
+{
+public:
+
+	virtual ~SimkaInputSource(){}
+
+	//Returns false at the end of the file
+	virtual bool read(vector<char>& chunk) = 0;
+
+	//Whole content of the file if it is mapped in memory, the file is then parsed in place
+	virtual bool getMappedData(const char*& data, size_t& size){ return false; }
+
+	static SimkaInputSource* create(const string& filename, size_t nbThreads);
+
+	//Size of a BGZF block given by the BC field of its header, 0 if the header is not a BGZF header
+	static size_t getBgzfBlockSize(const u_int8_t* header, size_t size){
+
+		if(size < SIMKA_BGZF_HEADER_SIZE) return 0;
+		if(header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 || (header[3] & 4) == 0) return 0;
+
+		size_t xlen = header[10] | (header[11] << 8);
+		if(size < SIMKA_BGZF_HEADER_SIZE + xlen) return 0;
+
+		const u_int8_t* extra = header + SIMKA_BGZF_HEADER_SIZE;
+		for(size_t i=0; i+4<=xlen; ){
+			size_t slen = extra[i+2] | (extra[i+3] << 8);
+			if(extra[i] == 'B' && extra[i+1] == 'C' && slen == 2 && i+6 <= xlen){
+				return (extra[i+4] | (extra[i+5] << 8)) + 1;
+			}
+			i += 4 + slen;
+		}
+
+		return 0;
+	}
+};
+
+
+class SimkaPlainSource : public SimkaInputSource
+{
+public:
+
+	SimkaPlainSource(SimkaInputFile* file) : _file(file)
+	{
+	}
+
+	bool read(vector<char>& chunk){
+		chunk.resize(SIMKA_INPUT_CHUNK_SIZE);
+		size_t size = _file->read(&chunk[0], chunk.size());
+		chunk.resize(size);
+		return size > 0;
+	}
+
+private:
+
+	std::unique_ptr<SimkaInputFile> _file;
+};
+
+
+/*
+ * Uncompressed regular file, mapped in memory. The reads given by the parser reference the
+ * mapping, so that the file is not copied.
+ */
+class SimkaMappedSource : public SimkaInputSource
+{
+public:
+
+	SimkaMappedSource(SimkaInputFile& file) : _data(0), _size(0), _pos(0)
+	{
+		struct stat st;
+		if(!file.isStream() && fstat(file.getDescriptor(), &st) == 0 && st.st_size > 0){
+			//Private writable mapping: an in place modification of a read does not change the file
+			void* data = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file.getDescriptor(), 0);
+			if(data != MAP_FAILED){
+				_data = (char*) data;
+				_size = st.st_size;
+				madvise(_data, _size, MADV_SEQUENTIAL);
+			}
+		}
+	}
+
+	~SimkaMappedSource(){
+		if(_data) munmap(_data, _size);
+	}
+
+	bool isMapped(){
+		return _data != 0;
+	}
+
+	bool getMappedData(const char*& data, size_t& size){
+		data = _data;
+		size = _size;
+		return true;
+	}
+
+	bool read(vector<char>& chunk){
+		size_t size = min((size_t)SIMKA_INPUT_CHUNK_SIZE, _size - _pos);
+		chunk.assign(_data + _pos, _data + _pos + size);
+		_pos += size;
+		return size > 0;
+	}
+
+private:
+
+	char* _data;
+	size_t _size;
+	size_t _pos;
+};
+
+
+/*
+ * Gzip file (possibly made of several members), inflated by a decoder thread.
+ */
+class SimkaGzipSource : public SimkaInputSource
+{
+public:
+
+	SimkaGzipSource(SimkaInputFile* file) : _filename(file->getFilename()), _file(file), _chunks(SIMKA_INPUT_MAX_PENDING_CHUNKS)
+	{
+		_thread = std::thread(&SimkaGzipSource::decode, this);
+	}
+
+	~SimkaGzipSource(){
+		_chunks.cancel();
+		_thread.join();
+	}
+
+	bool read(vector<char>& chunk){
+		return _chunks.pop(chunk);
+	}
+
+private:
+
+	void decode(){
+
+		z_stream stream;
+		memset(&stream, 0, sizeof(stream));
+		if(inflateInit2(&stream, 15+32) != Z_OK){
+			_chunks.setError("unable to inflate input file " + _filename);
+			return;
+		}
+
+		vector<char> input(SIMKA_INPUT_CHUNK_SIZE);
+		vector<char> output(SIMKA_INPUT_CHUNK_SIZE);
+		u_int64_t index = 0;
+		bool isEof = false;
+		bool isMemberComplete = true;
+
+		stream.next_out = (Bytef*) &output[0];
+		stream.avail_out = output.size();
+
+		while(!_chunks.isCancelled()){
+
+			if(stream.avail_in == 0 && !isEof){
+				size_t size = _file->read(&input[0], input.size());
+				isEof = (size == 0);
+				stream.next_in = (Bytef*) &input[0];
+				stream.avail_in = size;
+			}
+
+			if(isEof && isMemberComplete) break;
+
+			uInt previousAvailOut = stream.avail_out;
+			int ret = inflate(&stream, Z_NO_FLUSH);
+			isMemberComplete = (ret == Z_STREAM_END);
+
+			if(ret == Z_STREAM_END){
+				//Next member of a multi-member file
+				inflateReset(&stream);
+			}
+			else if((ret != Z_OK && ret != Z_BUF_ERROR) || (isEof && stream.avail_out == previousAvailOut)){
+				_chunks.setError((ret == Z_OK || ret == Z_BUF_ERROR ? "truncated gzip input file " : "corrupted gzip input file ") + _filename);
+				inflateEnd(&stream);
+				return;
+			}
+
+			if(stream.avail_out == 0){
+				if(!_chunks.push(index++, output)) break;
+				output.resize(SIMKA_INPUT_CHUNK_SIZE);
+				stream.next_out = (Bytef*) &output[0];
+				stream.avail_out = output.size();
+			}
+		}
+
+		inflateEnd(&stream);
+
+		output.resize(output.size() - stream.avail_out);
+		if(output.size() > 0) _chunks.push(index++, output);
+		_chunks.finish();
+	}
+
+	string _filename;
+	std::unique_ptr<SimkaInputFile> _file;
+	SimkaChunkQueue _chunks;
+	std::thread _thread;
+};
+
+
+/*
+ * File made of independent compressed frames. The reader thread groups the frames in jobs, the jobs
+ * are decoded in parallel by nbThreads threads. Subclasses must call start() at the end of their
+ * constructor and stop() at the beginning of their destructor.
+ */
+class SimkaParallelSource : public SimkaInputSource
+{
+public:
+
+	SimkaParallelSource(SimkaInputFile* file, size_t nbThreads) :
+		_filename(file->getFilename()), _file(file), _chunks(max(nbThreads*2, (size_t)SIMKA_INPUT_MAX_PENDING_CHUNKS)), _isClosed(false), _isCancelled(false), _nbThreads(max(nbThreads, (size_t)1))
+	{
+		_maxPendingJobs = _nbThreads * 2;
+		_nbActiveWorkers = _nbThreads;
+	}
+
+	virtual ~SimkaParallelSource(){
+	}
+
+	bool read(vector<char>& chunk){
+		return _chunks.pop(chunk);
+	}
+
+protected:
+
+	struct Job{
+		u_int64_t _index;
+		vector<u_int8_t> _data;
+		vector<u_int64_t> _frameSizes; //compressed size and decoded size of each frame, if known
+	};
+
+	//Reads the frames of the next job, returns false at the end of the file
+	virtual bool readJob(Job& job) = 0;
+
+	//Decodes the frames of a job, returns false if they are corrupted
+	virtual bool decodeJob(void* context, Job& job, vector<char>& output) = 0;
+
+	virtual void* createContext() = 0;
+	virtual void deleteContext(void* context) = 0;
+
+	void start(){
+		_reader = std::thread(&SimkaParallelSource::readJobs, this);
+		for(size_t i=0; i<_nbThreads; i++){
+			_workers.push_back(std::thread(&SimkaParallelSource::decodeJobs, this));
+		}
+	}
+
+	void stop(){
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_isCancelled = true;
+			_jobAvailable.notify_all();
+			_jobTaken.notify_all();
+		}
+		_chunks.cancel();
+
+		if(_reader.joinable()) _reader.join();
+		for(size_t i=0; i<_workers.size(); i++) _workers[i].join();
+		_workers.clear();
+	}
+
+	string _filename;
+	std::unique_ptr<SimkaInputFile> _file;
+	SimkaChunkQueue _chunks;
+
+private:
+
+	void readJobs(){
+
+		u_int64_t index = 0;
+
+		while(true){
+			Job job;
+			job._index = index++;
+			if(!readJob(job)) break;
+
+			std::unique_lock<std::mutex> lock(_mutex);
+			_jobTaken.wait(lock, [&]{ return _jobs.size() < _maxPendingJobs || _isCancelled; });
+			if(_isCancelled) break;
+
+			_jobs.push_back(Job());
+			_jobs.back()._index = job._index;
+			_jobs.back()._data.swap(job._data);
+			_jobs.back()._frameSizes.swap(job._frameSizes);
+			_jobAvailable.notify_one();
+		}
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		_isClosed = true;
+		_jobAvailable.notify_all();
+	}
+
+	void decodeJobs(){
+
+		void* context = createContext();
+
+		while(context){
+
+			Job job;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_jobAvailable.wait(lock, [&]{ return _jobs.size() > 0 || _isClosed || _isCancelled; });
+				if(_isCancelled || _jobs.size() == 0) break;
+
+				job._index = _jobs.front()._index;
+				job._data.swap(_jobs.front()._data);
+				job._frameSizes.swap(_jobs.front()._frameSizes);
+				_jobs.pop_front();
+				_jobTaken.notify_one();
+			}
+
+			vector<char> output;
+			if(!decodeJob(context, job, output)){
+				_chunks.setError("corrupted compressed block in input file " + _filename);
+				break;
+			}
+			if(!_chunks.push(job._index, output)) break;
+		}
+
+		if(context) deleteContext(context);
+		else _chunks.setError("unable to decompress input file " + _filename);
+
+		//The last worker signals the end of the file
+		std::lock_guard<std::mutex> lock(_mutex);
+		_nbActiveWorkers -= 1;
+		if(_nbActiveWorkers == 0) _chunks.finish();
+	}
+
+	std::deque<Job> _jobs;
+	size_t _maxPendingJobs;
+	bool _isClosed;
+	bool _isCancelled;
+	size_t _nbThreads;
+	size_t _nbActiveWorkers;
+	std::mutex _mutex;
+	std::condition_variable _jobAvailable;
+	std::condition_variable _jobTaken;
+
+	std::thread _reader;
+	vector<std::thread> _workers;
+};
+
+
+/*
+ * BGZF file: a sequence of independent gzip blocks of at most 64 KB of data.
+ */
+class SimkaBgzfSource : public SimkaParallelSource
+{
+public:
+
+	SimkaBgzfSource(SimkaInputFile* file, size_t nbThreads) : SimkaParallelSource(file, nbThreads)
+	{
+		start();
+	}
+
+	~SimkaBgzfSource(){
+		stop();
+	}
+
+protected:
+
+	bool readJob(Job& job){
+
+		vector<u_int8_t> header(SIMKA_BGZF_HEADER_SIZE + 0xFFFF);
+
+		for(size_t nbBlocks=0; nbBlocks<SIMKA_BGZF_BLOCKS_PER_JOB; nbBlocks++){
+
+			size_t size = _file->read(&header[0], SIMKA_BGZF_HEADER_SIZE);
+			if(size == 0) break;
+
+			size_t xlen = (size == SIMKA_BGZF_HEADER_SIZE) ? (header[10] | (header[11] << 8)) : 0;
+			if(size == SIMKA_BGZF_HEADER_SIZE) size += _file->read(&header[SIMKA_BGZF_HEADER_SIZE], xlen);
+
+			size_t blockSize = getBgzfBlockSize(&header[0], size);
+			if(blockSize < size + SIMKA_BGZF_TRAILER_SIZE){
+				_chunks.setError("invalid BGZF block in input file " + _filename);
+				return false;
+			}
+
+			size_t offset = job._data.size();
+			job._data.resize(offset + blockSize);
+			memcpy(&job._data[offset], &header[0], size);
+			if(_file->read(&job._data[offset + size], blockSize - size) != blockSize - size){
+				_chunks.setError("truncated BGZF block in input file " + _filename);
+				return false;
+			}
+		}
+
+		return job._data.size() > 0;
+	}
+
+	bool decodeJob(void* context, Job& job, vector<char>& output){
+
+		z_stream& stream = *(z_stream*) context;
+
+		size_t offset = 0;
+		while(offset < job._data.size()){
+
+			const u_int8_t* block = &job._data[offset];
+			size_t xlen = block[10] | (block[11] << 8);
+			size_t blockSize = getBgzfBlockSize(block, job._data.size() - offset);
+
+			const u_int8_t* trailer = block + blockSize - SIMKA_BGZF_TRAILER_SIZE;
+			u_int32_t crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((u_int32_t)trailer[3] << 24);
+			u_int32_t dataSize = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | ((u_int32_t)trailer[7] << 24);
+
+			size_t outputOffset = output.size();
+			output.resize(outputOffset + dataSize);
+
+			if(dataSize > 0){
+				inflateReset(&stream);
+				stream.next_in = (Bytef*) (block + SIMKA_BGZF_HEADER_SIZE + xlen);
+				stream.avail_in = blockSize - SIMKA_BGZF_HEADER_SIZE - xlen - SIMKA_BGZF_TRAILER_SIZE;
+				stream.next_out = (Bytef*) &output[outputOffset];
+				stream.avail_out = dataSize;
+
+				if(inflate(&stream, Z_FINISH) != Z_STREAM_END || stream.avail_out != 0) return false;
+				if(crc32(0, (const Bytef*) &output[outputOffset], dataSize) != crc) return false;
+			}
+
+			offset += blockSize;
+		}
+
+		return true;
+	}
+
+	void* createContext(){
+		z_stream* stream = new z_stream;
+		memset(stream, 0, sizeof(z_stream));
+		if(inflateInit2(stream, -15) == Z_OK) return stream;
+		delete stream;
+		return 0;
+	}
+
+	void deleteContext(void* context){
+		inflateEnd((z_stream*) context);
+		delete (z_stream*) context;
+	}
+};
+
+
+#ifdef SIMKA_ZSTD
+
+#define SIMKA_ZSTD_MAGIC 0xFD2FB528
+#define SIMKA_ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+#define SIMKA_ZSTD_SEEKABLE_FOOTER_SIZE 9
+
+/*
+ * Zstd file, decoded by a decoder thread in parallel with the parsing.
+ */
+class SimkaZstdSource : public SimkaInputSource
+{
+public:
+
+	SimkaZstdSource(SimkaInputFile* file) : _filename(file->getFilename()), _file(file), _chunks(SIMKA_INPUT_MAX_PENDING_CHUNKS)
+	{
+		_thread = std::thread(&SimkaZstdSource::decode, this);
+	}
+
+	~SimkaZstdSource(){
+		_chunks.cancel();
+		_thread.join();
+	}
+
+	bool read(vector<char>& chunk){
+		return _chunks.pop(chunk);
+	}
+
+private:
+
+	void decode(){
+
+		ZSTD_DStream* stream = ZSTD_createDStream();
+		if(stream == 0 || ZSTD_isError(ZSTD_initDStream(stream))){
+			if(stream) ZSTD_freeDStream(stream);
+			_chunks.setError("unable to decompress input file " + _filename);
+			return;
+		}
+
+		vector<char> inputBuffer(ZSTD_DStreamInSize());
+		vector<char> output(SIMKA_INPUT_CHUNK_SIZE);
+		ZSTD_inBuffer input = {&inputBuffer[0], 0, 0};
+		ZSTD_outBuffer out = {&output[0], output.size(), 0};
+		u_int64_t index = 0;
+		bool isEof = false;
+		size_t ret = 0;
+
+		while(!_chunks.isCancelled()){
+
+			if(input.pos == input.size && !isEof){
+				input.size = _file->read(&inputBuffer[0], inputBuffer.size());
+				input.pos = 0;
+				isEof = (input.size == 0);
+			}
+
+			//ret is 0 at the end of each frame
+			if(isEof && ret == 0) break;
+
+			size_t previousPos = out.pos;
+			ret = ZSTD_decompressStream(stream, &out, &input);
+
+			if(ZSTD_isError(ret) || (isEof && out.pos == previousPos)){
+				_chunks.setError((ZSTD_isError(ret) ? "corrupted zstd input file " : "truncated zstd input file ") + _filename);
+				ZSTD_freeDStream(stream);
+				return;
+			}
+
+			if(out.pos == out.size){
+				if(!_chunks.push(index++, output)) break;
+				output.resize(SIMKA_INPUT_CHUNK_SIZE);
+				out.dst = &output[0];
+				out.pos = 0;
+			}
+		}
+
+		ZSTD_freeDStream(stream);
+
+		output.resize(out.pos);
+		if(output.size() > 0) _chunks.push(index++, output);
+		_chunks.finish();
+	}
+
+	string _filename;
+	std::unique_ptr<SimkaInputFile> _file;
+	SimkaChunkQueue _chunks;
+	std::thread _thread;
+};
+
+
+/*
+ * Seekable zstd file: the seek table stored at the end of the file gives the compressed and the
+ * decoded size of each frame, so that the frames can be decoded in parallel.
+ */
+class SimkaSeekableZstdSource : public SimkaParallelSource
+{
+public:
+
+	SimkaSeekableZstdSource(SimkaInputFile* file, size_t nbThreads, const vector<u_int64_t>& frameSizes) :
+		SimkaParallelSource(file, nbThreads), _frameSizes(frameSizes), _frameIndex(0)
+	{
+		start();
+	}
+
+	~SimkaSeekableZstdSource(){
+		stop();
+	}
+
+	//Compressed and decoded sizes of the frames, empty if the file has no seek table
+	static vector<u_int64_t> readSeekTable(FILE* file){
+
+		vector<u_int64_t> frameSizes;
+		u_int8_t footer[SIMKA_ZSTD_SEEKABLE_FOOTER_SIZE];
+
+		if(fseeko(file, -SIMKA_ZSTD_SEEKABLE_FOOTER_SIZE, SEEK_END) != 0) return frameSizes;
+		if(fread(footer, 1, sizeof(footer), file) != sizeof(footer)) return frameSizes;
+		if(readU32(footer + 5) != SIMKA_ZSTD_SEEKABLE_MAGIC) return frameSizes;
+
+		u_int64_t nbFrames = readU32(footer);
+		size_t entrySize = (footer[4] & 0x80) ? 12 : 8;
+
+		vector<u_int8_t> entries(nbFrames * entrySize);
+		off_t tableOffset = - (off_t)(SIMKA_ZSTD_SEEKABLE_FOOTER_SIZE + entries.size());
+		if(nbFrames > 0){
+			if(fseeko(file, tableOffset, SEEK_END) != 0) return frameSizes;
+			if(fread(&entries[0], 1, entries.size(), file) != entries.size()) return frameSizes;
+		}
+
+		for(size_t i=0; i<nbFrames; i++){
+			frameSizes.push_back(readU32(&entries[i*entrySize]));
+			frameSizes.push_back(readU32(&entries[i*entrySize + 4]));
+		}
+
+		return frameSizes;
+	}
+
+protected:
+
+	bool readJob(Job& job){
+
+		u_int64_t decodedSize = 0;
+
+		while(_frameIndex < _frameSizes.size()/2 && decodedSize < SIMKA_INPUT_CHUNK_SIZE*4){
+
+			u_int64_t compressedSize = _frameSizes[_frameIndex*2];
+			size_t offset = job._data.size();
+			job._data.resize(offset + compressedSize);
+			if(compressedSize > 0 && _file->read(&job._data[offset], compressedSize) != compressedSize){
+				_chunks.setError("truncated zstd input file " + _filename);
+				return false;
+			}
+
+			job._frameSizes.push_back(compressedSize);
+			job._frameSizes.push_back(_frameSizes[_frameIndex*2+1]);
+			decodedSize += _frameSizes[_frameIndex*2+1];
+			_frameIndex += 1;
+		}
+
+		return job._frameSizes.size() > 0;
+	}
+
+	bool decodeJob(void* context, Job& job, vector<char>& output){
+
+		ZSTD_DCtx* dctx = (ZSTD_DCtx*) context;
+		size_t inputOffset = 0;
+
+		for(size_t i=0; i<job._frameSizes.size()/2; i++){
+
+			u_int64_t compressedSize = job._frameSizes[i*2];
+			u_int64_t decodedSize = job._frameSizes[i*2+1];
+
+			size_t outputOffset = output.size();
+			output.resize(outputOffset + decodedSize);
+
+			size_t size = ZSTD_decompressDCtx(dctx, decodedSize > 0 ? &output[outputOffset] : 0, decodedSize, &job._data[inputOffset], compressedSize);
+			if(ZSTD_isError(size) || size != decodedSize) return false;
+
+			inputOffset += compressedSize;
+		}
+
+		return true;
+	}
+
+	void* createContext(){
+		return ZSTD_createDCtx();
+	}
+
+	void deleteContext(void* context){
+		ZSTD_freeDCtx((ZSTD_DCtx*) context);
+	}
+
+private:
+
+	static u_int32_t readU32(const u_int8_t* buffer){
+		return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((u_int32_t)buffer[3] << 24);
+	}
+
+	vector<u_int64_t> _frameSizes;
+	size_t _frameIndex;
+};
+
+#endif
+
+
+inline SimkaInputSource* SimkaInputSource::create(const string& filename, size_t nbThreads){
+
+	u_int8_t header[SIMKA_BGZF_HEADER_SIZE + 6];
+	std::unique_ptr<SimkaInputFile> file(new SimkaInputFile(filename));
+	size_t size = file->peek(header, sizeof(header));
+
+#ifdef SIMKA_ZSTD
+	if(size >= 4 && (header[0] | (header[1] << 8) | (header[2] << 16) | ((u_int32_t)header[3] << 24)) == SIMKA_ZSTD_MAGIC){
+		//The seek table is at the end of the file, a pipe is decoded as a regular zstd stream
+		if(!file->isStream()){
+			vector<u_int64_t> frameSizes = SimkaSeekableZstdSource::readSeekTable(file->getFile());
+			file->rewind();
+			if(frameSizes.size() > 0) return new SimkaSeekableZstdSource(file.release(), nbThreads, frameSizes);
+		}
+		return new SimkaZstdSource(file.release());
+	}
+#endif
+
+	if(size >= 2 && header[0] == 0x1f && header[1] == 0x8b){
+		if(getBgzfBlockSize(header, size) > 0) return new SimkaBgzfSource(file.release(), nbThreads);
+		return new SimkaGzipSource(file.release());
+	}
+
+	SimkaMappedSource* mappedSource = new SimkaMappedSource(*file);
+	if(mappedSource->isMapped()) return mappedSource;
+	delete mappedSource;
+
+	return new SimkaPlainSource(file.release());
+}
+
+
+/*
+ * Fasta/fastq parser of one input file. Fastq records are 4 lines, fasta sequences can span
+ * several lines.
+ *
+ * Records are parsed in place in the buffer of decoded chunks, or in the mapping of uncompressed
+ * files: the sequence of the current item references the buffer, only the multi-line fasta
+ * sequences are copied. The buffer and the mapping are shared (see getItemOwner()), a buffer still
+ * referenced is not modified, the next chunk is decoded in a new one.
+ * Line and record boundaries are found with memchr, which is vectorized by the C library.
+ * The comments of the reads are not kept.
+ */
+class SimkaFastxIterator : public Iterator<Sequence>
+{
+public:
+
+	SimkaFastxIterator(const string& filename, size_t nbThreads) :
+		_filename(filename), _nbThreads(nbThreads), _isMapped(false), _data(0), _size(0), _pos(0), _isEof(false), _isItemCopied(false), _index(0), _isDone(true)
+	{
+	}
+
+	void first(){
+		_source.reset(SimkaInputSource::create(_filename, _nbThreads));
+		_buffer.reset();
+		_data = 0;
+		_size = 0;
+		_pos = 0;
+		_isMapped = _source->getMappedData(_data, _size);
+		_isEof = _isMapped;
+		_index = 0;
+
+		next();
+	}
+
+	void next(){
+		_isDone = !readRecord();
+		if(_isDone) _source.reset();
+	}
+
+	bool isDone(){
+		return _isDone;
+	}
+
+	Sequence& item(){
+		return *(this->_item);
+	}
+
+	/*
+	 * Owner of the memory referenced by the current item: the item sequence stays valid after next()
+	 * as long as the owner is kept. Null if the sequence is valid until next() only.
+	 */
+	std::shared_ptr<const void> getItemOwner(){
+		if(_isItemCopied) return std::shared_ptr<const void>();
+		if(_isMapped) return _source;
+		return _buffer;
+	}
+
+private:
+
+	enum ParseResult { RECORD, NEED_DATA, END };
+
+	bool readRecord(){
+
+		while(true){
+			ParseResult result = parseRecord();
+			if(result != NEED_DATA) return result == RECORD;
+
+			if(!fill()) _isEof = true;
+		}
+	}
+
+	/*
+	 * Parses the record starting at _pos. Returns NEED_DATA if the record is not complete in the
+	 * buffer, the record is then parsed again once the next chunk is appended.
+	 */
+	ParseResult parseRecord(){
+
+		const char* begin = _data + _pos;
+		const char* end = _data + _size;
+
+		while(begin < end && (*begin == '\n' || *begin == '\r')) begin += 1;
+		if(begin == end){
+			_pos = _size;
+			return _isEof ? END : NEED_DATA;
+		}
+
+		const char* sequence;
+		size_t sequenceSize;
+		const char* recordEnd;
+		bool isCopied = false;
+
+		if(*begin == '@'){
+
+			const char* lineEnds[4];
+			const char* line = begin;
+
+			for(size_t i=0; i<4; i++){
+				const char* lineEnd = (line < end) ? (const char*) memchr(line, '\n', end - line) : 0;
+				if(lineEnd == 0){
+					if(!_isEof) return NEED_DATA;
+					if(line >= end && i < 3) throw Exception ("truncated fastq record in input file %s", _filename.c_str());
+					lineEnd = end;
+				}
+				lineEnds[i] = lineEnd;
+				line = lineEnd + 1;
+			}
+
+			sequence = lineEnds[0] + 1;
+			sequenceSize = trimLine(sequence, lineEnds[1]);
+			recordEnd = min(lineEnds[3] + 1, end);
+		}
+		else if(*begin == '>'){
+
+			const char* headerEnd = (const char*) memchr(begin, '\n', end - begin);
+			if(headerEnd == 0){
+				if(!_isEof) return NEED_DATA;
+				headerEnd = end;
+			}
+
+			sequence = min(headerEnd + 1, end);
+			recordEnd = 0;
+
+			//Next header: a '>' at the beginning of a line
+			for(const char* p = sequence; p < end; ){
+				const char* next = (const char*) memchr(p, '>', end - p);
+				if(next == 0) break;
+				if(next[-1] == '\n'){
+					recordEnd = next;
+					break;
+				}
+				p = next + 1;
+			}
+
+			if(recordEnd == 0){
+				if(!_isEof) return NEED_DATA;
+				recordEnd = end;
+			}
+
+			sequenceSize = trimLine(sequence, recordEnd);
+			if(sequenceSize > 0 && memchr(sequence, '\n', sequenceSize) != 0){
+				_sequence.clear();
+				for(const char* p = sequence; p < recordEnd; ){
+					const char* lineEnd = (const char*) memchr(p, '\n', recordEnd - p);
+					if(lineEnd == 0) lineEnd = recordEnd;
+					_sequence.append(p, trimLine(p, lineEnd));
+					p = lineEnd + 1;
+				}
+				sequence = _sequence.c_str();
+				sequenceSize = _sequence.size();
+				isCopied = true;
+			}
+		}
+		else{
+			throw Exception ("input file %s is not a fasta or fastq file", _filename.c_str());
+		}
+
+		Data& data = this->_item->getData();
+		data.setRef((char*) sequence, sequenceSize);
+		data.setEncoding(Data::ASCII);
+		this->_item->setIndex(_index++);
+		_isItemCopied = isCopied;
+
+		_pos = recordEnd - _data;
+		return RECORD;
+	}
+
+	//Size of the line [start, end) without its trailing new line and carriage return characters
+	static size_t trimLine(const char* start, const char* end){
+		while(end > start && (end[-1] == '\n' || end[-1] == '\r')) end -= 1;
+		return end - start;
+	}
+
+	bool fill(){
+
+		//The items of a buffer still referenced must stay valid: the unparsed end goes to a new buffer
+		if(_buffer && _buffer.use_count() == 1){
+			_buffer->erase(_buffer->begin(), _buffer->begin() + _pos);
+		}
+		else{
+			std::shared_ptr<vector<char> > buffer = std::make_shared<vector<char> >();
+			if(_buffer) buffer->assign(_buffer->begin() + _pos, _buffer->end());
+			_buffer = buffer;
+		}
+		_pos = 0;
+
+		bool hasChunk = _source->read(_chunk);
+		if(hasChunk){
+			if(_buffer->empty()) _buffer->swap(_chunk);
+			else _buffer->insert(_buffer->end(), _chunk.begin(), _chunk.end());
+		}
+
+		_data = _buffer->size() > 0 ? &(*_buffer)[0] : 0;
+		_size = _buffer->size();
+		return hasChunk;
+	}
+
+	string _filename;
+	size_t _nbThreads;
+	std::shared_ptr<SimkaInputSource> _source;
+	bool _isMapped;
+
+	vector<char> _chunk;
+	std::shared_ptr<vector<char> > _buffer;
+	const char* _data;
+	size_t _size;
+	size_t _pos;
+	bool _isEof;
+
+	string _sequence;
+	bool _isItemCopied;
+
+	u_int64_t _index;
+	bool _isDone;
+};
+
+
+/*
+ * Dataset read with SimkaFastxIterator. The dataset file lists the input files, one per line,
+ * as for gatb banks (see SimkaAlgorithm::layoutInputFilename). The gatb bank is kept for the
+ * estimations of the number of reads.
+ *
+ * A dataset with a pipe in its input files can be read only once: it is not opened by gatb (which
+ * reads the beginning of the files to detect their format and to estimate their size) and its
+ * estimations are nominal values. The counting spills its reads if it needs several passes (see
+ * SimkaReadCacheBank).
+ */
+#define SIMKA_STREAM_ESTIMATED_NB_READS 1000000
+#define SIMKA_STREAM_ESTIMATED_READ_SIZE 150
+
+class SimkaBankFastx : public BankDelegate
+{
+public:
+
+	SimkaBankFastx(const string& datasetFilename, size_t nbThreads) :
+		BankDelegate(isStream(datasetFilename) ? (IBank*) new BankStrings(vector<string>()) : Bank::open(datasetFilename)),
+		_nbThreads(nbThreads), _filenames(getFilenames(datasetFilename)), _isStream(isStream(datasetFilename))
+	{
+	}
+
+	Iterator<Sequence>* iterator(){
+		vector<Iterator<Sequence>*> iterators;
+		for(size_t i=0; i<_filenames.size(); i++){
+			iterators.push_back(new SimkaFastxIterator(_filenames[i], _nbThreads));
+		}
+		return new CompositeIterator<Sequence>(iterators);
+	}
+
+	int64_t estimateNbItems(){
+		if(!_isStream) return _ref->estimateNbItems();
+		return SIMKA_STREAM_ESTIMATED_NB_READS * _filenames.size();
+	}
+
+	void estimate(u_int64_t& number, u_int64_t& totalSize, u_int64_t& maxSize){
+		if(!_isStream){
+			_ref->estimate(number, totalSize, maxSize);
+			return;
+		}
+
+		number = SIMKA_STREAM_ESTIMATED_NB_READS * _filenames.size();
+		totalSize = number * SIMKA_STREAM_ESTIMATED_READ_SIZE;
+		maxSize = SIMKA_STREAM_ESTIMATED_READ_SIZE;
+	}
+
+	static vector<string> getFilenames(const string& datasetFilename){
+
+		vector<string> filenames;
+		ifstream datasetFile(datasetFilename.c_str());
+		string filename;
+
+		while(getline(datasetFile, filename)){
+			if(filename == "") continue;
+
+			//Relative to the dataset file, as in gatb albums
+			if(!System::file().doesExist(filename)){
+				filename = System::file().getDirectory(datasetFilename) + "/" + filename;
+			}
+
+			filenames.push_back(filename);
+		}
+
+		return filenames;
+	}
+
+	/*
+	 * True if filename is the standard input. The counting jobs are started in the background by a shell,
+	 * their standard input is /dev/null and not the standard input of simka.
+	 */
+	static bool isStandardInput(const string& filename){
+		return filename == "/dev/stdin" || filename == "/dev/fd/0" || filename == "/proc/self/fd/0" || filename == "-" || (filename.size() >= 2 && filename.compare(filename.size()-2, 2, "/-") == 0);
+	}
+
+	//True if one of the input files of the dataset is a pipe
+	static bool isStream(const string& datasetFilename){
+		vector<string> filenames = getFilenames(datasetFilename);
+		for(size_t i=0; i<filenames.size(); i++){
+			if(SimkaInputFile::isStream(filenames[i])) return true;
+		}
+		return false;
+	}
+
+private:
+
+	size_t _nbThreads;
+	vector<string> _filenames;
+	bool _isStream;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_SIMKAINPUTREADER_HPP_ */
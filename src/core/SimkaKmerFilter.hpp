@@ -0,0 +1,282 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_SIMKAKMERFILTER_HPP_
+#define TOOLS_SIMKA_SRC_SIMKAKMERFILTER_HPP_
+
+#include <gatb/gatb_core.hpp>
+
+#define SIMKA_SCALED_HASH_SEED 0x5bd1e9955bd1e995ULL
+
+/*
+ * Filters applied on the solid kmers of a dataset during the counting, before they are written
+ * to the partition files: kmer Shannon index and scaled subsampling.
+ */
+template<size_t span>
+class SimkaKmerFilter
+{
+public:
+
+	typedef typename Kmer<span>::Type Type;
+
+	SimkaKmerFilter(size_t kmerSize, double minShannonIndex, u_int64_t scaled)
+	{
+		_kmerSize = kmerSize;
+		_minShannonIndex = minShannonIndex;
+
+		// Scaled subsampling: a kmer is kept if its hash is below 2^64/scaled. The hash depends on the
+		// kmer only, so that the same subset of kmers is kept in all the datasets.
+		_maxHash = (scaled > 1) ? ((u_int64_t) -1) / scaled : 0;
+
+		// Nucleotide i of a kmer is stored in bits 2i and 2i+1, so one byte holds 4 nucleotides.
+		// _byteCounts[b] gives the number of A, C, T and G of the byte b, one per 16 bits lane.
+		for(size_t b=0; b<256; b++){
+			u_int64_t counts = 0;
+			for(size_t i=0; i<4; i++){
+				u_int64_t nt = (b >> (2*i)) & 3;
+				counts += ((u_int64_t)1) << (16*nt);
+			}
+			_byteCounts[b] = counts;
+		}
+
+		// Bits above 2k are zero, the last byte is padded with A
+		_nbBytes = (_kmerSize+3) / 4;
+		_nbPaddingA = _nbBytes*4 - _kmerSize;
+
+		_entropyTerms.resize(_kmerSize+1, 0);
+		for(size_t c=1; c<=_kmerSize; c++){
+			double freq = (double) c / (double) _kmerSize;
+			_entropyTerms[c] = - freq * log(freq) / log(2);
+		}
+	}
+
+	bool operator() (const Type& kmer) const {
+		return isHashValid(kmer) && isShannonIndexValid(kmer);
+	}
+
+	bool isHashValid(const Type& kmer) const {
+		if(_maxHash == 0) return true;
+		return hash1(kmer, SIMKA_SCALED_HASH_SEED) < _maxHash;
+	}
+
+	bool isShannonIndexValid(const Type& kmer) const {
+		if(_minShannonIndex == 0) return true;
+		return getShannonIndex(kmer) >= _minShannonIndex;
+	}
+
+	double getShannonIndex(const Type& kmer) const {
+
+		u_int64_t counts = 0;
+		Type value = kmer;
+
+		for(size_t i=0; i<_nbBytes; i++){
+			counts += _byteCounts[value.getVal() & 0xFF];
+			value = value >> 8;
+		}
+
+		counts -= _nbPaddingA;
+
+		double index = 0;
+		for(size_t nt=0; nt<4; nt++){
+			index += _entropyTerms[(counts >> (16*nt)) & 0xFFFF];
+		}
+
+		return index;
+	}
+
+private:
+
+	size_t _kmerSize;
+	double _minShannonIndex;
+	u_int64_t _maxHash;
+
+	u_int64_t _byteCounts[256];
+	size_t _nbBytes;
+	u_int64_t _nbPaddingA;
+	vector<double> _entropyTerms;
+};
+
+
+/*
+ * Iterator forwarding only the kmers seen at least twice (erroneous singletons are discarded before
+ * the counting). The first occurrence of a kmer is stored in a Bloom filter, the following ones are
+ * forwarded: the counts of the forwarded kmers are thus one less than their real abundance and must
+ * be corrected by +1 (see SimkaCompressedProcessor).
+ *
+ * Each read is cut into fragments covering the runs of consecutive forwarded kmers.
+ * The Bloom filter is created with the iterator, so that the several passes of the counting see the
+ * same fragments.
+ */
+template<size_t span>
+class SimkaSingletonFilterIterator : public Iterator<Sequence>
+{
+public:
+
+	typedef typename Kmer<span>::Type Type;
+	typedef typename Kmer<span>::ModelCanonical ModelCanonical;
+	typedef typename ModelCanonical::Kmer KmerType;
+
+	SimkaSingletonFilterIterator(Iterator<Sequence>* ref, size_t kmerSize, u_int64_t bloomBits, u_int64_t& nbReads) :
+		_ref(0), _model(kmerSize), _kmerSize(kmerSize), _bloomBits(bloomBits), _bloom(0), _nbReads(nbReads), _kmerIndex(0), _isDone(true)
+	{
+		setRef(ref);
+	}
+
+	~SimkaSingletonFilterIterator(){
+		delete _bloom;
+		setRef(0);
+	}
+
+	//Each iteration starts with an empty Bloom filter, otherwise every kmer would be seen already
+	void first(){
+		delete _bloom;
+		_bloom = new BloomCacheCoherent<Type>(_bloomBits, 7);
+
+		_nbReads = 0;
+		_kmers.clear();
+		_kmerIndex = 0;
+
+		_ref->first();
+		if(!_ref->isDone()) loadRead();
+
+		nextFragment();
+	}
+
+	void next(){
+		nextFragment();
+	}
+
+	bool isDone(){
+		return _isDone;
+	}
+
+	Sequence& item(){
+		return *(this->_item);
+	}
+
+private:
+
+	void loadRead(){
+		_nbReads += 1;
+		_model.build(_ref->item().getData(), _kmers);
+		_kmerIndex = 0;
+	}
+
+	void nextFragment(){
+
+		while(!_ref->isDone()){
+
+			size_t start = _kmers.size();
+			size_t end = _kmers.size();
+
+			while(_kmerIndex < _kmers.size()){
+				bool isSeen = isKmerSeen(_kmers[_kmerIndex]);
+				_kmerIndex += 1;
+
+				if(isSeen){
+					if(start == _kmers.size()) start = _kmerIndex-1;
+					end = _kmerIndex-1;
+				}
+				else if(start != _kmers.size()){
+					break;
+				}
+			}
+
+			if(start != _kmers.size()){
+				setFragment(start, end - start + _kmerSize);
+				_isDone = false;
+				return;
+			}
+
+			_ref->next();
+			if(!_ref->isDone()) loadRead();
+		}
+
+		_isDone = true;
+	}
+
+	bool isKmerSeen(const KmerType& kmer){
+		if(!kmer.isValid()) return false;
+
+		Type value = kmer.value();
+		if(_bloom->contains(value)) return true;
+
+		_bloom->insert(value);
+		return false;
+	}
+
+	void setFragment(size_t start, size_t length){
+		Data& read = _ref->item().getData();
+		Data& fragment = this->_item->getData();
+
+		fragment.resize(length);
+		memcpy(fragment.getBuffer(), read.getBuffer() + start, length);
+		fragment.setEncoding(read.getEncoding());
+	}
+
+	Iterator<Sequence>* _ref;
+	void setRef (Iterator<Sequence>* ref)  { SP_SETATTR(ref); }
+
+	ModelCanonical _model;
+	size_t _kmerSize;
+	u_int64_t _bloomBits;
+	BloomCacheCoherent<Type>* _bloom;
+	u_int64_t& _nbReads;
+
+	vector<KmerType> _kmers;
+	size_t _kmerIndex;
+	bool _isDone;
+};
+
+
+/*
+ * Bank of the reads of a dataset without their singleton kmers. The number of reads read by the
+ * last iteration is given by getNbReads(), the number of sequences seen by the counter being the
+ * number of fragments.
+ */
+template<size_t span>
+class SimkaSingletonFilterBank : public BankDelegate
+{
+public:
+
+	SimkaSingletonFilterBank(IBank* ref, size_t kmerSize, u_int64_t bloomBits) : BankDelegate(ref)
+	{
+		_kmerSize = kmerSize;
+		_bloomBits = bloomBits;
+		_nbReads = 0;
+	}
+
+	Iterator<Sequence>* iterator(){
+		return new SimkaSingletonFilterIterator<span>(_ref->iterator(), _kmerSize, _bloomBits, _nbReads);
+	}
+
+	u_int64_t getNbReads(){
+		return _nbReads;
+	}
+
+private:
+
+	size_t _kmerSize;
+	u_int64_t _bloomBits;
+	u_int64_t _nbReads;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_SIMKAKMERFILTER_HPP_ */
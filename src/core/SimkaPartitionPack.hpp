@@ -0,0 +1,722 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_SIMKAPARTITIONPACK_HPP_
+#define TOOLS_SIMKA_SRC_SIMKAPARTITIONPACK_HPP_
+
+#include <gatb/gatb_core.hpp>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/*
+ * Packed partition file: all the partitions written by one count job are stored in a single file.
+ *
+ * Layout:
+ * 		chunk 0 | chunk 1 | ... | chunk n-1 | index (n * SimkaPackChunk) | first items (n * Item) | SimkaPackTrailer
+ *
+ * Each chunk is an independently compressed block of items belonging to one partition. Chunks of
+ * different partitions are interleaved in the order they were compressed by the writer threads.
+ * The index gives, for each chunk, its partition, its offset and its size, so that a merge job
+ * only reads the byte ranges of its own partition. The chunks of a partition are listed in the order
+ * they were flushed, which is the order of their items. The first item of each chunk follows the index,
+ * in the same order: as the items of a partition are sorted, a merge job can start reading a
+ * partition at the chunk holding a given kmer (see SimkaMergeAlgorithm::mergeRanges).
+ */
+
+#define SIMKA_PACK_MAGIC 0x324b4341504b4d53ULL //"SMKPACK2"
+//Changed with the layout, the packs of an other version are not reused from the count cache
+#define SIMKA_PACK_VERSION 2
+
+struct SimkaPackChunk{
+	u_int32_t _partitionId;
+	u_int32_t _nbItems;
+	u_int64_t _offset;
+	u_int64_t _size;
+};
+
+struct SimkaPackTrailer{
+	u_int64_t _nbChunks;
+	u_int64_t _indexOffset;
+	u_int64_t _nbPartitions;
+	u_int64_t _itemSize;
+	u_int64_t _firstItemsOffset;
+	u_int64_t _magic;
+};
+
+class SimkaPartitionPack{
+public:
+
+	static void writeAt(int fd, const void* buffer, u_int64_t size, u_int64_t offset, const string& filename){
+		const char* ptr = (const char*) buffer;
+		while(size > 0){
+			ssize_t nbWritten = pwrite(fd, ptr, size, offset);
+			if(nbWritten <= 0) throw Exception ("unable to write packed partition file %s", filename.c_str());
+			ptr += nbWritten;
+			offset += nbWritten;
+			size -= nbWritten;
+		}
+	}
+
+	static void readAt(int fd, void* buffer, u_int64_t size, u_int64_t offset, const string& filename){
+		char* ptr = (char*) buffer;
+		while(size > 0){
+			ssize_t nbRead = pread(fd, ptr, size, offset);
+			if(nbRead <= 0) throw Exception ("unable to read packed partition file %s", filename.c_str());
+			ptr += nbRead;
+			offset += nbRead;
+			size -= nbRead;
+		}
+	}
+
+	//Reads and uncompresses a chunk, buffer holds its compressed bytes
+	template<typename Item>
+	static void readChunk(int fd, const SimkaPackChunk& chunk, vector<Bytef>& buffer, vector<Item>& items, const string& filename){
+
+		buffer.resize(chunk._size);
+		readAt(fd, &buffer[0], chunk._size, chunk._offset, filename);
+
+		items.resize(chunk._nbItems);
+		uLongf rawSize = chunk._nbItems * sizeof(Item);
+		if(uncompress((Bytef*) &items[0], &rawSize, &buffer[0], chunk._size) != Z_OK || rawSize != chunk._nbItems * sizeof(Item)){
+			throw Exception ("corrupted chunk in packed partition file %s", filename.c_str());
+		}
+	}
+
+	//Hints the kernel that a byte range of the file will be read soon
+	static void willRead(int fd, u_int64_t offset, u_int64_t size){
+#ifdef POSIX_FADV_WILLNEED
+		posix_fadvise(fd, offset, size, POSIX_FADV_WILLNEED);
+#endif
+	}
+};
+
+
+/*
+ * Writer shared by all the partitions of a count job.
+ * write() is thread safe: it only queues the raw items, they are compressed and written by the writer
+ * threads, so that the counting threads do not wait for zlib nor for the disk. The offset of a chunk is
+ * reserved by the writer thread once it is compressed, chunks are numbered when they are queued to
+ * keep the order of the chunks of a partition in the index.
+ * At most maxPendingChunks chunks are queued, write() blocks when the queue is full.
+ */
+#define SIMKA_PACK_WRITER_THREADS 2
+#define SIMKA_PACK_MAX_PENDING_CHUNKS 64
+
+template<typename Item>
+class SimkaPartitionPackWriter
+{
+public:
+
+	SimkaPartitionPackWriter(const string& filename, size_t nbPartitions, size_t nbWriterThreads=SIMKA_PACK_WRITER_THREADS, size_t maxPendingChunks=SIMKA_PACK_MAX_PENDING_CHUNKS) :
+		_filename(filename), _nbPartitions(nbPartitions), _position(0), _nbQueuedChunks(0), _maxPendingChunks(max(maxPendingChunks, (size_t)1)), _isClosing(false), _hasError(false)
+	{
+		_fd = open(_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(_fd < 0) throw Exception ("unable to create packed partition file %s", _filename.c_str());
+
+		for(size_t i=0; i<max(nbWriterThreads, (size_t)1); i++){
+			_threads.push_back(std::thread(&SimkaPartitionPackWriter::writeChunks, this));
+		}
+	}
+
+	~SimkaPartitionPackWriter(){
+		if(_fd >= 0){
+			stopThreads();
+			::close(_fd);
+		}
+	}
+
+	//Queues the items of a chunk, items is left empty
+	void write(size_t partitionId, vector<Item>& items){
+
+		if(items.size() == 0) return;
+
+		PendingChunk pendingChunk;
+		pendingChunk._items.swap(items);
+
+		std::unique_lock<std::mutex> lock(_mutex);
+		_queueNotFull.wait(lock, [this]{ return _pendingChunks.size() < _maxPendingChunks || _hasError; });
+		if(_hasError) throw Exception ("unable to write packed partition file %s", _filename.c_str());
+
+		pendingChunk._partitionId = partitionId;
+		pendingChunk._sequence = _nbQueuedChunks;
+		_nbQueuedChunks += 1;
+
+		_pendingChunks.push_back(std::move(pendingChunk));
+		_queueNotEmpty.notify_one();
+	}
+
+	void close(){
+
+		stopThreads();
+		if(_hasError){
+			::close(_fd);
+			_fd = -1;
+			throw Exception ("unable to write packed partition file %s", _filename.c_str());
+		}
+
+		//Chunks are sorted by partition, in the order they were queued
+		vector<size_t> order(_chunks.size());
+		for(size_t i=0; i<order.size(); i++) order[i] = i;
+		std::sort(order.begin(), order.end(), [this](size_t l, size_t r){
+			if(_chunks[l]._partitionId != _chunks[r]._partitionId) return _chunks[l]._partitionId < _chunks[r]._partitionId;
+			return _sequences[l] < _sequences[r];
+		});
+
+		vector<SimkaPackChunk> chunks(_chunks.size());
+		vector<Item> firstItems(_chunks.size());
+		for(size_t i=0; i<order.size(); i++){
+			chunks[i] = _chunks[order[i]];
+			firstItems[i] = _firstItems[order[i]];
+		}
+
+		u_int64_t indexSize = chunks.size() * sizeof(SimkaPackChunk);
+		u_int64_t firstItemsSize = firstItems.size() * sizeof(Item);
+
+		SimkaPackTrailer trailer;
+		trailer._nbChunks = chunks.size();
+		trailer._indexOffset = _position;
+		trailer._nbPartitions = _nbPartitions;
+		trailer._itemSize = sizeof(Item);
+		trailer._firstItemsOffset = _position + indexSize;
+		trailer._magic = SIMKA_PACK_MAGIC;
+
+		if(indexSize > 0) SimkaPartitionPack::writeAt(_fd, &chunks[0], indexSize, trailer._indexOffset, _filename);
+		if(firstItemsSize > 0) SimkaPartitionPack::writeAt(_fd, &firstItems[0], firstItemsSize, trailer._firstItemsOffset, _filename);
+		SimkaPartitionPack::writeAt(_fd, &trailer, sizeof(trailer), trailer._firstItemsOffset + firstItemsSize, _filename);
+
+		::close(_fd);
+		_fd = -1;
+	}
+
+private:
+
+	struct PendingChunk{
+		size_t _partitionId;
+		u_int64_t _sequence;
+		vector<Item> _items;
+	};
+
+	//Chunks are written at the offset reserved after their compression, the writer threads can write them in any order
+	void writeChunks(){
+
+		vector<Bytef> buffer;
+
+		while(true){
+
+			PendingChunk pendingChunk;
+
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_queueNotEmpty.wait(lock, [this]{ return !_pendingChunks.empty() || _isClosing; });
+				if(_pendingChunks.empty()) return;
+
+				pendingChunk = std::move(_pendingChunks.front());
+				_pendingChunks.pop_front();
+				_queueNotFull.notify_one();
+			}
+
+			uLong rawSize = pendingChunk._items.size() * sizeof(Item);
+			uLongf size = compressBound(rawSize);
+			buffer.resize(size);
+			bool isCompressed = compress2(&buffer[0], &size, (const Bytef*) &pendingChunk._items[0], rawSize, 1) == Z_OK;
+
+			SimkaPackChunk chunk;
+			chunk._partitionId = pendingChunk._partitionId;
+			chunk._nbItems = pendingChunk._items.size();
+			chunk._size = size;
+
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				if(!isCompressed){
+					_hasError = true;
+					_queueNotFull.notify_all();
+					continue;
+				}
+
+				chunk._offset = _position;
+				_position += size;
+				_chunks.push_back(chunk);
+				_sequences.push_back(pendingChunk._sequence);
+				_firstItems.push_back(pendingChunk._items[0]);
+			}
+
+			try{
+				SimkaPartitionPack::writeAt(_fd, &buffer[0], chunk._size, chunk._offset, _filename);
+			}
+			catch(Exception& e){
+				std::lock_guard<std::mutex> lock(_mutex);
+				_hasError = true;
+				_queueNotFull.notify_all();
+			}
+		}
+	}
+
+	void stopThreads(){
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_isClosing = true;
+		}
+		_queueNotEmpty.notify_all();
+
+		for(size_t i=0; i<_threads.size(); i++) _threads[i].join();
+		_threads.clear();
+	}
+
+	string _filename;
+	size_t _nbPartitions;
+	int _fd;
+	u_int64_t _position;
+	vector<SimkaPackChunk> _chunks;
+	vector<u_int64_t> _sequences;
+	vector<Item> _firstItems;
+
+	u_int64_t _nbQueuedChunks;
+	size_t _maxPendingChunks;
+	std::deque<PendingChunk> _pendingChunks;
+	vector<std::thread> _threads;
+	bool _isClosing;
+	bool _hasError;
+	std::mutex _mutex;
+	std::condition_variable _queueNotEmpty;
+	std::condition_variable _queueNotFull;
+};
+
+
+/*
+ * Bag of one partition of a packed file. Items are buffered and compressed as one chunk when the
+ * buffer is full. As for BagCache, a given partition must be filled by one thread at a time.
+ */
+template<typename Item>
+class BagPartitionPack : public Bag<Item>, public SmartPointer
+{
+public:
+
+	BagPartitionPack(SimkaPartitionPackWriter<Item>& writer, size_t partitionId, size_t cacheSize) :
+		_writer(writer), _partitionId(partitionId), _cacheSize(cacheSize)
+	{
+		_items.reserve(_cacheSize);
+	}
+
+	~BagPartitionPack(){
+		flush();
+	}
+
+	void insert (const Item& item){
+		_items.push_back(item);
+		if(_items.size() >= _cacheSize) flush();
+	}
+
+	//The buffer is given to the writer, a new one is allocated
+	void flush (){
+		if(_items.size() == 0) return;
+		_writer.write(_partitionId, _items);
+		_items.reserve(_cacheSize);
+	}
+
+	//Drops the cached items, when the output is abandoned
+	void discard (){
+		_items.clear();
+	}
+
+private:
+
+	SimkaPartitionPackWriter<Item>& _writer;
+	size_t _partitionId;
+	size_t _cacheSize;
+	vector<Item> _items;
+};
+
+
+/*
+ * Chunk of a partition decoded ahead of its iterator by a SimkaPackPrefetcher.
+ */
+template<typename Item>
+struct SimkaPackBlock{
+	int _fd;
+	const string* _filename;
+	SimkaPackChunk _chunk;
+	vector<Bytef> _buffer;
+	vector<Item> _items;
+	u_int64_t _memory;
+	bool _isQueued;
+	bool _isPending;
+	string _error;
+
+	SimkaPackBlock() : _fd(-1), _filename(0), _memory(0), _isQueued(false), _isPending(false) {}
+};
+
+
+/*
+ * Pool of threads decoding the next chunk of the iterators of a merge, so that the merge thread
+ * only waits for the disk and zlib when the pool is behind. A block is decoded in the memory of its
+ * iterator, which swaps it with its current chunk (double buffering). The blocks in flight are bounded
+ * by maxMemory, an iterator whose block does not fit reads its next chunk itself.
+ * Iterators must be deleted before the prefetcher.
+ */
+template<typename Item>
+class SimkaPackPrefetcher
+{
+public:
+
+	typedef SimkaPackBlock<Item> Block;
+
+	SimkaPackPrefetcher(size_t nbThreads, u_int64_t maxMemory) : _maxMemory(maxMemory), _memory(0), _isClosing(false)
+	{
+		for(size_t i=0; i<max(nbThreads, (size_t)1); i++){
+			_threads.push_back(std::thread(&SimkaPackPrefetcher::decodeBlocks, this));
+		}
+	}
+
+	~SimkaPackPrefetcher(){
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_isClosing = true;
+		}
+		_blockQueued.notify_all();
+
+		for(size_t i=0; i<_threads.size(); i++) _threads[i].join();
+	}
+
+	//Queues the decoding of a chunk in block, returns false if the block does not fit in the memory of the prefetcher
+	bool prefetch(Block& block, int fd, const string& filename, const SimkaPackChunk& chunk){
+
+		u_int64_t memory = chunk._size + chunk._nbItems * sizeof(Item);
+
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		if(_memory + memory > _maxMemory){
+			vector<Bytef>().swap(block._buffer);
+			vector<Item>().swap(block._items);
+			return false;
+		}
+
+		_memory += memory;
+		block._fd = fd;
+		block._filename = &filename;
+		block._chunk = chunk;
+		block._memory = memory;
+		block._isQueued = true;
+		block._isPending = true;
+		block._error = "";
+
+		_blocks.push_back(&block);
+		_blockQueued.notify_one();
+		return true;
+	}
+
+	//Waits for a prefetched block, a block still in the queue is decoded by the calling thread
+	void take(Block& block){
+		wait(block, true);
+		if(block._error != "") throw Exception ("%s", block._error.c_str());
+	}
+
+	//Drops a prefetched block, it is not decoded if it is still in the queue
+	void cancel(Block& block){
+		wait(block, false);
+	}
+
+private:
+
+	void wait(Block& block, bool isDecoded){
+
+		std::unique_lock<std::mutex> lock(_mutex);
+
+		if(block._isQueued){
+			_blocks.erase(std::find(_blocks.begin(), _blocks.end(), &block));
+			block._isQueued = false;
+
+			lock.unlock();
+			if(isDecoded) decode(block);
+			lock.lock();
+
+			block._isPending = false;
+		}
+		else{
+			_blockDecoded.wait(lock, [&block]{ return !block._isPending; });
+		}
+
+		_memory -= block._memory;
+		block._memory = 0;
+	}
+
+	void decode(Block& block){
+		try{
+			SimkaPartitionPack::readChunk(block._fd, block._chunk, block._buffer, block._items, *block._filename);
+		}
+		catch(Exception& e){
+			block._error = e.getMessage();
+		}
+	}
+
+	void decodeBlocks(){
+
+		while(true){
+
+			Block* block;
+
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_blockQueued.wait(lock, [this]{ return !_blocks.empty() || _isClosing; });
+				if(_blocks.empty()) return;
+
+				block = _blocks.front();
+				_blocks.pop_front();
+				block->_isQueued = false;
+			}
+
+			decode(*block);
+
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				block->_isPending = false;
+			}
+			_blockDecoded.notify_all();
+		}
+	}
+
+	u_int64_t _maxMemory;
+	u_int64_t _memory;
+	std::deque<Block*> _blocks;
+	vector<std::thread> _threads;
+	bool _isClosing;
+	std::mutex _mutex;
+	std::condition_variable _blockQueued;
+	std::condition_variable _blockDecoded;
+};
+
+
+/*
+ * Iterates the items of one partition of a packed file, chunk after chunk. With a prefetcher, the next
+ * chunk is decoded in the background while the current one is iterated.
+ */
+template<typename Item>
+class IteratorPartitionPack : public Iterator<Item>
+{
+public:
+
+	IteratorPartitionPack(const string& filename, const vector<SimkaPackChunk>& chunks, SimkaPackPrefetcher<Item>* prefetcher=0) :
+		_filename(filename), _chunks(chunks), _fd(-1), _chunkIndex(0), _index(0), _isDone(true), _prefetcher(prefetcher), _prefetchIndex(chunks.size())
+	{
+	}
+
+	~IteratorPartitionPack(){
+		cancelPrefetch();
+		if(_fd >= 0) close(_fd);
+	}
+
+	void first(){
+
+		if(_fd < 0){
+			_fd = open(_filename.c_str(), O_RDONLY);
+			if(_fd < 0) throw Exception ("unable to open packed partition file %s", _filename.c_str());
+
+			//The chunks of a partition are read by (almost always) increasing offset
+#ifdef POSIX_FADV_SEQUENTIAL
+			posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		}
+
+		cancelPrefetch();
+		_chunkIndex = 0;
+		loadChunk();
+	}
+
+	void next(){
+		_index += 1;
+		if(_index < _items.size()) return;
+
+		_chunkIndex += 1;
+		loadChunk();
+	}
+
+	bool isDone(){
+		return _isDone;
+	}
+
+	Item& item(){
+		return _items[_index];
+	}
+
+private:
+
+	//First chunk with items from chunkIndex
+	size_t getNextChunk(size_t chunkIndex){
+		while(chunkIndex < _chunks.size() && _chunks[chunkIndex]._nbItems == 0) chunkIndex += 1;
+		return chunkIndex;
+	}
+
+	void loadChunk(){
+
+		_index = 0;
+		_chunkIndex = getNextChunk(_chunkIndex);
+
+		if(_chunkIndex >= _chunks.size()){
+			_items.clear();
+			_isDone = true;
+			return;
+		}
+
+		if(_prefetchIndex == _chunkIndex){
+			_prefetchIndex = _chunks.size();
+			_prefetcher->take(_block);
+			_items.swap(_block._items);
+		}
+		else{
+			SimkaPartitionPack::readChunk(_fd, _chunks[_chunkIndex], _buffer, _items, _filename);
+		}
+
+		_isDone = false;
+		prefetch(getNextChunk(_chunkIndex+1));
+	}
+
+	//Queues the decoding of a chunk, the kernel is asked to read ahead the first chunk which is not decoded in the background
+	void prefetch(size_t chunkIndex){
+
+		if(chunkIndex >= _chunks.size()) return;
+
+		if(_prefetcher != 0 && _prefetcher->prefetch(_block, _fd, _filename, _chunks[chunkIndex])){
+			_prefetchIndex = chunkIndex;
+			chunkIndex = getNextChunk(chunkIndex+1);
+			if(chunkIndex >= _chunks.size()) return;
+		}
+
+		SimkaPartitionPack::willRead(_fd, _chunks[chunkIndex]._offset, _chunks[chunkIndex]._size);
+	}
+
+	void cancelPrefetch(){
+		if(_prefetchIndex >= _chunks.size()) return;
+		_prefetcher->cancel(_block);
+		_prefetchIndex = _chunks.size();
+	}
+
+	string _filename;
+	vector<SimkaPackChunk> _chunks;
+	int _fd;
+	size_t _chunkIndex;
+	size_t _index;
+	bool _isDone;
+	vector<Bytef> _buffer;
+	vector<Item> _items;
+
+	SimkaPackPrefetcher<Item>* _prefetcher;
+	SimkaPackBlock<Item> _block;
+	size_t _prefetchIndex;
+};
+
+
+/*
+ * Loads the index of a packed file.
+ */
+template<typename Item>
+class SimkaPartitionPackReader
+{
+public:
+
+	SimkaPartitionPackReader(const string& filename) : _filename(filename)
+	{
+		int fd = open(_filename.c_str(), O_RDONLY);
+		if(fd < 0) throw Exception ("unable to open packed partition file %s", _filename.c_str());
+
+		off_t fileSize = lseek(fd, 0, SEEK_END);
+		if(fileSize < (off_t) sizeof(SimkaPackTrailer)){
+			::close(fd);
+			throw Exception ("invalid packed partition file %s", _filename.c_str());
+		}
+
+		SimkaPackTrailer trailer;
+		SimkaPartitionPack::readAt(fd, &trailer, sizeof(trailer), fileSize - sizeof(trailer), _filename);
+
+		if(trailer._magic != SIMKA_PACK_MAGIC || trailer._itemSize != sizeof(Item)){
+			::close(fd);
+			throw Exception ("invalid packed partition file %s", _filename.c_str());
+		}
+
+		vector<SimkaPackChunk> chunks(trailer._nbChunks);
+		vector<Item> firstItems;
+		if(trailer._nbChunks > 0) SimkaPartitionPack::readAt(fd, &chunks[0], trailer._nbChunks * sizeof(SimkaPackChunk), trailer._indexOffset, _filename);
+
+		if(trailer._nbChunks > 0){
+			firstItems.resize(trailer._nbChunks);
+			SimkaPartitionPack::readAt(fd, &firstItems[0], trailer._nbChunks * sizeof(Item), trailer._firstItemsOffset, _filename);
+		}
+		::close(fd);
+
+		_partitions.resize(trailer._nbPartitions);
+		_firstItems.resize(trailer._nbPartitions);
+		for(size_t i=0; i<chunks.size(); i++){
+			size_t partitionId = chunks[i]._partitionId;
+			if(partitionId >= _partitions.size()){
+				_partitions.resize(partitionId+1);
+				_firstItems.resize(partitionId+1);
+			}
+			_partitions[partitionId].push_back(chunks[i]);
+			_firstItems[partitionId].push_back(firstItems[i]);
+		}
+	}
+
+	size_t getNbPartitions(){
+		return _partitions.size();
+	}
+
+	const vector<SimkaPackChunk>& getChunks(size_t partitionId){
+		return _partitions[partitionId];
+	}
+
+	//First item of each chunk of a partition, in the order of getChunks()
+	const vector<Item>& getFirstItems(size_t partitionId){
+		return _firstItems[partitionId];
+	}
+
+	u_int64_t getPartitionSize(size_t partitionId){
+		if(partitionId >= _partitions.size()) return 0;
+		u_int64_t size = 0;
+		for(size_t i=0; i<_partitions[partitionId].size(); i++) size += _partitions[partitionId][i]._size;
+		return size;
+	}
+
+	u_int64_t getPartitionNbItems(size_t partitionId){
+		if(partitionId >= _partitions.size()) return 0;
+		u_int64_t nbItems = 0;
+		for(size_t i=0; i<_partitions[partitionId].size(); i++) nbItems += _partitions[partitionId][i]._nbItems;
+		return nbItems;
+	}
+
+	//Iterates the items of a partition from its chunk firstChunk, the chunks are decoded ahead by the prefetcher if any
+	Iterator<Item>* iterator(size_t partitionId, size_t firstChunk=0, SimkaPackPrefetcher<Item>* prefetcher=0){
+		if(partitionId >= _partitions.size() || firstChunk >= _partitions[partitionId].size()) return new IteratorPartitionPack<Item>(_filename, vector<SimkaPackChunk>());
+		vector<SimkaPackChunk> chunks(_partitions[partitionId].begin() + firstChunk, _partitions[partitionId].end());
+		return new IteratorPartitionPack<Item>(_filename, chunks, prefetcher);
+	}
+
+private:
+
+	string _filename;
+	vector<vector<SimkaPackChunk> > _partitions;
+	vector<vector<Item> > _firstItems;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_SIMKAPARTITIONPACK_HPP_ */
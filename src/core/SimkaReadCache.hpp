@@ -0,0 +1,293 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_SIMKAREADCACHE_HPP_
+#define TOOLS_SIMKA_SRC_SIMKAREADCACHE_HPP_
+
+#include <gatb/gatb_core.hpp>
+#include <stdio.h>
+
+/*
+ * Spill file of the reads of a dataset, used when the counting makes several passes over the input
+ * and to share the reads between the runs of several kmer sizes (see SimkaPotara::execute).
+ * The first pass reads the input files and writes the reads (already filtered and truncated) in the
+ * spill file, the following passes read the spill file instead of parsing the input files again.
+ *
+ * Record of a read:
+ * 		u_int32_t length | u_int32_t nbRuns | nbRuns * (u_int32_t start, u_int32_t length) | (length+3)/4 bytes
+ *
+ * Nucleotides are packed 4 per byte (A=0, C=1, G=2, T=3), the runs give the positions of the other
+ * characters, which are read back as N.
+ */
+#define SIMKA_READ_CACHE_BUFFER_SIZE (4*MBYTE)
+
+class SimkaReadCache
+{
+public:
+
+	static u_int8_t encode(char c){
+		switch(c){
+			case 'A': case 'a': return 0;
+			case 'C': case 'c': return 1;
+			case 'G': case 'g': return 2;
+			case 'T': case 't': return 3;
+			default: return 4;
+		}
+	}
+
+	static FILE* open(const string& filename, const char* mode, vector<char>& buffer){
+		FILE* file = fopen(filename.c_str(), mode);
+		if(file == 0) throw Exception ("unable to open read cache file %s", filename.c_str());
+		buffer.resize(SIMKA_READ_CACHE_BUFFER_SIZE);
+		setvbuf(file, &buffer[0], _IOFBF, buffer.size());
+		return file;
+	}
+};
+
+
+/*
+ * Forwards the reads of the input iterator and writes them to the spill file.
+ * The spill file is marked as complete only if the iteration reaches the last read.
+ */
+class SimkaReadCacheWriteIterator : public Iterator<Sequence>
+{
+public:
+
+	SimkaReadCacheWriteIterator(Iterator<Sequence>* ref, const string& filename, bool& isComplete) :
+		_ref(0), _filename(filename), _file(0), _isComplete(isComplete)
+	{
+		setRef(ref);
+	}
+
+	~SimkaReadCacheWriteIterator(){
+		if(_file != 0){
+			fclose(_file);
+			System::file().remove(_filename);
+		}
+		setRef(0);
+	}
+
+	void first(){
+		if(_file != 0) fclose(_file);
+		_file = SimkaReadCache::open(_filename, "wb", _fileBuffer);
+
+		_ref->first();
+		update();
+	}
+
+	void next(){
+		_ref->next();
+		update();
+	}
+
+	bool isDone(){
+		return _ref->isDone();
+	}
+
+	Sequence& item(){
+		return *(this->_item);
+	}
+
+private:
+
+	void update(){
+
+		if(_ref->isDone()){
+			if(fclose(_file) != 0) throw Exception ("unable to write read cache file %s", _filename.c_str());
+			_file = 0;
+			_isComplete = true;
+			return;
+		}
+
+		*(this->_item) = _ref->item();
+		write(_ref->item().getData());
+	}
+
+	void write(Data& data){
+
+		u_int32_t length = data.size();
+		const char* buffer = data.getBuffer();
+
+		_runs.clear();
+		_packed.assign((length+3)/4, 0);
+
+		for(u_int32_t i=0; i<length; i++){
+			u_int8_t nt = SimkaReadCache::encode(buffer[i]);
+
+			if(nt == 4){
+				if(_runs.size() > 0 && _runs[_runs.size()-2] + _runs[_runs.size()-1] == i) _runs[_runs.size()-1] += 1;
+				else { _runs.push_back(i); _runs.push_back(1); }
+				continue;
+			}
+
+			_packed[i/4] |= nt << (2*(i%4));
+		}
+
+		u_int32_t nbRuns = _runs.size() / 2;
+		bool isWritten = fwrite(&length, sizeof(length), 1, _file) == 1 && fwrite(&nbRuns, sizeof(nbRuns), 1, _file) == 1;
+		if(nbRuns > 0) isWritten = isWritten && fwrite(&_runs[0], sizeof(u_int32_t), _runs.size(), _file) == _runs.size();
+		if(length > 0) isWritten = isWritten && fwrite(&_packed[0], 1, _packed.size(), _file) == _packed.size();
+
+		if(!isWritten) throw Exception ("unable to write read cache file %s", _filename.c_str());
+	}
+
+	Iterator<Sequence>* _ref;
+	void setRef (Iterator<Sequence>* ref)  { SP_SETATTR(ref); }
+
+	string _filename;
+	FILE* _file;
+	vector<char> _fileBuffer;
+	bool& _isComplete;
+
+	vector<u_int32_t> _runs;
+	vector<u_int8_t> _packed;
+};
+
+
+/*
+ * Iterates the reads of a complete spill file.
+ */
+class SimkaReadCacheReadIterator : public Iterator<Sequence>
+{
+public:
+
+	SimkaReadCacheReadIterator(const string& filename) : _filename(filename), _file(0), _isDone(true)
+	{
+		for(size_t b=0; b<256; b++){
+			for(size_t i=0; i<4; i++){
+				_decoded[b][i] = "ACGT"[(b >> (2*i)) & 3];
+			}
+		}
+	}
+
+	~SimkaReadCacheReadIterator(){
+		if(_file != 0) fclose(_file);
+	}
+
+	void first(){
+		if(_file != 0) fclose(_file);
+		_file = SimkaReadCache::open(_filename, "rb", _fileBuffer);
+
+		read();
+	}
+
+	void next(){
+		read();
+	}
+
+	bool isDone(){
+		return _isDone;
+	}
+
+	Sequence& item(){
+		return *(this->_item);
+	}
+
+private:
+
+	void read(){
+
+		u_int32_t length;
+		u_int32_t nbRuns;
+
+		if(fread(&length, sizeof(length), 1, _file) != 1){
+			_isDone = true;
+			return;
+		}
+		if(fread(&nbRuns, sizeof(nbRuns), 1, _file) != 1) throw Exception ("corrupted read cache file %s", _filename.c_str());
+
+		_runs.resize(nbRuns*2);
+		_packed.resize((length+3)/4);
+		if(nbRuns > 0 && fread(&_runs[0], sizeof(u_int32_t), _runs.size(), _file) != _runs.size()) throw Exception ("corrupted read cache file %s", _filename.c_str());
+		if(length > 0 && fread(&_packed[0], 1, _packed.size(), _file) != _packed.size()) throw Exception ("corrupted read cache file %s", _filename.c_str());
+
+		Data& data = this->_item->getData();
+		data.resize(length);
+		char* buffer = data.getBuffer();
+
+		for(u_int32_t i=0; i<length; i+=4){
+			u_int32_t nb = min((u_int32_t)4, length-i);
+			memcpy(buffer + i, _decoded[_packed[i/4]], nb);
+		}
+
+		for(u_int32_t r=0; r<nbRuns; r++){
+			if(_runs[2*r] + _runs[2*r+1] > length) throw Exception ("corrupted read cache file %s", _filename.c_str());
+			memset(buffer + _runs[2*r], 'N', _runs[2*r+1]);
+		}
+
+		data.setEncoding(Data::ASCII);
+		_isDone = false;
+	}
+
+	string _filename;
+	FILE* _file;
+	vector<char> _fileBuffer;
+	bool _isDone;
+
+	char _decoded[256][4];
+	vector<u_int32_t> _runs;
+	vector<u_int8_t> _packed;
+};
+
+
+/*
+ * Bank reading its reads from the input bank the first time it is iterated, and from the spill
+ * file the following times. The spill file is removed with the bank, unless it is kept by save().
+ * A bank created with isComplete reads an existing spill file and does not remove it.
+ */
+class SimkaReadCacheBank : public BankDelegate
+{
+public:
+
+	SimkaReadCacheBank(IBank* ref, const string& filename, bool isComplete=false) : BankDelegate(ref), _filename(filename), _isComplete(isComplete), _isTemporary(!isComplete)
+	{
+	}
+
+	~SimkaReadCacheBank(){
+		remove();
+	}
+
+	Iterator<Sequence>* iterator(){
+		if(_isComplete) return new SimkaReadCacheReadIterator(_filename);
+		return new SimkaReadCacheWriteIterator(_ref->iterator(), _filename, _isComplete);
+	}
+
+	void remove(){
+		if(_isComplete && _isTemporary) System::file().remove(_filename);
+		_isComplete = false;
+	}
+
+	//Keeps the spill file for other runs on the same reads
+	void save(const string& filename){
+		if(!_isComplete || !_isTemporary) return;
+		System::file().rename(_filename, filename);
+		_filename = filename;
+		_isTemporary = false;
+	}
+
+private:
+
+	string _filename;
+	bool _isComplete;
+	bool _isTemporary;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_SIMKAREADCACHE_HPP_ */
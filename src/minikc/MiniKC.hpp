@@ -9,6 +9,7 @@
 #define GATB_SIMKA_SRC_MINIKC_MINIKC_HPP_
 
 #include <gatb/gatb_core.hpp>
+#include "SimkaKmerFilter.hpp"
 //#include "../SimkaCount.cpp"
 
 //typedef u_int16_t CountType;
@@ -38,28 +39,33 @@ public:
 	};
 
     //SimkaCompressedProcessor(vector<BagGzFile<Count>* >& bags, vector<vector<Count> >& caches, vector<size_t>& cacheIndexes, CountNumber abundanceMin, CountNumber abundanceMax) : _bags(bags), _caches(caches), _cacheIndexes(cacheIndexes)
-    SimkaCompressedProcessor(vector<Bag<Kmer_BankId_Count>* >& bags, vector<u_int64_t>& nbKmerPerParts, vector<u_int64_t>& nbDistinctKmerPerParts, vector<u_int64_t>& chordPerParts, CountNumber abundanceMin, CountNumber abundanceMax, size_t bankIndex) :
-    	_bags(bags), _nbDistinctKmerPerParts(nbDistinctKmerPerParts), _nbKmerPerParts(nbKmerPerParts), _chordPerParts(chordPerParts)
+    SimkaCompressedProcessor(vector<Bag<Kmer_BankId_Count>* >& bags, vector<u_int64_t>& nbKmerPerParts, vector<u_int64_t>& nbDistinctKmerPerParts, vector<u_int64_t>& chordPerParts, CountNumber abundanceMin, CountNumber abundanceMax, size_t bankIndex, const SimkaKmerFilter<span>& kmerFilter, bool singletonFilter) :
+    	_bags(bags), _nbDistinctKmerPerParts(nbDistinctKmerPerParts), _nbKmerPerParts(nbKmerPerParts), _chordPerParts(chordPerParts), _kmerFilter(kmerFilter)
     {
     	_abundanceMin = abundanceMin;
     	_abundanceMax = abundanceMax;
     	_bankIndex = bankIndex;
+    	_singletonFilter = singletonFilter;
     }
 
 	~SimkaCompressedProcessor(){}
-    CountProcessorAbstract<span>* clone ()  {  return new SimkaCompressedProcessor (_bags, _nbKmerPerParts, _nbDistinctKmerPerParts, _chordPerParts, _abundanceMin, _abundanceMax, _bankIndex);  }
+    CountProcessorAbstract<span>* clone ()  {  return new SimkaCompressedProcessor (_bags, _nbKmerPerParts, _nbDistinctKmerPerParts, _chordPerParts, _abundanceMin, _abundanceMax, _bankIndex, _kmerFilter, _singletonFilter);  }
     //CountProcessorAbstract<span>* clone ()  {  return new SimkaCompressedProcessor (_bags, _caches, _cacheIndexes, _abundanceMin, _abundanceMax);  }
 	void finishClones (vector<ICountProcessor<span>*>& clones){}
 
 	bool process (size_t partId, const typename Kmer<span>::Type& kmer, const CountVector& count, CountNumber sum){
 
-		if(count[0] < _abundanceMin || count[0] > _abundanceMax) return false;
+		//The first occurrence of the kmers has been discarded by the singleton filter (see SimkaSingletonFilterIterator)
+		CountNumber abundance = _singletonFilter ? count[0] + 1 : count[0];
+
+		if(abundance < _abundanceMin || abundance > _abundanceMax) return false;
+		if(!_kmerFilter(kmer)) return false;
 
-		Kmer_BankId_Count item(kmer, _bankIndex, count[0]);
+		Kmer_BankId_Count item(kmer, _bankIndex, abundance);
 		_bags[partId]->insert(item);
 		_nbDistinctKmerPerParts[partId] += 1;
-		_nbKmerPerParts[partId] += count[0];
-		_chordPerParts[partId] += pow(count[0], 2);
+		_nbKmerPerParts[partId] += abundance;
+		_chordPerParts[partId] += pow(abundance, 2);
 
 		/*
 		size_t index = _cacheIndexes[partId];
@@ -86,6 +92,8 @@ public:
 	CountNumber _abundanceMin;
 	CountNumber _abundanceMax;
 	size_t _bankIndex;
+	SimkaKmerFilter<span> _kmerFilter;
+	bool _singletonFilter;
 	//_stats->_chord_N2[i] += pow(abundanceI, 2);
 	//vector<vector<Count> >& _caches;
 	//vector<size_t>& _cacheIndexes;
@@ -26,6 +26,7 @@
 
 #include "SimkaMinCommons.hpp"
 #include "SimkaCommons.hpp"
+#include "SimkaInputReader.hpp"
 #include "MurmurHash3.h"
 #include <mutex>
 //#include "../../thirdparty/KMC/kmc_api/kmc_file.h"
@@ -705,7 +706,7 @@ public:
 		createDirs();
 
 		cout << endl << "Checking input file validity..." << endl;
-		SimkaCommons::checkInputValidity(_outputDirTemp, _inputFilename, _progress_nbDatasetsToProcess);
+		SimkaCommons::checkInputValidity(_outputDirTemp, _inputFilename, _progress_nbDatasetsToProcess, _nbCores);
 
 		_progress = this->createIteratorListener (_progress_nbDatasetsToProcess, ""); //new ProgressSynchro (
 			//this->createIteratorListener (_progress_nbDatasetsToProcess, ""),
@@ -1120,7 +1121,8 @@ public:
 		//cout << "start: " << inputFilename << endl;
 		//countKmersMutex.unlock();
 
-		IBank* bank = Bank::open(inputFilename);
+		//Several datasets are processed in parallel, one decoder thread per dataset
+		IBank* bank = new SimkaBankFastx(inputFilename, 1);
 		LOCAL(bank);
 
 		SimkaSequenceFilter sequenceFilter(_minReadSize, _minReadShannonIndex);
@@ -67,8 +67,9 @@ def __test_matrices(simka_vs_truth, result_dir, truth_dir):
 	return ok
 
 
-def test_dists(dir):
-	if(__test_matrices(True, "__results__/" + dir, "truth/" + dir)):
+def test_dists(dir, truth_dir=None):
+	if truth_dir is None: truth_dir = dir
+	if(__test_matrices(True, "__results__/" + dir, "truth/" + truth_dir)):
 		print("\tOK")
 	else:
 		print("\tFAILED")
@@ -120,6 +121,56 @@ print(command)
 os.system(command + suffix)
 test_dists("results_k21_t2")
 
+#test several kmer sizes: the results of each size are in their own sub dir
+clear()
+print("TESTING kmer sizes 21,31 t=0")
+command = "../build/bin/simka -in ../example/simka_input.txt -out ./__results__/results_k21_k31_t0 -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 21,31 -abundance-min 0 -verbose 0"
+print(command)
+os.system(command + suffix)
+test_dists("results_k21_k31_t0/k21", "results_k21_t0")
+test_dists("results_k21_k31_t0/k31", "results_k31_t0")
+
+#test intermediate merges: the 5 count files of a partition are merged 2 at a time
+clear()
+print("TESTING intermediate merges")
+command = "../build/bin/simka -in ../example/simka_input.txt -out ./__results__/results_k31_t0 -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 31 -abundance-min 0 -max-merge-fan-in 2 -verbose 0"
+print(command)
+os.system(command + suffix)
+test_dists("results_k31_t0")
+
+#test update: A, B and C are counted first, D and E are added to their results
+clear()
+print("TESTING update")
+inputFile = open("__results__/simka_input_ABC.txt", "w")
+inputFile.write("A: ../../example/A.fasta\nB: ../../example/B.fasta\nC: ../../example/C.fasta\n")
+inputFile.close()
+inputFile = open("__results__/simka_input_DE.txt", "w")
+inputFile.write("D: ../../example/D_paired_1.fasta ; ../../example/D_paired_2.fasta\nE: ../../example/A.fasta , ../../example/A.fasta ; ../../example/B.fasta , ../../example/B.fasta\n")
+inputFile.close()
+command = "../build/bin/simka -in ./__results__/simka_input_ABC.txt -out ./__results__/results_k31_t0 -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 31 -abundance-min 0 -keep-tmp -verbose 0"
+print(command)
+os.system(command + suffix)
+command = "../build/bin/simka -in ./__results__/simka_input_DE.txt -out ./__results__/results_k31_t0 -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 31 -abundance-min 0 -update -verbose 0"
+print(command)
+os.system(command + suffix)
+test_dists("results_k31_t0")
+
+#test count cache: the second run reuses the count files of every dataset of the first run
+clear()
+print("TESTING count cache")
+command = "../build/bin/simka -in ../example/simka_input.txt -out ./__results__/results_k31_t0 -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 31 -abundance-min 0 -fixed-partitions 16 -count-cache ./__results__/count_cache -verbose 0"
+print(command)
+os.system(command + suffix)
+shutil.rmtree("temp_output")
+shutil.rmtree("__results__/results_k31_t0")
+output = os.popen(command + " 2>&1").read()
+nbCacheHits = output.count("found in count cache")
+if nbCacheHits != 5:
+	print("\t- TEST ERROR:    " + str(nbCacheHits) + " datasets found in count cache instead of 5")
+	print("\tFAILED")
+	sys.exit(1)
+test_dists("results_k31_t0")
+
 #test resources 1
 clear()
 print("TESTING parallelization")